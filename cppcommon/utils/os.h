@@ -19,27 +19,25 @@ namespace cppcommon {
  */
 std::string GetEnv(const std::string &key, const std::string &dft);
 
-inline std::string GetDatedFilePath(int64_t ts_ms, const std::string &filename, const std::string &prefix,
-                                    int timezone_offset = 0, bool year = true, bool month = true, bool day = true,
-                                    bool hour = true) {
-  auto di = GetDateInfo(ts_ms, timezone_offset);
+inline std::string GetDatedFilePath(const std::tm &tm, const std::string &filename, const std::string &prefix,
+                                    bool year = true, bool month = true, bool day = true, bool hour = true) {
   std::stringstream ss;
   ss << prefix << "/";
   if (year) {
-    ss << di.GetHumanYear() << "/";
+    ss << 1900 + tm.tm_year << "/";
   }
   if (month) {
-    auto v = di.GetHumanMonth();
+    auto v = tm.tm_mon + 1;
     if (v < 10) ss << "0";
     ss << v << "/";
   }
   if (day) {
-    auto v = di.GetMonthDay();
+    auto v = tm.tm_mday;
     if (v < 10) ss << "0";
     ss << v << "/";
   }
   if (hour) {
-    auto v = di.GetHour();
+    auto v = tm.tm_hour;
     if (v < 10) ss << "0";
     ss << v << "/";
   }
@@ -47,9 +45,20 @@ inline std::string GetDatedFilePath(int64_t ts_ms, const std::string &filename,
   return ss.str();
 }
 
+inline std::string GetDatedFilePath(int64_t ts_ms, const std::string &filename, const std::string &prefix,
+                                    int timezone_offset = 0, bool year = true, bool month = true, bool day = true,
+                                    bool hour = true) {
+  auto di = GetDateInfo(ts_ms, timezone_offset);
+  return GetDatedFilePath(*di.tm, filename, prefix, year, month, day, hour);
+}
+
+// current time from CoarseClock
 inline std::string GetDatedFilePath(const std::string &filename, const std::string &prefix, int timezone_offset = 0,
                                     bool year = true, bool month = true, bool day = true, bool hour = true) {
-  return GetDatedFilePath(CurrentTsMs(), filename, prefix, timezone_offset, year, month, day, hour);
+  if (timezone_offset == 0) {
+    return GetDatedFilePath(CoarseClock::Instance().Date()->tm, filename, prefix, year, month, day, hour);
+  }
+  return GetDatedFilePath(CoarseClock::Instance().NowMs(), filename, prefix, timezone_offset, year, month, day, hour);
 }
 
 template <typename S>
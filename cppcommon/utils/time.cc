@@ -1,5 +1,6 @@
 #include "cppcommon/utils/time.h"
 
+#include <algorithm>
 #include <memory>
 #include <utility>
 
@@ -21,4 +22,57 @@ DateInfo::DateInfo(int64_t timestamp_ms, int timezone_offset) {
 }
 
 DateInfo::DateInfo(std::shared_ptr<std::tm> ttm) : tm(std::move(ttm)) {}
+
+CoarseClock::CoarseClock(std::chrono::milliseconds resolution)
+    : resolution_ms_(std::max<int64_t>(1, resolution.count())) {
+  Update();
+  thread_ = std::thread(&CoarseClock::Run, this);
+}
+
+CoarseClock::~CoarseClock() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    running_ = false;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+CoarseClock& CoarseClock::Instance() {
+  static auto* clock = new CoarseClock();
+  return *clock;
+}
+
+void CoarseClock::SetResolution(std::chrono::milliseconds resolution) {
+  resolution_ms_ = std::max<int64_t>(1, resolution.count());
+  cv_.notify_all();
+}
+
+void CoarseClock::Update() {
+  auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  now_ms_.store(now_ms, std::memory_order_relaxed);
+  auto second = now_ms / 1000;
+  auto date = date_.load(std::memory_order_relaxed);
+  if (date && date->second == second) return;
+
+  auto next = std::make_shared<CoarseDate>();
+  next->second = second;
+  auto t = static_cast<std::time_t>(second);
+  gmtime_r(&t, &next->tm);
+  char buf[32];
+  next->second_str.assign(buf, std::strftime(buf, sizeof(buf), "%Y%m%d_%H%M%S", &next->tm));
+  next->hour_str.assign(buf, std::strftime(buf, sizeof(buf), "%Y%m%d%H", &next->tm));
+  next->day_str.assign(buf, std::strftime(buf, sizeof(buf), "%Y%m%d", &next->tm));
+  date_.store(std::move(next), std::memory_order_release);
+}
+
+void CoarseClock::Run() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (running_) {
+    cv_.wait_for(lock, Resolution());
+    Update();
+  }
+}
 }  // namespace cppcommon
@@ -5,14 +5,18 @@
  * @date 2025-04-27 14:40:48
  */
 #pragma once
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <ctime>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 namespace cppcommon {
 using days = std::chrono::duration<int, std::ratio<86400>>;
@@ -105,4 +109,48 @@ inline DateInfo GetDateInfo(int64_t timestamp_ms = -1, int timezone_offset = 0)
 /// @brief get the day of the week, from 0 to 6
 ///   default timezone is utc 0 zone
 int GetWeekDay(int64_t timestamp_ms = -1, int timezone_offset = 0);
+
+// current second in utc 0 zone, formatted once per second by CoarseClock
+struct CoarseDate {
+  int64_t second{0};  // since epoch
+  std::tm tm{};
+  std::string second_str;  // %Y%m%d_%H%M%S
+  std::string hour_str;    // %Y%m%d%H
+  std::string day_str;     // %Y%m%d
+};
+
+/**
+ * Wall clock refreshed by a background thread every resolution, for hot paths that can live with a coarse time.
+ * usage:
+ *   auto ts_ms = CoarseClock::Instance().NowMs();  // one relaxed atomic load
+ *   auto date = CoarseClock::Instance().Date();    // date->second_str, e.g. 20250618_140625
+ */
+class CoarseClock {
+ public:
+  explicit CoarseClock(std::chrono::milliseconds resolution = std::chrono::milliseconds(1));
+  ~CoarseClock();
+  CoarseClock(const CoarseClock&) = delete;
+  CoarseClock& operator=(const CoarseClock&) = delete;
+
+  // shared clock with 1ms resolution, never destroyed so that it is usable until the process exits
+  static CoarseClock& Instance();
+
+  inline int64_t NowMs() const { return now_ms_.load(std::memory_order_relaxed); }
+  inline std::shared_ptr<const CoarseDate> Date() const { return date_.load(std::memory_order_acquire); }
+  inline std::chrono::milliseconds Resolution() const { return std::chrono::milliseconds(resolution_ms_.load()); }
+  void SetResolution(std::chrono::milliseconds resolution);
+
+ private:
+  void Update();
+  void Run();
+
+ private:
+  std::atomic<int64_t> now_ms_{0};
+  std::atomic<std::shared_ptr<const CoarseDate>> date_;
+  std::atomic<int64_t> resolution_ms_;
+  bool running_{true};
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
 }  // namespace cppcommon
@@ -5,8 +5,16 @@
  * @date 2025-05-29 16:07:26
  */
 #pragma once
+#include "cppcommon/objectstorage/sink/arrow_row_sink.h"
 #include "cppcommon/objectstorage/sink/base_sink.h"
 #include "cppcommon/objectstorage/sink/local_arrow_sink.h"
 #include "cppcommon/objectstorage/sink/local_text_sink.h"
+#include "cppcommon/objectstorage/sink/parquet_compactor.h"
+#include "cppcommon/objectstorage/sink/partitioned_sink.h"
+#include "cppcommon/objectstorage/sink/post_roll.h"
+#include "cppcommon/objectstorage/sink/replay_reader.h"
+#include "cppcommon/objectstorage/sink/sink_executor.h"
+#include "cppcommon/objectstorage/sink/sink_metrics.h"
+#include "cppcommon/objectstorage/sink/tee_sink.h"
 
 namespace cppcommon::os {}
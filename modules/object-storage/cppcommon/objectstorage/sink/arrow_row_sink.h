@@ -0,0 +1,302 @@
+/**
+ * @file arrow_row_sink.h
+ * @brief sink of plain structs, rows are appended into column builders and written as arrow record batches
+ * @author zhenkai.sun
+ * @date 2025-06-19 11:27:43
+ */
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/array/concatenate.h>
+#include <arrow/type_traits.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/local_arrow_sink.h"
+
+namespace cppcommon::os {
+// column of a struct member
+template <typename Struct, typename Member>
+struct ArrowField {
+  const char *name;
+  Member Struct::*member;
+};
+
+/**
+ * Specialize it to describe the columns of a row type.
+ * usage:
+ *   struct Trade {
+ *     std::string symbol;
+ *     double price;
+ *     std::optional<int64_t> qty;  // nullable
+ *   };
+ *   template <>
+ *   struct ArrowRowSchema<Trade> {
+ *     static constexpr auto kFields = std::make_tuple(ArrowField{"symbol", &Trade::symbol},
+ *                                                     ArrowField{"price", &Trade::price},
+ *                                                     ArrowField{"qty", &Trade::qty});
+ *   };
+ */
+template <typename Row>
+struct ArrowRowSchema;
+
+// member type to arrow type and builder, arithmetic types and std::string by arrow::CTypeTraits
+template <typename T>
+struct ArrowColumnTraits {
+  using ArrowType = typename arrow::CTypeTraits<T>::ArrowType;
+  using BuilderType = typename arrow::TypeTraits<ArrowType>::BuilderType;
+  static constexpr bool kNullable = false;
+  static inline std::shared_ptr<arrow::DataType> Type() { return arrow::TypeTraits<ArrowType>::type_singleton(); }
+  static inline arrow::Status Append(BuilderType &builder, const T &value) { return builder.Append(value); }
+};
+
+template <>
+struct ArrowColumnTraits<std::string_view> : ArrowColumnTraits<std::string> {
+  static inline arrow::Status Append(BuilderType &builder, std::string_view value) { return builder.Append(value); }
+};
+
+template <typename T>
+struct ArrowColumnTraits<std::optional<T>> : ArrowColumnTraits<T> {
+  using Base = ArrowColumnTraits<T>;
+  static constexpr bool kNullable = true;
+  static inline arrow::Status Append(typename Base::BuilderType &builder, const std::optional<T> &value) {
+    return value ? Base::Append(builder, *value) : builder.AppendNull();
+  }
+};
+
+template <typename Fields>
+struct ArrowBuildersOf;
+
+template <typename... Struct, typename... Member>
+struct ArrowBuildersOf<std::tuple<ArrowField<Struct, Member>...>> {
+  using type = std::tuple<typename ArrowColumnTraits<Member>::BuilderType...>;
+};
+
+/**
+ * Typed column builders of a row type, values are appended column by column without virtual dispatch.
+ * A row failing at some column is dropped, the rows before it are kept. Not thread safe.
+ */
+template <typename Row>
+class ArrowRowBatchBuilder {
+ public:
+  static constexpr auto &kFields = ArrowRowSchema<Row>::kFields;
+  using Fields = std::remove_cvref_t<decltype(ArrowRowSchema<Row>::kFields)>;
+  using Builders = typename ArrowBuildersOf<Fields>::type;
+  static constexpr size_t kColumns = std::tuple_size_v<Fields>;
+
+  static const std::shared_ptr<arrow::Schema> &Schema() {
+    static const auto schema = MakeSchema(std::make_index_sequence<kColumns>{});
+    return schema;
+  }
+
+  arrow::Status Append(const Row &row) {
+    auto s = AppendColumns(row, std::make_index_sequence<kColumns>{});
+    if (s.ok()) {
+      ++rows_;
+      return s;
+    }
+    // builders can not remove the values appended to the columns before the failed one, so the built rows are
+    // moved into pending_ without them
+    std::vector<std::shared_ptr<arrow::Array>> arrays(kColumns);
+    auto rows = rows_;
+    auto fs = FinishArrays(arrays);
+    if (fs.ok()) {
+      pending_ = std::move(arrays);
+      rows_ = rows;
+    } else {
+      spdlog::error("[ArrowRowBatchBuilder] finish columns failed, rows are dropped. [rows={}, error={}]", rows,
+                    fs.ToString());
+    }
+    return s;
+  }
+
+  inline int64_t NumRows() const { return rows_; }
+
+  arrow::Status Reserve(int64_t rows) {
+    return std::apply(
+        [rows](auto &...builders) {
+          arrow::Status s;
+          ((s.ok() ? (s = builders.Reserve(rows), 0) : 0), ...);
+          return s;
+        },
+        builders_);
+  }
+
+  // the builders are reset and reusable
+  arrow::Result<std::shared_ptr<arrow::RecordBatch>> Finish() {
+    std::vector<std::shared_ptr<arrow::Array>> arrays(kColumns);
+    auto rows = rows_;
+    ARROW_RETURN_NOT_OK(FinishArrays(arrays));
+    return arrow::RecordBatch::Make(Schema(), rows, std::move(arrays));
+  }
+
+ private:
+  template <size_t... I>
+  static std::shared_ptr<arrow::Schema> MakeSchema(std::index_sequence<I...>) {
+    return arrow::schema({MakeField(std::get<I>(kFields))...});
+  }
+
+  template <typename Struct, typename Member>
+  static std::shared_ptr<arrow::Field> MakeField(const ArrowField<Struct, Member> &field) {
+    using Traits = ArrowColumnTraits<Member>;
+    return arrow::field(field.name, Traits::Type(), Traits::kNullable);
+  }
+
+  template <size_t... I>
+  arrow::Status AppendColumns(const Row &row, std::index_sequence<I...>) {
+    arrow::Status s;
+    ((s.ok() ? (s = AppendColumn<I>(row), 0) : 0), ...);
+    return s;
+  }
+
+  template <size_t I>
+  inline arrow::Status AppendColumn(const Row &row) {
+    auto &field = std::get<I>(kFields);
+    using Member = std::remove_cvref_t<decltype(row.*(field.member))>;
+    return ArrowColumnTraits<Member>::Append(std::get<I>(builders_), row.*(field.member));
+  }
+
+  template <size_t... I>
+  arrow::Status FinishColumns(std::vector<std::shared_ptr<arrow::Array>> &arrays, std::index_sequence<I...>) {
+    arrow::Status s;
+    ((s.ok() ? (s = std::get<I>(builders_).Finish(&arrays[I]), 0) : 0), ...);
+    return s;
+  }
+
+  // arrays of the rows_ rows, pending ones first. the builders are reset and rows_ is 0, even on failure
+  arrow::Status FinishArrays(std::vector<std::shared_ptr<arrow::Array>> &arrays) {
+    auto pending = std::exchange(pending_, {});
+    auto built = rows_ - (pending.empty() ? 0 : pending.front()->length());
+    rows_ = 0;
+    auto s = FinishColumns(arrays, std::make_index_sequence<kColumns>{});
+    if (!s.ok()) {
+      std::apply([](auto &...builders) { (builders.Reset(), ...); }, builders_);
+      return s;
+    }
+    for (size_t i = 0; i < kColumns; ++i) {
+      // columns before a failed append hold a value of the dropped row
+      if (arrays[i]->length() > built) arrays[i] = arrays[i]->Slice(0, built);
+      if (!pending.empty()) {
+        ARROW_ASSIGN_OR_RAISE(arrays[i], arrow::Concatenate({pending[i], arrays[i]}));
+      }
+    }
+    return arrow::Status::OK();
+  }
+
+ private:
+  Builders builders_;
+  int64_t rows_{0};
+  std::vector<std::shared_ptr<arrow::Array>> pending_;  // rows built before a failed append
+};
+
+struct ArrowRowSinkOptions {
+  int64_t batch_rows{8192};  // rows of each record batch handed to the sink
+  size_t stripes{0};  // builders selected by thread id, 0: hardware concurrency
+};
+
+/**
+ * Producers append rows into column builders picked by thread id, full builders are turned into record batches of
+ * batch_rows rows and written into the inner record batch sink.
+ * usage:
+ *   ArrowRowSink<Trade> sink({.name = "trade", .name_options{.suffix = "parquet"}});
+ *   sink.Write(Trade{"AAPL", 1.0, 100});
+ */
+template <typename Row, typename Sink = LocalArrowRecordBatchSinkV1>
+class ArrowRowSink {
+ public:
+  using Options = typename Sink::Options;
+  using Builder = ArrowRowBatchBuilder<Row>;
+
+  explicit ArrowRowSink(Options &&options, ArrowRowSinkOptions row_options = {})
+      : row_options_(row_options), sink_(std::move(options)) {
+    auto stripes = row_options_.stripes ? row_options_.stripes : std::max(1u, std::thread::hardware_concurrency());
+    row_options_.batch_rows = std::max<int64_t>(1, row_options_.batch_rows);
+    stripes_.reserve(stripes);
+    for (size_t i = 0; i < stripes; ++i) {
+      stripes_.emplace_back(std::make_unique<Stripe>());
+    }
+  }
+
+  ~ArrowRowSink() { Close(); }
+
+  static const std::shared_ptr<arrow::Schema> &Schema() { return Builder::Schema(); }
+
+  WriteStatus Write(const Row &row) {
+    if (closed_) return WriteStatus::STOPPED;
+    auto &stripe = *stripes_[std::hash<std::thread::id>{}(std::this_thread::get_id()) % stripes_.size()];
+    std::shared_ptr<arrow::RecordBatch> batch;
+    {
+      std::lock_guard lock(stripe.mtx);
+      if (stripe.builder.NumRows() == 0) {
+        auto s = stripe.builder.Reserve(row_options_.batch_rows);
+        if (!s.ok()) spdlog::warn("[ArrowRowSink] reserve builders failed. [error={}]", s.ToString());
+      }
+      auto s = stripe.builder.Append(row);
+      if (!s.ok()) {
+        spdlog::error("[ArrowRowSink] append row failed. [error={}]", s.ToString());
+        return WriteStatus::DROPPED;
+      }
+      if (stripe.builder.NumRows() < row_options_.batch_rows) return WriteStatus::OK;
+      batch = FinishBatch(stripe.builder);
+    }
+    return batch ? sink_.Write(std::move(batch)) : WriteStatus::DROPPED;
+  }
+
+  // hand the partial batches to the inner sink
+  void Flush() {
+    for (auto &stripe : stripes_) {
+      std::shared_ptr<arrow::RecordBatch> batch;
+      {
+        std::lock_guard lock(stripe->mtx);
+        if (stripe->builder.NumRows() == 0) continue;
+        batch = FinishBatch(stripe->builder);
+      }
+      if (batch) sink_.Write(std::move(batch));
+    }
+  }
+
+  void Close() {
+    if (closed_.exchange(true)) return;
+    Flush();
+    sink_.Close();
+  }
+
+  inline Sink &Inner() { return sink_; }
+
+ private:
+  struct Stripe {
+    std::mutex mtx;
+    Builder builder;
+  };
+
+  static std::shared_ptr<arrow::RecordBatch> FinishBatch(Builder &builder) {
+    auto batch = builder.Finish();
+    if (!batch.ok()) {
+      spdlog::error("[ArrowRowSink] finish record batch failed. [error={}]", batch.status().ToString());
+      return nullptr;
+    }
+    return std::move(batch).ValueOrDie();
+  }
+
+ private:
+  ArrowRowSinkOptions row_options_;
+  std::atomic<bool> closed_{false};
+  std::vector<std::unique_ptr<Stripe>> stripes_;
+  Sink sink_;
+};
+}  // namespace cppcommon::os
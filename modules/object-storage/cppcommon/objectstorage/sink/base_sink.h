@@ -9,21 +9,38 @@
 #include <fmt/format.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <ostream>
-#include <queue>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "concurrentqueue/blockingconcurrentqueue.h"
+#include "cppcommon/objectstorage/sink/compression.h"
+#include "cppcommon/objectstorage/sink/output_file.h"
+#include "cppcommon/objectstorage/sink/post_roll.h"
+#include "cppcommon/objectstorage/sink/sink_executor.h"
+#include "cppcommon/objectstorage/sink/sink_metrics.h"
+#include "cppcommon/objectstorage/sink/spill_file.h"
 #include "cppcommon/utils/time.h"
 #include "spdlog/spdlog.h"
 
@@ -32,12 +49,33 @@ namespace cppcommon::os {
 template <typename Record>
 class SinkFileSystem {
  public:
+  using RecordType = Record;
+  // Sync can succeed, DurabilityMode other than NONE is rejected by BaseSink otherwise
+  static constexpr bool kSyncSupported = false;
+
   virtual void Open(const std::string &filepath) = 0;
   // @return number of writted lines
   virtual int Write(Record &&record) = 0;
+  // @return number of writted lines, override it if records can be written in one shot
+  virtual int WriteBatch(std::span<Record> records) {
+    int rows = 0;
+    for (auto &record : records) {
+      rows += Write(std::move(record));
+    }
+    return rows;
+  }
   virtual bool IsOpen() = 0;
+  // formatted bytes since Open, before compression, @return 0 if it is not counted
+  virtual uint64_t BytesWritten() const { return 0; }
+  // rows written since Open but lost, e.g. in blocks which failed to compress, complete once it is closed
+  virtual uint64_t DroppedRows() const { return 0; }
   virtual void Close() {}
   virtual void Flush() {}
+  // flush and fdatasync, @return false if it failed or is not supported
+  virtual bool Sync() {
+    Flush();
+    return false;
+  }
   inline static bool IsExists(const std::string &filepath) { return std::filesystem::exists(filepath); }
   virtual ~SinkFileSystem() {
     Flush();
@@ -46,6 +84,13 @@ class SinkFileSystem {
   inline operator bool() { return IsOpen(); }
 };
 
+// final, so calls through it are resolved at compile time, see StaticSink
+template <typename FS>
+class StaticSinkFileSystem final : public FS {
+ public:
+  using FS::FS;
+};
+
 enum class RollPeriod {
   UNSPECIFIED,
   SECONDLY = 1000,
@@ -72,7 +117,7 @@ struct TimeRollPolicy {
 
   inline bool IsRoll() {
     if (period == RollPeriod::UNSPECIFIED) return false;
-    auto cur = cppcommon::CurrentTsMs();
+    auto cur = cppcommon::CoarseClock::Instance().NowMs();
     if (last_rolling_ts_ms < 0) {
       last_rolling_ts_ms = cur - cur % static_cast<int64_t>(period);
       return false;
@@ -85,7 +130,7 @@ struct TimeRollPolicy {
 
   inline void Roll() {
     if (period != RollPeriod::UNSPECIFIED) {
-      auto cur = cppcommon::CurrentTsMs();
+      auto cur = cppcommon::CoarseClock::Instance().NowMs();
       if (last_rolling_ts_ms < 0) {
         last_rolling_ts_ms = cur - cur % static_cast<int64_t>(period);
       } else if (cur - last_rolling_ts_ms > static_cast<int64_t>(period)) {
@@ -105,10 +150,144 @@ struct TimeRollPolicy {
 
 using OnRollFileCallback = std::function<void(std::string, const TimeRollPolicy &time_roll_policy)>;
 
-inline std::string GetDateFileName() {
-  auto di = cppcommon::DateInfo(cppcommon::CurrentTsMs());
-  return di.Format("%Y%m%d_%H%M%S");
-}
+inline std::string GetDateFileName() { return cppcommon::CoarseClock::Instance().Date()->second_str; }
+
+// NOTE: ROUND_ROBIN: spread records over shards evenly; KEY_HASH: records with the same key go to the same shard
+enum class ShardRouting { ROUND_ROBIN, KEY_HASH };
+
+// NOTE: what to do when a bounded queue is full
+//  BLOCK: wait for free space until block_timeout, the record is dropped on timeout
+//  DROP_NEWEST: drop the incoming record
+//  DROP_OLDEST: drop queued records (oldest of some producer) to make room
+//  SAMPLE: keep 1 of every sample_rate incoming records, up to twice the capacity
+//  SPILL: append records to a local spill file, the writer drains it in FIFO order once it catches up
+enum class OverflowPolicy { BLOCK, DROP_NEWEST, DROP_OLDEST, SAMPLE, SPILL };
+enum class QueueCapacityUnit { RECORDS, BYTES };
+
+// NOTE: SYNC_FAILED: returned by WriteDurable, the record is written but fdatasync failed
+enum class WriteStatus { OK, DROPPED, TIMEOUT, STOPPED, SYNC_FAILED };
+
+// NOTE: when the writer calls fdatasync on the current file, records of WriteDurable are always synced
+//  NONE: only for WriteDurable
+//  INTERVAL: every interval if anything is written
+//  BYTES: every bytes written (approximated by RecordByteSize)
+//  GROUP_COMMIT: only for WriteDurable like NONE, plus rolled files are synced before closing
+enum class DurabilityMode { NONE, INTERVAL, BYTES, GROUP_COMMIT };
+
+// approximate memory cost of a record, used by queues bounded in bytes
+template <typename Record>
+struct RecordByteSize {
+  inline size_t operator()(const Record &) const { return sizeof(Record); }
+};
+
+template <>
+struct RecordByteSize<std::string> {
+  inline size_t operator()(const std::string &record) const { return sizeof(std::string) + record.size(); }
+};
+
+struct SinkQueueOptions {
+  size_t capacity{0};  // 0: unbounded, otherwise the limit of each shard
+  QueueCapacityUnit unit{QueueCapacityUnit::RECORDS};
+  OverflowPolicy policy{OverflowPolicy::BLOCK};
+  std::chrono::milliseconds block_timeout{100};
+  int sample_rate{10};
+};
+
+/**
+ * Accounting of a queue bounded by SinkQueueOptions, in units of SinkQueueOptions::unit. Producers reserve the cost of
+ * a record before enqueueing it and the writer releases it once the record is dequeued.
+ */
+struct QueueBudget {
+  std::atomic<int64_t> queued{0};
+  std::atomic<uint64_t> sample_seq{0};
+  std::atomic<int> waiters{0};
+  std::mutex space_mtx;
+  std::condition_variable space_cv;
+  struct {
+    std::atomic<uint64_t> newest{0};
+    std::atomic<uint64_t> oldest{0};
+    std::atomic<uint64_t> sampled{0};
+    std::atomic<uint64_t> timeout{0};
+    std::atomic<uint64_t> spill{0};
+  } drops;
+
+  inline bool TryReserve(int64_t cost, int64_t limit) {
+    auto cur = queued.load();
+    do {
+      // an empty queue always accepts one record, even if it is larger than the limit
+      if (cur > 0 && cur + cost > limit) return false;
+    } while (!queued.compare_exchange_weak(cur, cur + cost));
+    return true;
+  }
+
+  // false on block_timeout, or once stopped
+  bool WaitReserve(const SinkQueueOptions &qo, int64_t cost, const std::atomic<bool> &stopped) {
+    auto capacity = static_cast<int64_t>(qo.capacity);
+    std::unique_lock lock(space_mtx);
+    ++waiters;
+    bool reserved = false;
+    space_cv.wait_for(lock, qo.block_timeout, [&] { return stopped || (reserved = TryReserve(cost, capacity)); });
+    --waiters;
+    return reserved;
+  }
+
+  /**
+   * Applies the overflow policy to a record which does not fit, SPILL is left to the caller.
+   * @param drop_oldest called with cost by DROP_OLDEST, drops queued records until cost is reserved
+   * @return OK once cost is reserved
+   */
+  template <typename DropOldest>
+  WriteStatus Overflow(const SinkQueueOptions &qo, int64_t cost, const std::atomic<bool> &stopped,
+                       DropOldest &&drop_oldest) {
+    switch (qo.policy) {
+      case OverflowPolicy::BLOCK:
+        if (WaitReserve(qo, cost, stopped)) return WriteStatus::OK;
+        if (stopped) return WriteStatus::STOPPED;
+        drops.timeout.fetch_add(1, std::memory_order_relaxed);
+        return WriteStatus::TIMEOUT;
+      case OverflowPolicy::DROP_NEWEST:
+        drops.newest.fetch_add(1, std::memory_order_relaxed);
+        return WriteStatus::DROPPED;
+      case OverflowPolicy::DROP_OLDEST:
+        drop_oldest(cost);
+        return WriteStatus::OK;
+      case OverflowPolicy::SAMPLE:
+        if (sample_seq.fetch_add(1, std::memory_order_relaxed) % qo.sample_rate != 0 ||
+            !TryReserve(cost, static_cast<int64_t>(qo.capacity) * 2)) {
+          drops.sampled.fetch_add(1, std::memory_order_relaxed);
+          return WriteStatus::DROPPED;
+        }
+        return WriteStatus::OK;
+      case OverflowPolicy::SPILL:
+        break;
+    }
+    drops.spill.fetch_add(1, std::memory_order_relaxed);
+    return WriteStatus::DROPPED;
+  }
+
+  // called by the writer with the cost of dequeued records
+  inline void Release(int64_t cost) {
+    queued -= cost;
+    if (waiters > 0) {
+      std::lock_guard lock(space_mtx);
+      space_cv.notify_all();
+    }
+  }
+
+  // wakes producers blocked by BLOCK, e.g. on close
+  inline void WakeAll() {
+    std::lock_guard lock(space_mtx);
+    space_cv.notify_all();
+  }
+
+  inline void AddDrops(SinkDropStats &stats) const {
+    stats.dropped_newest += drops.newest.load(std::memory_order_relaxed);
+    stats.dropped_oldest += drops.oldest.load(std::memory_order_relaxed);
+    stats.dropped_sampled += drops.sampled.load(std::memory_order_relaxed);
+    stats.dropped_timeout += drops.timeout.load(std::memory_order_relaxed);
+    stats.dropped_spill += drops.spill.load(std::memory_order_relaxed);
+  }
+};
 
 template <typename Record, typename FS = SinkFileSystem<Record>, typename OfsOptions = void>
 class BaseSink {
@@ -123,8 +302,31 @@ class BaseSink {
   struct RollOptions {
     bool is_rotate{true};
     int64_t max_rows_per_file{1000000};
-    int max_backup_files{-1};  // -1: unlimited
+    int max_backup_files{-1};  // -1: unlimited, counted over all shards
     TimeRollPolicy time_roll_policy;
+    // 0: unlimited, counted by SinkFileSystem::BytesWritten, so it is ignored by files which do not count
+    int64_t max_bytes_per_file{0};
+  };
+
+  // each shard owns a writer thread, a queue and a file sequence (name_shard{id}_<date>_<idx>.<suffix>)
+  struct ShardOptions {
+    int shards{1};
+    ShardRouting routing{ShardRouting::ROUND_ROBIN};
+    std::function<size_t(const Record &)> key_func{};  // required by KEY_HASH
+  };
+
+  using QueueOptions = SinkQueueOptions;
+
+  // used by OverflowPolicy::SPILL, spill files are {dir}/{name}[_shard{id}].spill
+  struct SpillOptions {
+    std::string dir{""};  // empty: same as Options::path
+    int64_t max_bytes{1LL << 30};  // per shard, records are dropped beyond it
+  };
+
+  struct DurabilityOptions {
+    DurabilityMode mode{DurabilityMode::NONE};
+    std::chrono::milliseconds interval{1000};  // INTERVAL
+    size_t bytes{64 * 1024 * 1024};  // BYTES
   };
 
   struct Options {
@@ -132,15 +334,22 @@ class BaseSink {
     std::string path{""};
     FileNameOptions name_options;
     RollOptions roll_options;
-    OnRollFileCallback on_roll_callback{};  // callling with last filepath when rolling file
+    OnRollFileCallback on_roll_callback{};  // callling with last filepath when rolling file, after post roll steps
+    // close and run post roll steps on PostRollOptions::pool, retries of failed steps are run there either way
     bool close_in_threads{true};
     [[no_unique_address]] std::conditional_t<std::is_void_v<OfsOptions>, int, OfsOptions> ofs_options;
+    ShardOptions shard_options;
+    size_t write_batch_size{256};  // max records dequeued and written at once
+    QueueOptions queue_options;
+    SpillOptions spill_options;
+    DurabilityOptions durability_options;
+    PostRollOptions post_roll;
+    SinkExecutorOptions executor;  // shards are written by a shared SinkExecutor instead of their own threads
   };
 
   struct State {
     int file_index{0};
     std::atomic<int64_t> current_row_nums{0};
-    bool stopped_{false};
 
     inline void Roll() {
       ++file_index;
@@ -148,51 +357,538 @@ class BaseSink {
     }
   };
 
+  struct DurableWaiter {
+    bool done{false};
+    bool ok{false};
+  };
+
+  // a final FS is called without virtual dispatch and kept inside the shard, reconstructed in place on roll
+  static constexpr bool kStaticDispatch = std::is_final_v<FS>;
+  using OfsHolder = std::conditional_t<kStaticDispatch, std::optional<FS>, std::shared_ptr<FS>>;
+
+  struct Shard {
+    int id{0};
+    State state{};
+    TimeRollPolicy time_roll_policy;
+    std::string filepath;  // current file
+    OfsHolder ofs;
+    moodycamel::BlockingConcurrentQueue<Record> queue;
+    std::thread writer;
+    SinkExecutor::UnitPtr unit;  // instead of writer with SinkExecutorOptions::pool
+    // owned by the writer
+    std::vector<Record> batch;
+    std::optional<moodycamel::ConsumerToken> consumer;
+    std::unique_ptr<SpillFile<Record>> spill;
+
+    QueueBudget budget;
+
+    // enqueued and the probe are updated by producers, the rest by the writer thread
+    struct {
+      std::atomic<uint64_t> enqueued{0};
+      std::atomic<uint64_t> probe_seq{0};
+      std::atomic<int64_t> probe_ns{0};  // enqueue time of record probe_seq, 0: no probe in flight
+      uint64_t dequeued{0};
+      std::atomic<uint64_t> depth_hwm{0};
+      uint64_t file_bytes{0};  // BytesWritten of the current file counted so far
+    } metrics;
+
+    // durability, owned by the writer thread
+    bool unsynced{false};  // records are written since the last fdatasync
+    bool durable_unsynced{false};  // records of WriteDurable are written since the last fdatasync
+    bool sync_failed{false};
+    size_t unsynced_bytes{0};
+    std::chrono::steady_clock::time_point last_sync{std::chrono::steady_clock::now()};
+
+    // producers of WriteDurable waiting for the next group commit
+    struct {
+      std::mutex mtx;
+      std::condition_variable cv;
+      std::vector<DurableWaiter *> waiters;
+      std::atomic<size_t> size{0};
+    } durable;
+  };
+
   explicit BaseSink(Options &&options) : options_(std::move(options)) {
-    writer_threads_.emplace_back(&BaseSink::WriteThreadFunc, this);
+    if (!options_.post_roll.pool) options_.post_roll.pool = PostRollPool::Default();
+    auto &so = options_.shard_options;
+    if (so.shards < 1) {
+      throw std::invalid_argument("shards should be positive");
+    }
+    if (so.routing == ShardRouting::KEY_HASH && !so.key_func) {
+      throw std::invalid_argument("key_func is required by KEY_HASH shard routing");
+    }
+    auto &qo = options_.queue_options;
+    if (qo.policy == OverflowPolicy::SAMPLE && qo.sample_rate < 1) {
+      throw std::invalid_argument("sample_rate should be positive");
+    }
+    if constexpr (requires { options_.ofs_options.compression.type; }) {
+      if (!IsCompressionSupported(options_.ofs_options.compression.type)) {
+        throw std::invalid_argument("compression is not enabled in this build");
+      }
+    }
+    if (qo.capacity && qo.policy == OverflowPolicy::SPILL && !SpillCodec<Record>::kSupported) {
+      throw std::invalid_argument("spilling is not supported by the record type");
+    }
+    if (options_.durability_options.mode != DurabilityMode::NONE && !IsSyncSupported()) {
+      throw std::invalid_argument("durability mode is not supported by the file system");
+    }
+    for (int i = 0; i < so.shards; ++i) {
+      auto shard = std::make_unique<Shard>();
+      shard->id = i;
+      shard->time_roll_policy = options_.roll_options.time_roll_policy;
+      if (qo.capacity && qo.policy == OverflowPolicy::SPILL) {
+        shard->spill = std::make_unique<SpillFile<Record>>(SpillFilePath(i), options_.spill_options.max_bytes);
+      }
+      shards_.emplace_back(std::move(shard));
+    }
+    for (auto &shard : shards_) {
+      shard->batch.resize(std::max<size_t>(1, options_.write_batch_size));
+      shard->consumer.emplace(shard->queue);
+      if (auto &executor = options_.executor.pool) {
+        shard->unit = executor->Register([this, s = shard.get()](int budget) { return RunShard(*s, budget); },
+                                         options_.executor.priority);
+      } else {
+        shard->writer = std::thread(&BaseSink::WriteThreadFunc, this, shard.get());
+      }
+    }
   }
 
+  /**
+   * Write handle of one producer thread. It holds a moodycamel::ProducerToken of each shard queue, which skips the
+   * implicit producer lookup of Write and keeps the records of the producer in FIFO order within a shard. With
+   * ROUND_ROBIN routing all records of a producer go to the shard picked when it is created.
+   * Not thread safe, and must not outlive the sink.
+   * usage:
+   *   auto producer = sink.CreateProducer();
+   *   producer.Write(record);
+   *   producer.WriteBulk(records);
+   */
+  class SinkProducer {
+   public:
+    SinkProducer(SinkProducer &&) = default;
+    SinkProducer &operator=(SinkProducer &&) = default;
+
+    template <typename T>
+    WriteStatus Write(T &&record) {
+      if (sink_->stopped_) return WriteStatus::STOPPED;
+      if (sink_->IsKeyRouted()) {
+        Record r(std::forward<T>(record));
+        auto &shard = sink_->KeyShard(r);
+        return sink_->Enqueue(shard, std::move(r), &tokens_[shard.id]);
+      }
+      return sink_->Enqueue(*shard_, std::forward<T>(record), &tokens_[shard_->id]);
+    }
+
+    // records are moved from, @return OK if all of them are accepted, otherwise the status of the last rejected one
+    WriteStatus WriteBulk(std::span<Record> records) {
+      if (sink_->stopped_) return WriteStatus::STOPPED;
+      if (!sink_->IsKeyRouted()) return sink_->EnqueueBulk(*shard_, records, tokens_[shard_->id]);
+      auto status = WriteStatus::OK;
+      for (auto &record : records) {
+        auto s = Write(std::move(record));
+        if (s != WriteStatus::OK) status = s;
+      }
+      return status;
+    }
+
+   private:
+    friend class BaseSink;
+    SinkProducer(BaseSink *sink, Shard *shard, std::vector<moodycamel::ProducerToken> &&tokens)
+        : sink_(sink), shard_(shard), tokens_(std::move(tokens)) {}
+
+    BaseSink *sink_;
+    Shard *shard_;  // ROUND_ROBIN
+    std::vector<moodycamel::ProducerToken> tokens_;  // indexed by shard id
+  };
+
   virtual ~BaseSink() { Close(); }
 
   template <typename T>
-  void Write(T &&record) {
-    if (state_.stopped_) return;
-    queue_.enqueue(std::forward<T>(record));
+  WriteStatus Write(T &&record) {
+    if (stopped_) return WriteStatus::STOPPED;
+    if (IsKeyRouted()) {
+      Record r(std::forward<T>(record));
+      auto &shard = KeyShard(r);
+      return Enqueue(shard, std::move(r));
+    }
+    return Enqueue(NextShard(), std::forward<T>(record));
+  }
+
+  // a write handle for the calling thread, producers are spread over shards like records of Write
+  SinkProducer CreateProducer() {
+    std::vector<moodycamel::ProducerToken> tokens;
+    tokens.reserve(shards_.size());
+    for (auto &shard : shards_) tokens.emplace_back(shard->queue);
+    return SinkProducer(this, &NextShard(), std::move(tokens));
+  }
+
+  /**
+   * Block until the record is written and covered by an fdatasync. The record goes through the queue of its shard,
+   * records written to the shard before by the same thread stay ahead of it and are covered by the same fdatasync.
+   * Waiting producers of a shard share one fdatasync (group commit), bounded queues and overflow policies do not apply.
+   */
+  template <typename T>
+  WriteStatus WriteDurable(T &&record) {
+    if (stopped_) return WriteStatus::STOPPED;
+    Record r(std::forward<T>(record));
+    Shard *shard;
+    if (IsKeyRouted()) {
+      shard = &KeyShard(r);
+    } else {
+      shard = &NextShard();
+    }
+    DurableWaiter waiter;
+    auto &durable = shard->durable;
+    std::unique_lock lock(durable.mtx);
+    // checked under the lock, Close sets stopped_ holding it, so the writer never misses the record
+    if (stopped_) return WriteStatus::STOPPED;
+    // the commit waits for the lock, so the record is queued before the writer drains the queue for it
+    durable.waiters.push_back(&waiter);
+    durable.size.fetch_add(1, std::memory_order_release);
+    EnqueueDurable(*shard, std::move(r));
+    durable.cv.wait(lock, [&waiter] { return waiter.done; });
+    return waiter.ok ? WriteStatus::OK : WriteStatus::SYNC_FAILED;
+  }
+
+  inline size_t Size() const {
+    size_t size = 0;
+    for (auto &shard : shards_) {
+      size += shard->queue.size_approx();
+      if (shard->spill) size += shard->spill->Size();
+    }
+    return size;
   }
 
-  inline size_t Size() const { return queue_.size_approx(); }
+  // close, then the post roll steps of rolled files
+  std::vector<PostRollStepStats> PostRollStats() { return post_roll_stats_.Snapshot(); }
+
+  SinkMetrics Metrics() {
+    SinkMetrics m;
+    m.name = options_.name;
+    for (auto &shard : shards_) {
+      m.enqueued += shard->metrics.enqueued.load(std::memory_order_relaxed);
+      m.queue_depth_hwm = std::max(m.queue_depth_hwm, shard->metrics.depth_hwm.load(std::memory_order_relaxed));
+    }
+    m.queue_depth = Size();
+    m.rows_written = metrics_.rows.load(std::memory_order_relaxed);
+    m.bytes_written = metrics_.bytes.load(std::memory_order_relaxed);
+    m.files_rolled = metrics_.rolled.load(std::memory_order_relaxed);
+    m.enqueue_to_write = metrics_.enqueue_to_write.Summary();
+    m.write_batch = metrics_.write_batch.Summary();
+    m.roll = metrics_.roll.Summary();
+    m.close = metrics_.close.Summary();
+    m.roll_callback = metrics_.roll_callback.Summary();
+    m.drops = DropStats();
+    m.post_roll = PostRollStats();
+    auto now = SteadyNowNs();
+    m.uptime_s = static_cast<double>(now - metrics_.start_ns) / 1e9;
+    std::lock_guard lock(metrics_.snapshot_mtx);
+    if (now > metrics_.snapshot_ns) {
+      m.enqueue_rate = static_cast<double>(m.enqueued - metrics_.snapshot_enqueued) * 1e9 /
+                       static_cast<double>(now - metrics_.snapshot_ns);
+    }
+    metrics_.snapshot_ns = now;
+    metrics_.snapshot_enqueued = m.enqueued;
+    return m;
+  }
+
+  SinkDropStats DropStats() const {
+    SinkDropStats stats;
+    for (auto &shard : shards_) shard->budget.AddDrops(stats);
+    stats.dropped_encode = metrics_.dropped_encode.load(std::memory_order_relaxed);
+    return stats;
+  }
 
   void Close();
 
  protected:
-  void WriteThreadFunc();
-  void RollFile();
-  std::string NextFilePath();
-  bool IsRoll();
+  inline Shard &NextShard() {
+    if (shards_.size() == 1) return *shards_.front();
+    return *shards_[next_shard_.fetch_add(1, std::memory_order_relaxed) % shards_.size()];
+  }
+  inline bool IsKeyRouted() const {
+    return shards_.size() > 1 && options_.shard_options.routing == ShardRouting::KEY_HASH;
+  }
+  inline Shard &KeyShard(const Record &record) {
+    return *shards_[options_.shard_options.key_func(record) % shards_.size()];
+  }
+
+  // token: nullptr for the implicit producer of the calling thread
+  template <typename T>
+  WriteStatus Enqueue(Shard &shard, T &&record, moodycamel::ProducerToken *token = nullptr);
+  WriteStatus EnqueueBulk(Shard &shard, std::span<Record> records, moodycamel::ProducerToken &token);
+  // one relaxed increment, plus a clock read every kLatencyProbeInterval records
+  inline void CountEnqueued(Shard &shard, uint64_t count = 1) {
+    auto &metrics = shard.metrics;
+    auto seq = metrics.enqueued.fetch_add(count, std::memory_order_relaxed);
+    auto last = seq + count - 1;
+    // a bulk covering a probe point is probed by its last record
+    if ((seq % kLatencyProbeInterval == 0 || seq / kLatencyProbeInterval != last / kLatencyProbeInterval) &&
+        metrics.probe_ns.load(std::memory_order_relaxed) == 0) {
+      metrics.probe_seq.store(last, std::memory_order_relaxed);
+      metrics.probe_ns.store(SteadyNowNs(), std::memory_order_release);
+    }
+  }
+  void CountWritten(Shard &shard, size_t dequeued);
+  inline int64_t RecordCost(const Record &record) const {
+    if (options_.queue_options.unit == QueueCapacityUnit::RECORDS) return 1;
+    return static_cast<int64_t>(RecordByteSize<Record>{}(record));
+  }
+  void DropOldest(Shard &shard, int64_t cost);
+  void ReleaseQueued(Shard &shard, std::span<Record> records);
+  WriteStatus Spill(Shard &shard, const Record &record);
+  void EnqueueDurable(Shard &shard, Record &&record);
+  // objects are durable only once they are closed
+  inline bool IsSyncSupported() const {
+    if constexpr (requires { options_.ofs_options.file.type; }) {
+      if (options_.ofs_options.file.type == FileBackend::OBJECT) return false;
+    }
+    return FS::kSyncSupported;
+  }
+  inline bool IsSpilling(const Shard &shard) const { return shard.spill && shard.spill->Active(); }
+  std::string SpillFilePath(int shard_id) const;
+
+  void WriteThreadFunc(Shard *shard);
+  bool WriteOnce(Shard &shard, std::chrono::milliseconds timeout);
+  size_t DequeueAndWrite(Shard &shard, std::chrono::milliseconds timeout,
+                         size_t max = std::numeric_limits<size_t>::max());
+  // a turn on the executor, @return true if work is left
+  bool RunShard(Shard &shard, int budget);
+  inline bool HasPending(const Shard &shard) const {
+    return shard.queue.size_approx() != 0 || IsSpilling(shard) || HasDurable(shard);
+  }
+  inline void Wake(Shard &shard) {
+    if (shard.unit) options_.executor.pool->Notify(shard.unit);
+  }
+  void WriteRecords(Shard &shard, std::span<Record> records);
+  inline int WriteBatchTo(FS &ofs, std::span<Record> records) {
+    // the default WriteBatch calls Write virtually, loop here so Write is inlined
+    if constexpr (kStaticDispatch &&
+                  std::is_same_v<decltype(&FS::WriteBatch), int (SinkFileSystem<Record>::*)(std::span<Record>)>) {
+      int rows = 0;
+      for (auto &record : records) rows += ofs.Write(std::move(record));
+      return rows;
+    } else {
+      return ofs.WriteBatch(records);
+    }
+  }
+  void CommitDurable(Shard &shard);
+  void MaybeSync(Shard &shard);
+  bool SyncFile(Shard &shard);
+  inline bool HasDurable(const Shard &shard) const { return shard.durable.size.load(std::memory_order_acquire); }
+  void RollFile(Shard &shard);
+  std::string NextFilePath(Shard &shard);
+  bool IsRoll(Shard &shard);
+  // estimated bytes may go down, the sum stays right modulo 2^64
+  inline void CountFileBytes(Shard &shard) {
+    auto bytes = shard.ofs->BytesWritten();
+    metrics_.bytes.fetch_add(bytes - shard.metrics.file_bytes, std::memory_order_relaxed);
+    shard.metrics.file_bytes = bytes;
+  }
+  // estimated by the average row size of the current file, the file may exceed the limit by one row
+  inline size_t RowsUntilMaxBytes(const Shard &shard) const {
+    auto bytes = static_cast<int64_t>(shard.metrics.file_bytes);
+    int64_t rows = shard.state.current_row_nums;
+    if (rows == 0) return 1;
+    if (bytes == 0) return std::numeric_limits<size_t>::max();  // not counted by the file
+    auto left = options_.roll_options.max_bytes_per_file - bytes;
+    auto row_bytes = static_cast<double>(bytes) / static_cast<double>(rows);
+    return static_cast<size_t>(std::max(1.0, std::ceil(static_cast<double>(left) / row_bytes)));
+  }
   void RemoveOverflowFiles();
-  void CloseCurrentFile();
-  void OpenNewFile(const std::string &filepath);
+  void FinishBackupFile(const std::string &filepath, const std::string &final_filepath);
+  void CloseCurrentFile(Shard &shard);
+  inline void FinishPostRoll() {
+    std::lock_guard lock(post_roll_mtx_);
+    if (--post_roll_inflight_ == 0) post_roll_cv_.notify_all();
+  }
+  void PostRoll(std::shared_ptr<FS> ofs, RolledFile file, const TimeRollPolicy &time_roll_policy,
+                uint64_t counted_bytes);
+  void CloseFile(FS &ofs, uint64_t counted_bytes);
+  void OpenNewFile(Shard &shard, const std::string &filepath);
 
  protected:
   Options options_;
-  State state_{};
+  std::atomic<bool> stopped_{false};
+  std::atomic<size_t> next_shard_{0};
+  std::vector<std::unique_ptr<Shard>> shards_;
 
-  moodycamel::BlockingConcurrentQueue<Record> queue_;
-  std::vector<std::thread> writer_threads_;
-  std::shared_ptr<FS> ofs_;
-  std::queue<std::string> rotated_files_{};
+  std::mutex files_mtx_;  // guards rotated_files_ and Shard::filepath
+  struct BackupFile {
+    std::string filepath;
+    bool done{false};  // post roll steps are done, filepath is the final one, e.g. renamed by GzipStep
+  };
+  std::deque<BackupFile> rotated_files_{};
 
-  std::vector<std::thread> close_threads_{};
+  // files closing on the post roll pool
+  std::mutex post_roll_mtx_;
+  std::condition_variable post_roll_cv_;
+  size_t post_roll_inflight_{0};
+  cppcommon::os::PostRollStats post_roll_stats_;
+
+  // shared by shards, see Metrics()
+  struct {
+    int64_t start_ns{SteadyNowNs()};
+    std::atomic<uint64_t> rows{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> rolled{0};
+    std::atomic<uint64_t> dropped_encode{0};
+    LatencyHistogram enqueue_to_write;
+    LatencyHistogram write_batch;
+    LatencyHistogram roll;
+    LatencyHistogram close;
+    LatencyHistogram roll_callback;
+    std::mutex snapshot_mtx;
+    int64_t snapshot_ns{start_ns};
+    uint64_t snapshot_enqueued{0};
+  } metrics_;
 };
 
 template <typename Record, typename FS, typename OfsOptions>
-inline bool BaseSink<Record, FS, OfsOptions>::IsRoll() {
-  if (!ofs_) return true;
+template <typename T>
+WriteStatus BaseSink<Record, FS, OfsOptions>::Enqueue(Shard &shard, T &&record, moodycamel::ProducerToken *token) {
+  auto &qo = options_.queue_options;
+  if (qo.capacity == 0) {
+    CountEnqueued(shard);
+    if (token) {
+      shard.queue.enqueue(*token, std::forward<T>(record));
+    } else {
+      shard.queue.enqueue(std::forward<T>(record));
+    }
+    Wake(shard);
+    return WriteStatus::OK;
+  }
+
+  Record r(std::forward<T>(record));
+  // keep FIFO order, records go to the spill file until it is drained
+  if (IsSpilling(shard)) {
+    return Spill(shard, r);
+  }
+  auto cost = RecordCost(r);
+  if (!shard.budget.TryReserve(cost, static_cast<int64_t>(qo.capacity))) {
+    if (qo.policy == OverflowPolicy::SPILL) return Spill(shard, r);
+    auto status = shard.budget.Overflow(qo, cost, stopped_, [&](int64_t c) { DropOldest(shard, c); });
+    if (status != WriteStatus::OK) return status;
+  }
+  CountEnqueued(shard);
+  if (token) {
+    shard.queue.enqueue(*token, std::move(r));
+  } else {
+    shard.queue.enqueue(std::move(r));
+  }
+  Wake(shard);
+  return WriteStatus::OK;
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+WriteStatus BaseSink<Record, FS, OfsOptions>::EnqueueBulk(Shard &shard, std::span<Record> records,
+                                                          moodycamel::ProducerToken &token) {
+  if (records.empty()) return WriteStatus::OK;
+  auto capacity = static_cast<int64_t>(options_.queue_options.capacity);
+  if (capacity) {
+    int64_t cost = 0;
+    for (auto &record : records) cost += RecordCost(record);
+    // records go one by one through the overflow policy unless the whole bulk fits
+    if (IsSpilling(shard) || cost > capacity || !shard.budget.TryReserve(cost, capacity)) {
+      auto status = WriteStatus::OK;
+      for (auto &record : records) {
+        auto s = Enqueue(shard, std::move(record), &token);
+        if (s != WriteStatus::OK) status = s;
+      }
+      return status;
+    }
+  }
+  CountEnqueued(shard, records.size());
+  shard.queue.enqueue_bulk(token, std::make_move_iterator(records.begin()), records.size());
+  Wake(shard);
+  return WriteStatus::OK;
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::DropOldest(Shard &shard, int64_t cost) {
+  auto capacity = static_cast<int64_t>(options_.queue_options.capacity);
+  while (!shard.budget.TryReserve(cost, capacity)) {
+    Record oldest;
+    // a record of WriteDurable may be the oldest one, nothing is dropped until it is committed
+    if (HasDurable(shard) || !shard.queue.try_dequeue(oldest)) {
+      // queued records are taken by the writer, admit the record anyway
+      shard.budget.queued += cost;
+      return;
+    }
+    shard.budget.queued -= RecordCost(oldest);
+    shard.budget.drops.oldest.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+WriteStatus BaseSink<Record, FS, OfsOptions>::Spill(Shard &shard, const Record &record) {
+  if constexpr (SpillCodec<Record>::kSupported) {
+    if (shard.spill && shard.spill->Append(record)) {
+      Wake(shard);
+      return WriteStatus::OK;
+    }
+  }
+  shard.budget.drops.spill.fetch_add(1, std::memory_order_relaxed);
+  return WriteStatus::DROPPED;
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::EnqueueDurable(Shard &shard, Record &&record) {
+  // keep FIFO order while the spill file is drained, queue the record if it does not fit
+  if constexpr (SpillCodec<Record>::kSupported) {
+    if (IsSpilling(shard) && shard.spill->Append(record)) {
+      Wake(shard);
+      return;
+    }
+  }
+  if (options_.queue_options.capacity) shard.budget.queued += RecordCost(record);
+  CountEnqueued(shard);
+  shard.queue.enqueue(std::move(record));
+  Wake(shard);
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+std::string BaseSink<Record, FS, OfsOptions>::SpillFilePath(int shard_id) const {
+  auto &dir = options_.spill_options.dir.empty() ? options_.path : options_.spill_options.dir;
+  std::ostringstream filepath;
+  if (!dir.empty()) {
+    filepath << dir << "/";
+  }
+  filepath << options_.name;
+  if (options_.shard_options.shards > 1) {
+    filepath << "_shard" << shard_id;
+  }
+  filepath << ".spill";
+  return filepath.str();
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::ReleaseQueued(Shard &shard, std::span<Record> records) {
+  if (options_.queue_options.capacity == 0) return;
+  int64_t cost = 0;
+  if (options_.queue_options.unit == QueueCapacityUnit::RECORDS) {
+    cost = static_cast<int64_t>(records.size());
+  } else {
+    for (auto &record : records) cost += RecordCost(record);
+  }
+  shard.budget.Release(cost);
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+inline bool BaseSink<Record, FS, OfsOptions>::IsRoll(Shard &shard) {
+  if (!shard.ofs) return true;
   if (!options_.roll_options.is_rotate) return false;
-  if (state_.current_row_nums >= options_.roll_options.max_rows_per_file) {
+  if (shard.state.current_row_nums >= options_.roll_options.max_rows_per_file) {
     return true;
   }
-  if (options_.roll_options.time_roll_policy.IsRoll()) {
+  auto max_bytes = options_.roll_options.max_bytes_per_file;
+  if (max_bytes > 0 && static_cast<int64_t>(shard.metrics.file_bytes) >= max_bytes) {
+    // bytes still being compressed by the file are estimated, wait for the exact count before rolling on it
+    shard.ofs->Flush();
+    CountFileBytes(shard);
+    if (static_cast<int64_t>(shard.metrics.file_bytes) >= max_bytes) return true;
+  }
+  if (shard.time_roll_policy.IsRoll()) {
     return true;
   }
   return false;
@@ -200,12 +896,24 @@ inline bool BaseSink<Record, FS, OfsOptions>::IsRoll() {
 
 template <typename Record, typename FS, typename OfsOptions>
 void BaseSink<Record, FS, OfsOptions>::RemoveOverflowFiles() {
-  while (options_.roll_options.max_backup_files > 0 &&
-         static_cast<int>(rotated_files_.size()) > options_.roll_options.max_backup_files) {
-    auto oldest_fp = rotated_files_.front();
-    rotated_files_.pop();
-    spdlog::info("backup files exceeds the limit . [limit={}, remove={}]", options_.roll_options.max_backup_files,
-                 oldest_fp);
+  auto limit = options_.roll_options.max_backup_files;
+  if (limit <= 0) return;
+  std::lock_guard lock(files_mtx_);
+  // files opened by shards are never removed, even if they are the oldest ones
+  auto is_current = [this](const std::string &fp) {
+    return std::any_of(shards_.begin(), shards_.end(), [&fp](auto &shard) { return shard->filepath == fp; });
+  };
+  auto it = rotated_files_.begin();
+  while (static_cast<int>(rotated_files_.size()) > limit && it != rotated_files_.end()) {
+    if (is_current(it->filepath)) {
+      ++it;
+      continue;
+    }
+    // removed in order, once the post roll steps of the oldest file are done
+    if (!it->done) break;
+    auto oldest_fp = it->filepath;
+    it = rotated_files_.erase(it);
+    spdlog::info("backup files exceeds the limit . [limit={}, remove={}]", limit, oldest_fp);
     if (!std::filesystem::remove(oldest_fp)) {
       spdlog::error("remove rotated log file failed. [file={}]", oldest_fp);
     }
@@ -215,90 +923,335 @@ void BaseSink<Record, FS, OfsOptions>::RemoveOverflowFiles() {
 template <typename Record, typename FS, typename OfsOptions>
 void BaseSink<Record, FS, OfsOptions>::Close() {
   // write inflight records
-  state_.stopped_ = true;
-  for (auto &th : writer_threads_) {
-    if (th.joinable()) th.join();
+  {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto &shard : shards_) locks.emplace_back(shard->durable.mtx);
+    stopped_ = true;
+  }
+  for (auto &shard : shards_) shard->budget.WakeAll();
+  for (auto &shard : shards_) {
+    if (shard->writer.joinable()) shard->writer.join();
+    if (shard->unit) options_.executor.pool->Unregister(shard->unit);
   }
-  // close current file
-  CloseCurrentFile();
-  // wait for file closing threads
-  for (auto &td : close_threads_) {
-    if (td.joinable()) td.join();
+  // close current files
+  for (auto &shard : shards_) {
+    CloseCurrentFile(*shard);
   }
-  close_threads_.clear();
+  // wait for files closing on the post roll pool
+  std::unique_lock lock(post_roll_mtx_);
+  post_roll_cv_.wait(lock, [this] { return post_roll_inflight_ == 0; });
 }
 
 template <typename Record, typename FS, typename OfsOptions>
-void BaseSink<Record, FS, OfsOptions>::WriteThreadFunc() {
-  while (!state_.stopped_ || queue_.size_approx() != 0) {
-    Record item;
-    if (queue_.wait_dequeue_timed(item, std::chrono::milliseconds(5))) {
-      if (IsRoll()) {
-        RollFile();
-      }
-      if (ofs_) {
-        state_.current_row_nums += ofs_->Write(std::forward<Record>(item));
+void BaseSink<Record, FS, OfsOptions>::WriteThreadFunc(Shard *shard) {
+  // records of Write and WriteDurable wake the writer up, the timeout is for INTERVAL syncing and Close
+  auto timeout = std::chrono::milliseconds(5);
+  while (!stopped_ || HasPending(*shard)) {
+    WriteOnce(*shard, timeout);
+  }
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+bool BaseSink<Record, FS, OfsOptions>::RunShard(Shard &shard, int budget) {
+  for (int i = 0; i < budget && WriteOnce(shard, std::chrono::milliseconds(0)); ++i) {
+  }
+  return HasPending(shard);
+}
+
+// a batch from the queue or the spill file, then the group commit or syncing, @return false if nothing is written
+template <typename Record, typename FS, typename OfsOptions>
+bool BaseSink<Record, FS, OfsOptions>::WriteOnce(Shard &shard, std::chrono::milliseconds timeout) {
+  auto count = DequeueAndWrite(shard, timeout);
+  auto durable = HasDurable(shard);
+  if (durable) {
+    CommitDurable(shard);
+  } else {
+    MaybeSync(shard);
+  }
+  return count > 0 || durable;
+}
+
+// up to max records, @return records written
+template <typename Record, typename FS, typename OfsOptions>
+size_t BaseSink<Record, FS, OfsOptions>::DequeueAndWrite(Shard &shard, std::chrono::milliseconds timeout, size_t max) {
+  auto &batch = shard.batch;
+  auto &consumer = *shard.consumer;
+  auto batch_size = std::min(batch.size(), max);
+  size_t count = 0;
+  if (IsSpilling(shard)) {
+    // queued records are older than spilled ones
+    count = shard.queue.try_dequeue_bulk(consumer, batch.begin(), batch_size);
+    if (count > 0) {
+      std::span<Record> records(batch.data(), count);
+      ReleaseQueued(shard, records);
+      WriteRecords(shard, records);
+      CountWritten(shard, count);
+    } else if constexpr (SpillCodec<Record>::kSupported) {
+      size_t lost = 0;
+      count = shard.spill->Read(batch.data(), batch_size, lost);
+      if (lost) shard.budget.drops.spill.fetch_add(lost, std::memory_order_relaxed);
+      WriteRecords(shard, std::span<Record>(batch.data(), count));
+    }
+  } else {
+    auto depth = shard.queue.size_approx();
+    if (depth > shard.metrics.depth_hwm.load(std::memory_order_relaxed)) {
+      shard.metrics.depth_hwm.store(depth, std::memory_order_relaxed);
+    }
+    count = timeout.count() ? shard.queue.wait_dequeue_bulk_timed(consumer, batch.begin(), batch_size, timeout)
+                            : shard.queue.try_dequeue_bulk(consumer, batch.begin(), batch_size);
+    if (count > 0) {
+      std::span<Record> records(batch.data(), count);
+      ReleaseQueued(shard, records);
+      WriteRecords(shard, records);
+      CountWritten(shard, count);
+    }
+  }
+  return count;
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::WriteRecords(Shard &shard, std::span<Record> records) {
+  // roll is checked once per batch, the batch is split only when it crosses max_rows_per_file or max_bytes_per_file
+  while (!records.empty()) {
+    if (IsRoll(shard)) {
+      auto start = SteadyNowNs();
+      RollFile(shard);
+      metrics_.roll.Record(SteadyNowNs() - start);
+    }
+    auto count = records.size();
+    if (options_.roll_options.is_rotate) {
+      auto left = options_.roll_options.max_rows_per_file - shard.state.current_row_nums;
+      count = std::min(count, static_cast<size_t>(std::max<int64_t>(left, 1)));
+      if (options_.roll_options.max_bytes_per_file > 0) count = std::min(count, RowsUntilMaxBytes(shard));
+    }
+    if (shard.ofs) {
+      if (options_.durability_options.mode == DurabilityMode::BYTES) {
+        for (auto &record : records.first(count)) shard.unsynced_bytes += RecordByteSize<Record>{}(record);
       }
+      auto start = SteadyNowNs();
+      auto rows = WriteBatchTo(*shard.ofs, records.first(count));
+      metrics_.write_batch.Record(SteadyNowNs() - start);
+      shard.state.current_row_nums += rows;
+      shard.unsynced = true;
+      metrics_.rows.fetch_add(rows, std::memory_order_relaxed);
+      CountFileBytes(shard);
     }
+    records = records.subspan(count);
+  }
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::CountWritten(Shard &shard, size_t dequeued) {
+  auto &metrics = shard.metrics;
+  metrics.dequeued += dequeued;
+  auto ts = metrics.probe_ns.load(std::memory_order_acquire);
+  // records dropped by DROP_OLDEST leave the queue without the writer, approximate under multiple producers
+  if (ts && metrics.dequeued + shard.budget.drops.oldest.load(std::memory_order_relaxed) >
+                metrics.probe_seq.load(std::memory_order_relaxed)) {
+    metrics_.enqueue_to_write.Record(SteadyNowNs() - ts);
+    metrics.probe_ns.store(0, std::memory_order_relaxed);
+  }
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::CommitDurable(Shard &shard) {
+  auto &durable = shard.durable;
+  std::vector<DurableWaiter *> waiters;
+  size_t queued = 0;
+  {
+    std::lock_guard lock(durable.mtx);
+    waiters.swap(durable.waiters);
+    // records of the waiters are queued or spilled by now
+    queued = shard.queue.size_approx() + (shard.spill ? shard.spill->Size() : 0);
+  }
+  shard.sync_failed = false;
+  shard.durable_unsynced = true;
+  // as many records as queued or spilled with the waiters are written before the fdatasync, later ones are left to
+  // the next batches, so producers keeping up with the writer never hold the commit
+  while (queued > 0) {
+    auto count = DequeueAndWrite(shard, std::chrono::milliseconds(0), queued);
+    if (count == 0) break;
+    queued -= std::min(count, queued);
+  }
+  // a roll in between syncs the previous file before closing it
+  auto ok = SyncFile(shard) && !shard.sync_failed;
+  {
+    std::lock_guard lock(durable.mtx);
+    for (auto waiter : waiters) {
+      waiter->done = true;
+      waiter->ok = ok;
+    }
+    durable.size.fetch_sub(waiters.size(), std::memory_order_release);
+  }
+  durable.cv.notify_all();
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::MaybeSync(Shard &shard) {
+  if (!shard.unsynced) return;
+  auto &durability = options_.durability_options;
+  switch (durability.mode) {
+    case DurabilityMode::NONE:
+    case DurabilityMode::GROUP_COMMIT:  // synced by CommitDurable
+      return;
+    case DurabilityMode::INTERVAL:
+      if (std::chrono::steady_clock::now() - shard.last_sync < durability.interval) return;
+      break;
+    case DurabilityMode::BYTES:
+      if (shard.unsynced_bytes < durability.bytes) return;
+      break;
+  }
+  SyncFile(shard);
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+bool BaseSink<Record, FS, OfsOptions>::SyncFile(Shard &shard) {
+  auto ok = shard.ofs && shard.ofs->Sync();
+  if (!ok) {
+    spdlog::error("[BaseSink] sync file failed. [name={}, shard={}]", options_.name, shard.id);
   }
+  shard.unsynced = false;
+  shard.durable_unsynced = false;
+  shard.unsynced_bytes = 0;
+  shard.last_sync = std::chrono::steady_clock::now();
+  return ok;
 }
 
 template <typename Record, typename FS, typename OfsOptions>
-void BaseSink<Record, FS, OfsOptions>::OpenNewFile(const std::string &filepath) {
-  if constexpr (std::is_void_v<OfsOptions>) {
-    ofs_ = std::make_shared<FS>();
+void BaseSink<Record, FS, OfsOptions>::OpenNewFile(Shard &shard, const std::string &filepath) {
+  if constexpr (kStaticDispatch && std::is_void_v<OfsOptions>) {
+    shard.ofs.emplace();
+  } else if constexpr (kStaticDispatch) {
+    shard.ofs.emplace(options_.ofs_options);
+  } else if constexpr (std::is_void_v<OfsOptions>) {
+    shard.ofs = std::make_shared<FS>();
   } else {
-    ofs_ = std::make_shared<FS>(options_.ofs_options);
+    shard.ofs = std::make_shared<FS>(options_.ofs_options);
   }
-  ofs_->Open(filepath);
-  if (!ofs_->IsOpen()) {
+  shard.ofs->Open(filepath);
+  if (!shard.ofs->IsOpen()) {
     throw std::runtime_error("Failed to open file: " + filepath);
   }
+  std::lock_guard lock(files_mtx_);
+  shard.filepath = filepath;
 }
 
-struct RollMeta {
-  bool is_roll{false};
-  std::string filepath;
-  TimeRollPolicy time_roll_policy;
-};
-
 template <typename Record, typename FS, typename OfsOptions>
-void BaseSink<Record, FS, OfsOptions>::CloseCurrentFile() {
-  RollMeta meta;
-  if (!rotated_files_.empty() && options_.on_roll_callback) {
-    meta = RollMeta{true, rotated_files_.back(), options_.roll_options.time_roll_policy};
+void BaseSink<Record, FS, OfsOptions>::CloseCurrentFile(Shard &shard) {
+  RolledFile file{.filepath = shard.filepath, .period_start_ms = shard.time_roll_policy.last_rolling_ts_ms};
+  auto time_roll_policy = shard.time_roll_policy;
+  {
+    std::lock_guard lock(files_mtx_);
+    shard.filepath.clear();
+  }
+  // synced before the file leaves the writer thread, records written so far are covered by the next sync
+  if (shard.ofs && shard.unsynced &&
+      (options_.durability_options.mode != DurabilityMode::NONE || shard.durable_unsynced)) {
+    if (!SyncFile(shard)) shard.sync_failed = true;
   }
+  if (!shard.ofs && file.filepath.empty()) return;
+  auto counted_bytes = std::exchange(shard.metrics.file_bytes, 0);
+  if (!file.filepath.empty()) metrics_.rolled.fetch_add(1, std::memory_order_relaxed);
 
-  auto f = [meta = meta, ofs = std::move(ofs_), ops = &options_]() mutable {
-    if (ofs) {
-      ofs->Close();
-      ofs.reset();
+  std::shared_ptr<FS> ofs;
+  if constexpr (kStaticDispatch) {
+    // the file system stays in the shard, only the post roll steps are left to the pool
+    if (shard.ofs) {
+      CloseFile(*shard.ofs, counted_bytes);
+      shard.ofs.reset();
     }
-    if (meta.is_roll) {
-      ops->on_roll_callback(meta.filepath, meta.time_roll_policy);
+  } else {
+    ofs = std::move(shard.ofs);
+  }
+  {
+    // until the on roll callback, retries of post roll steps may finish it on the pool in both modes
+    std::lock_guard lock(post_roll_mtx_);
+    ++post_roll_inflight_;
+  }
+  // closing, post roll steps and on roll callback maybe block write thread
+  if (!options_.close_in_threads) {
+    PostRoll(std::move(ofs), std::move(file), time_roll_policy, counted_bytes);
+    return;
+  }
+  // blocks while the pool queue is full, which slows down rolling instead of piling up closed files
+  auto task = [this, ofs = std::move(ofs), file = std::move(file), time_roll_policy, counted_bytes]() mutable {
+    PostRoll(std::move(ofs), std::move(file), time_roll_policy, counted_bytes);
+  };
+  options_.post_roll.pool->Submit(std::move(task));
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::PostRoll(std::shared_ptr<FS> ofs, RolledFile file,
+                                                const TimeRollPolicy &time_roll_policy, uint64_t counted_bytes) {
+  if (ofs) {
+    CloseFile(*ofs, counted_bytes);
+    ofs.reset();
+  }
+  if (file.filepath.empty()) {
+    FinishPostRoll();
+    return;
+  }
+  auto done = [this, filepath = file.filepath, time_roll_policy](RolledFile &file) {
+    if (options_.on_roll_callback) {
+      auto start = SteadyNowNs();
+      options_.on_roll_callback(file.filepath, time_roll_policy);
+      metrics_.roll_callback.Record(SteadyNowNs() - start);
     }
+    FinishBackupFile(filepath, file.filepath);
+    FinishPostRoll();
   };
-  // on roll callback maybe block read thread
-  if (options_.close_in_threads) {
-    close_threads_.emplace_back(std::thread(std::move(f)));
-  } else {
-    f();
+  RunPostRollSteps(*options_.post_roll.pool, options_.post_roll.steps, std::move(file), post_roll_stats_,
+                   std::move(done));
+}
+
+// the backup file is counted by the path left by post roll steps, or forgotten if a step removed it
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::FinishBackupFile(const std::string &filepath,
+                                                        const std::string &final_filepath) {
+  {
+    std::lock_guard lock(files_mtx_);
+    auto it = std::find_if(rotated_files_.begin(), rotated_files_.end(),
+                           [&filepath](const BackupFile &f) { return !f.done && f.filepath == filepath; });
+    if (it == rotated_files_.end()) return;
+    std::error_code ec;
+    if (!std::filesystem::exists(final_filepath, ec)) {
+      rotated_files_.erase(it);
+      return;
+    }
+    it->filepath = final_filepath;
+    it->done = true;
   }
+  RemoveOverflowFiles();
+}
+
+template <typename Record, typename FS, typename OfsOptions>
+void BaseSink<Record, FS, OfsOptions>::CloseFile(FS &ofs, uint64_t counted_bytes) {
+  auto start = SteadyNowNs();
+  ofs.Close();
+  auto ns = SteadyNowNs() - start;
+  metrics_.close.Record(ns);
+  post_roll_stats_.Record("close", true, 0, static_cast<uint64_t>(ns / 1000));
+  // files formatting asynchronously count the rest of their bytes on close
+  metrics_.bytes.fetch_add(ofs.BytesWritten() - counted_bytes, std::memory_order_relaxed);
+  metrics_.dropped_encode.fetch_add(ofs.DroppedRows(), std::memory_order_relaxed);
 }
 
 template <typename Record, typename FS, typename OfsOptions>
-void BaseSink<Record, FS, OfsOptions>::RollFile() {
-  std::string filepath = NextFilePath();
-  CloseCurrentFile();
-  OpenNewFile(filepath);
-  state_.Roll();
-  options_.roll_options.time_roll_policy.Roll();
-  rotated_files_.push(filepath);
+void BaseSink<Record, FS, OfsOptions>::RollFile(Shard &shard) {
+  std::string filepath = NextFilePath(shard);
+  CloseCurrentFile(shard);
+  OpenNewFile(shard, filepath);
+  shard.state.Roll();
+  shard.time_roll_policy.Roll();
+  {
+    std::lock_guard lock(files_mtx_);
+    rotated_files_.push_back({.filepath = filepath});
+  }
   RemoveOverflowFiles();
 }
 
 template <typename Record, typename FS, typename OfsOptions>
-std::string BaseSink<Record, FS, OfsOptions>::NextFilePath() {
+std::string BaseSink<Record, FS, OfsOptions>::NextFilePath(Shard &shard) {
   std::string hostname_str;
   if (options_.name_options.name_with_hostname) {
     char hostname[128] = {};
@@ -313,6 +1266,9 @@ std::string BaseSink<Record, FS, OfsOptions>::NextFilePath() {
       filepath << options_.path << "/";
     }
     filepath << options_.name;
+    if (shards_.size() > 1) {
+      filepath << "_shard" << shard.id;
+    }
     if (!hostname_str.empty()) {
       filepath << "_" << hostname_str;
     }
@@ -320,18 +1276,31 @@ std::string BaseSink<Record, FS, OfsOptions>::NextFilePath() {
       filepath << "_" << GetDateFileName();
     }
     if (options_.name_options.name_with_timestamp) {
-      filepath << "_" << cppcommon::CurrentTsMs();
+      filepath << "_" << cppcommon::CoarseClock::Instance().NowMs();
     }
     if (options_.roll_options.is_rotate) {
-      filepath << "_" << state_.file_index;
+      filepath << "_" << shard.state.file_index;
     }
     filepath << "." << options_.name_options.suffix;
+    if constexpr (requires { options_.ofs_options.compression.type; }) {
+      filepath << CompressionSuffix(options_.ofs_options.compression.type);
+    }
 
     auto dest = filepath.str();
     if (!options_.roll_options.is_rotate || !FS::IsExists(dest)) {
       return dest;
     }
-    ++state_.file_index;
+    ++shard.state.file_index;
   }
 }
+
+/**
+ * BaseSink with static dispatch, for high rates of small records. The file system of each shard lives inside the
+ * sink and is constructed again in place on roll, Write and WriteBatch are called directly and inlined into the writer
+ * loop. Rolled files are closed on the writer thread, their post roll steps still run on the pool.
+ * usage:
+ *   StaticSink<std::string, LocalTextSinkFileSystem, TextWriterOptions> sink({.name = "events"});
+ */
+template <typename Record, typename FS, typename OfsOptions = void>
+using StaticSink = BaseSink<Record, StaticSinkFileSystem<FS>, OfsOptions>;
 }  // namespace cppcommon::os
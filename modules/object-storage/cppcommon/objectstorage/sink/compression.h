@@ -0,0 +1,334 @@
+/**
+ * @file compression.h
+ * @brief block compression of sink files, every block is an independent gzip member or zstd frame
+ * @author zhenkai.sun
+ * @date 2025-06-17 10:42:51
+ */
+#pragma once
+
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef CPPCOMMON_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "concurrentqueue/concurrentqueue.h"
+#include "cppcommon/objectstorage/sink/ordered_file_writer.h"
+#include "cppcommon/objectstorage/sink/sink_executor.h"
+
+namespace cppcommon::os {
+enum class Compression { NONE, GZIP, ZSTD };
+
+struct CompressionOptions {
+  Compression type{Compression::NONE};
+  int level{0};  // 0: default level of the codec
+};
+
+inline bool IsCompressionSupported(Compression type) {
+#ifdef CPPCOMMON_WITH_ZSTD
+  return true;
+#else
+  return type != Compression::ZSTD;
+#endif
+}
+
+// appended to the file suffix, e.g. log.gz
+inline std::string_view CompressionSuffix(Compression type) {
+  switch (type) {
+    case Compression::GZIP:
+      return ".gz";
+    case Compression::ZSTD:
+      return ".zst";
+    default:
+      return "";
+  }
+}
+
+/**
+ * Compresses blocks into self-contained frames, concatenated frames are still a valid file for gzip / zstd tools.
+ * Not thread safe, keeps the codec context between blocks.
+ */
+class BlockCompressor {
+ public:
+  explicit BlockCompressor(CompressionOptions options) : options_(options) {}
+
+  ~BlockCompressor() {
+    if (zs_) deflateEnd(zs_.get());
+#ifdef CPPCOMMON_WITH_ZSTD
+    if (zstd_) ZSTD_freeCCtx(zstd_);
+#endif
+  }
+
+  BlockCompressor(const BlockCompressor &) = delete;
+  BlockCompressor &operator=(const BlockCompressor &) = delete;
+
+  // replace out with the compressed block, @return false on failure
+  bool Compress(std::string_view in, std::string &out) {
+    switch (options_.type) {
+      case Compression::GZIP:
+        return Gzip(in, out);
+      case Compression::ZSTD:
+        return Zstd(in, out);
+      default:
+        out.assign(in);
+        return true;
+    }
+  }
+
+ private:
+  bool Gzip(std::string_view in, std::string &out) {
+    if (!zs_) {
+      zs_ = std::make_unique<z_stream>();
+      auto level = options_.level ? options_.level : Z_DEFAULT_COMPRESSION;
+      // 15 + 16: max window with a gzip header
+      if (deflateInit2(zs_.get(), level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        spdlog::error("[BlockCompressor] init gzip stream failed.");
+        zs_.reset();
+        return false;
+      }
+    } else {
+      deflateReset(zs_.get());
+    }
+    out.resize(deflateBound(zs_.get(), in.size()));
+    zs_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    zs_->avail_in = static_cast<uInt>(in.size());
+    zs_->next_out = reinterpret_cast<Bytef *>(out.data());
+    zs_->avail_out = static_cast<uInt>(out.size());
+    if (deflate(zs_.get(), Z_FINISH) != Z_STREAM_END) {
+      spdlog::error("[BlockCompressor] gzip compress failed.");
+      return false;
+    }
+    out.resize(zs_->total_out);
+    return true;
+  }
+
+  bool Zstd(std::string_view in, std::string &out) {
+#ifdef CPPCOMMON_WITH_ZSTD
+    if (!zstd_) zstd_ = ZSTD_createCCtx();
+    out.resize(ZSTD_compressBound(in.size()));
+    auto level = options_.level ? options_.level : ZSTD_CLEVEL_DEFAULT;
+    auto size = ZSTD_compressCCtx(zstd_, out.data(), out.size(), in.data(), in.size(), level);
+    if (ZSTD_isError(size)) {
+      spdlog::error("[BlockCompressor] zstd compress failed. [error={}]", ZSTD_getErrorName(size));
+      return false;
+    }
+    out.resize(size);
+    return true;
+#else
+    spdlog::error("[BlockCompressor] zstd is not enabled.");
+    return false;
+#endif
+  }
+
+ private:
+  CompressionOptions options_;
+  std::unique_ptr<z_stream> zs_;
+#ifdef CPPCOMMON_WITH_ZSTD
+  ZSTD_CCtx *zstd_{nullptr};
+#endif
+};
+
+struct CompressedBlock {
+  uint64_t seq{0};
+  std::string data;
+  std::string compressed;  // swapped with data once compressed, kept to reuse its capacity
+};
+
+/**
+ * Bytes of a file whose data is encoded by worker threads before it is written: exact for the blocks encoded so far,
+ * the rest is estimated by the ratio of encoded to added bytes so far, 1 until the first block is encoded, so the
+ * count runs ahead of the file rather than behind it.
+ * Add is called by the producer, Encoded by the workers, Bytes by either.
+ */
+class EncodedBytes {
+ public:
+  // bytes: written into the file directly, e.g. a header
+  inline void Reset(uint64_t bytes = 0) {
+    base_.store(bytes, std::memory_order_relaxed);
+    added_.store(0, std::memory_order_relaxed);
+    encoded_added_.store(0, std::memory_order_relaxed);
+    encoded_.store(0, std::memory_order_relaxed);
+  }
+
+  // estimated raw bytes handed to the workers, single producer
+  inline void Add(uint64_t bytes) {
+    added_.store(added_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+  }
+
+  // added: bytes of the block counted by Add, encoded: bytes of the block written into the file
+  inline void Encoded(uint64_t added, uint64_t encoded) {
+    encoded_.fetch_add(encoded, std::memory_order_relaxed);
+    encoded_added_.fetch_add(added, std::memory_order_relaxed);
+  }
+
+  // written into the file directly, e.g. a header
+  inline void Written(uint64_t bytes) { base_.fetch_add(bytes, std::memory_order_relaxed); }
+
+  uint64_t Bytes() const {
+    auto encoded = encoded_.load(std::memory_order_relaxed);
+    auto added = added_.load(std::memory_order_relaxed);
+    auto encoded_added = encoded_added_.load(std::memory_order_relaxed);
+    auto pending = added > encoded_added ? added - encoded_added : 0;
+    if (encoded_added > 0) pending = static_cast<uint64_t>(static_cast<double>(pending) * encoded / encoded_added);
+    return base_.load(std::memory_order_relaxed) + encoded + pending;
+  }
+
+ private:
+  std::atomic<uint64_t> base_{0};
+  std::atomic<uint64_t> added_{0};
+  std::atomic<uint64_t> encoded_added_{0};
+  std::atomic<uint64_t> encoded_{0};
+};
+
+/**
+ * Single producer file writer, data is cut into blocks of block_size bytes, compressed by tasks of a shared
+ * SinkExecutor and written in order. Flush compresses the blocks no task has taken yet itself, so it never waits for
+ * a busy executor.
+ */
+class CompressedFileWriter {
+ public:
+  using BlockPtr = std::unique_ptr<CompressedBlock>;
+
+  // executor: SinkExecutor::Default() if null
+  CompressedFileWriter(CompressionOptions options, size_t block_size, std::shared_ptr<SinkExecutor> executor,
+                       const FileBackendOptions &backend = {})
+      : options_(options),
+        block_size_(std::max<size_t>(1, block_size)),
+        executor_(executor ? std::move(executor) : SinkExecutor::Default()),
+        backend_(backend),
+        file_([this](BlockPtr &&block) { free_blocks_.enqueue(std::move(block)); }),
+        state_(std::make_shared<ExecutorState>()) {}
+
+  ~CompressedFileWriter() { Close(); }
+
+  bool Open(const std::string &filepath, bool append = false) {
+    bytes_.Reset();
+    dropped_rows_.store(0, std::memory_order_relaxed);
+    if (!file_.Open(filepath, append, backend_)) return false;
+    pending_ = AcquireBlock();
+    return true;
+  }
+
+  inline bool IsOpen() const { return file_.IsOpen(); }
+
+  // compressed bytes of the file, blocks not compressed yet are estimated
+  inline uint64_t BytesWritten() const { return bytes_.Bytes(); }
+
+  // lines of the blocks which failed to compress, they are not written since a raw block would corrupt the file
+  inline uint64_t DroppedRows() const { return dropped_rows_.load(std::memory_order_relaxed); }
+
+  inline void Write(std::string_view data) {
+    bytes_.Add(data.size());
+    pending_->data.append(data);
+    if (pending_->data.size() >= block_size_) {
+      Dispatch();
+    }
+  }
+
+  // block until all written data is in the file
+  inline void Flush() {
+    if (!file_.IsOpen()) return;
+    if (!pending_->data.empty()) {
+      Dispatch();
+    }
+    BlockPtr block;
+    while (state_->blocks.try_dequeue(block)) CompressAndSubmit(std::move(block));
+    file_.WaitCommitted(next_seq_);
+  }
+
+  inline bool Sync() {
+    if (!file_.IsOpen()) return false;
+    Flush();
+    return file_.Sync();
+  }
+
+  void Close() {
+    if (!file_.IsOpen()) return;
+    Flush();
+    {
+      // tasks which took a block may still be in file_.Submit
+      std::unique_lock lock(state_->mtx);
+      state_->cv.wait(lock, [this] { return state_->active == 0; });
+    }
+    file_.Close();
+  }
+
+ private:
+  // shared with executor tasks, which may run after the writer is closed and find no block
+  struct ExecutorState {
+    moodycamel::ConcurrentQueue<BlockPtr> blocks;
+    moodycamel::ConcurrentQueue<std::unique_ptr<BlockCompressor>> compressors;
+    std::mutex mtx;
+    std::condition_variable cv;
+    int active{0};  // tasks which may touch the writer
+  };
+
+  inline void CompressAndSubmit(BlockPtr &&block) {
+    std::unique_ptr<BlockCompressor> compressor;
+    if (!state_->compressors.try_dequeue(compressor)) {
+      compressor = std::make_unique<BlockCompressor>(options_);
+    }
+    auto raw = block->data.size();
+    if (compressor->Compress(block->data, block->compressed)) {
+      block->data.swap(block->compressed);
+    } else {
+      auto rows = std::count(block->data.begin(), block->data.end(), '\n');
+      spdlog::error("[CompressedFileWriter] compress failed, block dropped. [rows={}, bytes={}]", rows, raw);
+      dropped_rows_.fetch_add(rows, std::memory_order_relaxed);
+      block->data.clear();
+    }
+    bytes_.Encoded(raw, block->data.size());
+    file_.Submit(std::move(block));
+    state_->compressors.enqueue(std::move(compressor));
+  }
+
+  inline void Dispatch() {
+    pending_->seq = next_seq_++;
+    state_->blocks.enqueue(std::move(pending_));
+    executor_->Submit([this, state = state_] {
+      {
+        std::lock_guard lock(state->mtx);
+        ++state->active;
+      }
+      BlockPtr block;
+      if (state->blocks.try_dequeue(block)) CompressAndSubmit(std::move(block));
+      std::lock_guard lock(state->mtx);
+      if (--state->active == 0) state->cv.notify_all();
+    });
+    pending_ = AcquireBlock();
+  }
+
+  inline BlockPtr AcquireBlock() {
+    BlockPtr block;
+    if (!free_blocks_.try_dequeue(block)) {
+      block = std::make_unique<CompressedBlock>();
+    }
+    block->data.clear();
+    return block;
+  }
+
+ private:
+  CompressionOptions options_;
+  size_t block_size_;
+  std::shared_ptr<SinkExecutor> executor_;
+  FileBackendOptions backend_;
+  moodycamel::ConcurrentQueue<BlockPtr> free_blocks_;
+  OrderedFileWriter<CompressedBlock> file_;
+  std::shared_ptr<ExecutorState> state_;
+  BlockPtr pending_;
+  uint64_t next_seq_{0};
+  EncodedBytes bytes_;
+  std::atomic<uint64_t> dropped_rows_{0};
+};
+}  // namespace cppcommon::os
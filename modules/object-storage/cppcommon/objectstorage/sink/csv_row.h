@@ -0,0 +1,130 @@
+/**
+ * @file csv_row.h
+ * @brief csv row types
+ * @author zhenkai.sun
+ * @date 2025-06-13 11:05:12
+ */
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "concurrentqueue/concurrentqueue.h"
+#include "cppcommon/partterns/singleton.h"
+
+namespace cppcommon::os {
+using CsvRow = std::vector<std::string>;
+
+/**
+ * All fields are stored in one contiguous buffer, field i is data_[ends_[i - 1], ends_[i]).
+ * A new row costs two allocations, a row acquired from CsvFlatRowPool costs none.
+ */
+class CsvFlatRow {
+ public:
+  CsvFlatRow() = default;
+
+  CsvFlatRow(std::initializer_list<std::string_view> fields) {
+    ends_.reserve(fields.size());
+    for (auto field : fields) Append(field);
+  }
+
+  // keeps the CsvRow interface working
+  CsvFlatRow(const CsvRow &row) {  // NOLINT
+    size_t bytes = 0;
+    for (auto &field : row) bytes += field.size();
+    Reserve(bytes, row.size());
+    for (auto &field : row) Append(field);
+  }
+
+  inline CsvFlatRow &Append(std::string_view field) {
+    data_.append(field);
+    ends_.push_back(static_cast<uint32_t>(data_.size()));
+    return *this;
+  }
+
+  template <typename T>
+    requires(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>)
+  inline CsvFlatRow &Append(T value) {
+    char buf[64];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    return Append(std::string_view(buf, r.ptr - buf));
+  }
+
+  inline std::string_view operator[](size_t i) const {
+    uint32_t begin = i == 0 ? 0 : ends_[i - 1];
+    return std::string_view(data_).substr(begin, ends_[i] - begin);
+  }
+
+  inline size_t size() const { return ends_.size(); }
+  inline bool empty() const { return ends_.empty(); }
+
+  // keeps the capacity
+  inline void clear() {
+    data_.clear();
+    ends_.clear();
+  }
+
+  inline void Reserve(size_t bytes, size_t fields) {
+    data_.reserve(bytes);
+    ends_.reserve(fields);
+  }
+
+  inline size_t ByteSize() const { return data_.size() + ends_.size() * sizeof(uint32_t); }
+  inline size_t Capacity() const { return data_.capacity() + ends_.capacity() * sizeof(uint32_t); }
+
+  inline CsvRow ToRow() const {
+    CsvRow row;
+    row.reserve(size());
+    for (size_t i = 0; i < size(); ++i) row.emplace_back((*this)[i]);
+    return row;
+  }
+
+ private:
+  std::string data_;
+  std::vector<uint32_t> ends_;
+};
+
+/**
+ * Recycled rows, CsvWriter releases rows here after formatting them.
+ * usage:
+ *   auto row = CsvFlatRowPool::Instance().Acquire();
+ *   row.Append("a").Append(1);
+ *   sink.Write(std::move(row));
+ */
+class CsvFlatRowPool : public Singleton<CsvFlatRowPool> {
+ public:
+  static constexpr size_t kMaxPooledRows = 64 * 1024;
+  static constexpr size_t kMaxPooledRowCapacity = 64 * 1024;  // bytes, larger rows are freed
+
+  inline CsvFlatRow Acquire() {
+    CsvFlatRow row;
+    if (rows_.try_dequeue(row)) {
+      size_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return row;
+  }
+
+  inline void Release(CsvFlatRow &&row) {
+    if (row.Capacity() > kMaxPooledRowCapacity || size_.load(std::memory_order_relaxed) >= kMaxPooledRows) return;
+    row.clear();
+    size_.fetch_add(1, std::memory_order_relaxed);
+    rows_.enqueue(std::move(row));
+  }
+
+  inline size_t Size() const { return size_.load(std::memory_order_relaxed); }
+
+ private:
+  moodycamel::ConcurrentQueue<CsvFlatRow> rows_;
+  std::atomic<size_t> size_{0};
+};
+
+inline void RecycleCsvRow(CsvRow &&) {}
+inline void RecycleCsvRow(CsvFlatRow &&row) { CsvFlatRowPool::Instance().Release(std::move(row)); }
+}  // namespace cppcommon::os
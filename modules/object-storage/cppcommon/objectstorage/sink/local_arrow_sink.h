@@ -10,32 +10,173 @@
 #include <arrow/filesystem/s3fs.h>
 #include <arrow/io/api.h>
 #include <arrow/io/type_fwd.h>
+#include <arrow/ipc/reader.h>
 #include <arrow/ipc/writer.h>
 #include <arrow/record_batch.h>
 #include <arrow/result.h>
 #include <arrow/status.h>
 #include <arrow/type.h>
 #include <arrow/type_fwd.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/compression.h>
 #include <parquet/arrow/writer.h>
 #include <parquet/properties.h>
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/compression.h"
+#include "cppcommon/objectstorage/sink/output_file.h"
 
 namespace cppcommon::os {
+using RecordBatchSpan = std::span<std::shared_ptr<arrow::RecordBatch>>;
+
+// zero copy, the table shares column chunks with records
+inline arrow::Result<std::shared_ptr<arrow::Table>> ToTable(RecordBatchSpan records) {
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches(records.begin(), records.end());
+  return arrow::Table::FromRecordBatches(batches);
+}
+
+template <>
+struct RecordByteSize<std::shared_ptr<arrow::RecordBatch>> {
+  inline size_t operator()(const std::shared_ptr<arrow::RecordBatch> &record) const {
+    return record ? arrow::util::TotalBufferSize(*record) : 0;
+  }
+};
+
+template <>
+struct RecordByteSize<std::shared_ptr<arrow::Table>> {
+  inline size_t operator()(const std::shared_ptr<arrow::Table> &record) const {
+    return record ? arrow::util::TotalBufferSize(*record) : 0;
+  }
+};
+
+// record batches are spilled in the arrow ipc stream format
+template <>
+struct SpillCodec<std::shared_ptr<arrow::RecordBatch>> {
+  static constexpr bool kSupported = true;
+  static inline void Encode(const std::shared_ptr<arrow::RecordBatch> &record, std::string &out) {
+    auto sink = arrow::io::BufferOutputStream::Create().ValueOrDie();
+    auto writer = arrow::ipc::MakeStreamWriter(sink, record->schema()).ValueOrDie();
+    if (!writer->WriteRecordBatch(*record).ok() || !writer->Close().ok()) {
+      spdlog::error("[SpillCodec] encode record batch failed.");
+      return;
+    }
+    auto buffer = sink->Finish().ValueOrDie();
+    out.append(reinterpret_cast<const char *>(buffer->data()), buffer->size());
+  }
+  static inline bool Decode(std::string_view payload, std::shared_ptr<arrow::RecordBatch> &record) {
+    // copied, the payload is only valid until the next read
+    auto buffer = arrow::Buffer::FromString(std::string(payload));
+    auto reader = arrow::ipc::RecordBatchStreamReader::Open(std::make_shared<arrow::io::BufferReader>(buffer));
+    if (!reader.ok()) return false;
+    auto status = (*reader)->ReadNext(&record);
+    return status.ok() && record;
+  }
+};
+
+struct ParquetWriterOptions {
+  arrow::Compression::type compression{arrow::Compression::UNCOMPRESSED};
+  int compression_level{0};  // 0: default level of the codec
+  bool dictionary{true};
+  int64_t data_page_size{1024 * 1024};
+  bool statistics{true};
+  // encode the columns of a row group in parallel on the arrow cpu pool, shared by all writers of the process
+  bool use_threads{false};
+  int64_t max_row_group_length{0};  // rows, 0: default of the writer
+  int64_t row_group_bytes{128 * 1024 * 1024};  // ArrowParquetWriterV2 flushes a row group once it buffers that much
+};
+
+struct IpcWriterOptions {
+  arrow::Compression::type compression{arrow::Compression::UNCOMPRESSED};  // LZ4_FRAME or ZSTD, buffer compression
+  // runs of batches with fewer rows are copied into one batch, larger batches are written as they are
+  int64_t combine_rows{1024};
+};
+
+struct ArrowWriterOptions {
+  FileBackendOptions file;
+  ParquetWriterOptions parquet;
+  IpcWriterOptions ipc;
+};
+
+inline std::shared_ptr<parquet::WriterProperties> MakeParquetProperties(const ParquetWriterOptions &options,
+                                                                        int64_t max_row_group_length) {
+  parquet::WriterProperties::Builder builder;
+  builder.compression(options.compression);
+  if (options.compression_level) builder.compression_level(options.compression_level);
+  options.dictionary ? builder.enable_dictionary() : builder.disable_dictionary();
+  builder.data_pagesize(options.data_page_size);
+  options.statistics ? builder.enable_statistics() : builder.disable_statistics();
+  builder.max_row_group_length(options.max_row_group_length ? options.max_row_group_length : max_row_group_length);
+  return builder.build();
+}
+
+inline std::shared_ptr<parquet::ArrowWriterProperties> MakeArrowParquetProperties(const ParquetWriterOptions &options) {
+  return parquet::ArrowWriterProperties::Builder().set_use_threads(options.use_threads)->build();
+}
+
+// arrow output stream over OutputFile
+class OutputFileStream : public arrow::io::OutputStream {
+ public:
+  static arrow::Result<std::shared_ptr<OutputFileStream>> Open(const std::string &filepath,
+                                                               const FileBackendOptions &options) {
+    auto stream = std::shared_ptr<OutputFileStream>(new OutputFileStream(options));
+    if (!stream->file_.Open(filepath)) {
+      return arrow::Status::IOError("open file failed: ", filepath);
+    }
+    return stream;
+  }
+
+  arrow::Status Close() override {
+    if (!file_.IsOpen()) return arrow::Status::OK();
+    return file_.Close() ? arrow::Status::OK() : arrow::Status::IOError("close file failed: ", file_.FilePath());
+  }
+
+  bool closed() const override { return !file_.IsOpen(); }
+
+  arrow::Result<int64_t> Tell() const override { return file_.Tell(); }
+
+  arrow::Status Write(const void *data, int64_t nbytes) override {
+    if (file_.Write(static_cast<const char *>(data), static_cast<size_t>(nbytes))) return arrow::Status::OK();
+    return arrow::Status::IOError("write file failed: ", file_.FilePath());
+  }
+
+  arrow::Status Flush() override {
+    return file_.Flush() ? arrow::Status::OK() : arrow::Status::IOError("flush file failed: ", file_.FilePath());
+  }
+
+ private:
+  explicit OutputFileStream(const FileBackendOptions &options) : file_(options) {}
+
+ private:
+  OutputFile file_;
+};
+
 template <typename Writer, typename Record>
 class ArrowLocalSinkBase : public SinkFileSystem<Record> {
  public:
+  ArrowLocalSinkBase() = default;
+  explicit ArrowLocalSinkBase(const ArrowWriterOptions &options) : options_(options) {}
+
   void Open(const std::string &filepath) override {
-    ofs_ = arrow::io::FileOutputStream::Open(filepath).ValueOrDie();
+    if (options_.file.type == FileBackend::STREAM) {
+      ofs_ = arrow::io::FileOutputStream::Open(filepath).ValueOrDie();
+    } else {
+      ofs_ = OutputFileStream::Open(filepath, options_.file).ValueOrDie();
+    }
     filepath_ = filepath;
+    bytes_.Reset();
+    taken_bytes_ = 0;
+    stream_bytes_ = 0;
   }
 
   bool IsOpen() override { return static_cast<bool>(ofs_); }
@@ -50,6 +191,8 @@ class ArrowLocalSinkBase : public SinkFileSystem<Record> {
           spdlog::error("[ArrowLocalSinkBase] close file failed. [filepath={}]", filepath_);
         }
       }
+      // exact once the footer is written
+      if (auto tell = ofs_->Tell(); tell.ok()) bytes_.Reset(*tell);
       /* ofs_ */ {
         auto s = ofs_->Close();
         ofs_.reset();
@@ -71,125 +214,312 @@ class ArrowLocalSinkBase : public SinkFileSystem<Record> {
     }
   }
 
+  // parquet and ipc files are unreadable until the footer is written by Close, so no row is durable before,
+  // WriteDurable reports SYNC_FAILED instead of claiming rows which are only in memory, DurabilityMode is rejected
+  inline bool Sync() override { return false; }
+
+  /**
+   * Bytes in the stream, plus rows the writer still buffers, e.g. a parquet row group, estimated by their in-memory
+   * size scaled by the ratio of the rows already in the stream.
+   */
+  uint64_t BytesWritten() const override {
+    if (ofs_) {
+      auto tell = ofs_->Tell();
+      if (tell.ok() && *tell > stream_bytes_) {
+        bytes_.Encoded(std::exchange(taken_bytes_, 0), *tell - stream_bytes_);
+        stream_bytes_ = *tell;
+      }
+    }
+    return bytes_.Bytes();
+  }
+
  protected:
-  std::shared_ptr<arrow::io::FileOutputStream> ofs_;
+  // rows taken by the writer, bytes: their in-memory size
+  inline void Taken(uint64_t bytes) {
+    bytes_.Add(bytes);
+    taken_bytes_ += bytes;
+  }
+
+  // written by a new writer before any row, e.g. the parquet magic, not counted against the rows
+  inline void CountHeader() {
+    auto tell = ofs_->Tell();
+    if (tell.ok() && *tell > stream_bytes_) {
+      bytes_.Written(*tell - stream_bytes_);
+      stream_bytes_ = *tell;
+    }
+  }
+
+  // for writers which hand every row to the stream at once, e.g. csv
+  inline bool SyncStream() {
+    if (!ofs_ || options_.file.type == FileBackend::OBJECT) return false;
+    Flush();
+    return SyncFileData(filepath_);
+  }
+
+  inline void EnsureParquetWriter(const std::shared_ptr<arrow::Schema> &schema, int64_t max_row_group_length) {
+    if (!writer_) {
+      writer_ = Writer::Open(*schema, arrow::default_memory_pool(), ofs_,
+                             MakeParquetProperties(options_.parquet, max_row_group_length),
+                             MakeArrowParquetProperties(options_.parquet))
+                    .ValueOrDie();
+      CountHeader();
+    }
+  }
+
+  ArrowWriterOptions options_;
+  std::shared_ptr<arrow::io::OutputStream> ofs_;
   std::shared_ptr<Writer> writer_;
   std::string filepath_;
+  // updated by BytesWritten, when the stream grows by a row group or a batch
+  mutable EncodedBytes bytes_;
+  mutable uint64_t taken_bytes_{0};
+  mutable int64_t stream_bytes_{0};
 };
 
 class ArrowTableParquetWriter : public ArrowLocalSinkBase<parquet::arrow::FileWriter, std::shared_ptr<arrow::Table>> {
  public:
+  using ArrowLocalSinkBase::ArrowLocalSinkBase;
+
   inline int Write(std::shared_ptr<arrow::Table> &&record) override {
-    if (!writer_) {
-      std::shared_ptr<parquet::WriterProperties> props = parquet::WriterProperties::Builder().build();
-      // .compression(arrow::Compression::SNAPPY)
-      std::shared_ptr<parquet::ArrowWriterProperties> arrow_props =
-          parquet::ArrowWriterProperties::Builder().set_use_threads(false)->build();
-      writer_ = parquet::arrow::FileWriter::Open(*record->schema().get(), arrow::default_memory_pool(), ofs_, props,
-                                                 arrow_props)
-                    .ValueOrDie();
-    }
+    EnsureWriter(record->schema());
     auto s = writer_->WriteTable(*record);
     if (s.ok()) {
+      Taken(RecordByteSize<std::shared_ptr<arrow::Table>>{}(record));
       return record->num_rows();
     } else {
       spdlog::error("write arrow::Table failed. [error={}]", s.ToString());
       return 0;
     }
   }
+
+  inline int WriteBatch(std::span<std::shared_ptr<arrow::Table>> records) override {
+    auto table = arrow::ConcatenateTables(std::vector<std::shared_ptr<arrow::Table>>(records.begin(), records.end()));
+    if (!table.ok()) {
+      // e.g. schema mismatch, write tables one by one
+      return ArrowLocalSinkBase::WriteBatch(records);
+    }
+    return Write(std::move(table).ValueOrDie());
+  }
+
+ private:
+  inline void EnsureWriter(const std::shared_ptr<arrow::Schema> &schema) {
+    EnsureParquetWriter(schema, parquet::DEFAULT_MAX_ROW_GROUP_LENGTH);
+  }
 };
 
 class ArrowParquetWriter : public ArrowLocalSinkBase<parquet::arrow::FileWriter, std::shared_ptr<arrow::RecordBatch>> {
  public:
+  using ArrowLocalSinkBase::ArrowLocalSinkBase;
+
   inline int Write(std::shared_ptr<arrow::RecordBatch> &&record) override {
     if (!ofs_) {
       spdlog::error("write arrow::RecordBatch failed, file stream not ready.");
       return 0;
     }
-    if (!writer_) {
-      std::shared_ptr<parquet::WriterProperties> props =
-          parquet::WriterProperties::Builder().max_row_group_length(1024 * 10)->build();
-      // .compression(arrow::Compression::SNAPPY)
-      std::shared_ptr<parquet::ArrowWriterProperties> arrow_props =
-          parquet::ArrowWriterProperties::Builder().set_use_threads(false)->build();
-      writer_ = parquet::arrow::FileWriter::Open(*record->schema().get(), arrow::default_memory_pool(), ofs_, props,
-                                                 arrow_props)
-                    .ValueOrDie();
-    }
+    EnsureWriter(record->schema());
     auto s = writer_->WriteRecordBatch(*record);
     if (s.ok()) {
+      Taken(RecordByteSize<std::shared_ptr<arrow::RecordBatch>>{}(record));
       return record->num_rows();
     } else {
       spdlog::error("write arrow::RecordBatch failed. [error={}]", s.ToString());
       return 0;
     }
   }
+
+  inline int WriteBatch(RecordBatchSpan records) override {
+    // the buffered row group takes the batches one by one, without combining them into a copy first
+    int rows = 0;
+    for (auto &record : records) rows += Write(std::move(record));
+    return rows;
+  }
+
+ private:
+  inline void EnsureWriter(const std::shared_ptr<arrow::Schema> &schema) { EnsureParquetWriter(schema, 1024 * 10); }
 };
 
+/**
+ * Buffers record batches until row_group_bytes, then writes them as one row group. Its columns are encoded in
+ * parallel only with ParquetWriterOptions::use_threads. Peak memory is bounded by the budget instead of the file size.
+ */
 class ArrowParquetWriterV2
     : public ArrowLocalSinkBase<parquet::arrow::FileWriter, std::shared_ptr<arrow::RecordBatch>> {
  public:
+  using ArrowLocalSinkBase::ArrowLocalSinkBase;
+
   inline int Write(std::shared_ptr<arrow::RecordBatch> &&record) override {
+    if (!ofs_) {
+      spdlog::error("write arrow::RecordBatch failed, file stream not ready.");
+      return 0;
+    }
     auto count = record->num_rows();
+    auto bytes = RecordByteSize<std::shared_ptr<arrow::RecordBatch>>{}(record);
+    buffered_bytes_ += bytes;
+    Taken(bytes);
+    buffered_rows_ += count;
     records_.emplace_back(std::move(record));
+    auto max_rows = options_.parquet.max_row_group_length;
+    if (buffered_bytes_ >= options_.parquet.row_group_bytes || (max_rows && buffered_rows_ >= max_rows)) {
+      FlushRowGroup();
+    }
     return count;
   }
 
   void Close() override {
-    if (!records_.empty()) {
-      auto record = records_.front();
-      std::shared_ptr<parquet::WriterProperties> props = parquet::WriterProperties::Builder().build();
-      // .compression(arrow::Compression::SNAPPY)
-      std::shared_ptr<parquet::ArrowWriterProperties> arrow_props =
-          parquet::ArrowWriterProperties::Builder().set_use_threads(false)->build();
-      writer_ = parquet::arrow::FileWriter::Open(*record->schema().get(), arrow::default_memory_pool(), ofs_, props,
-                                                 arrow_props)
-                    .ValueOrDie();
+    FlushRowGroup();
+    ArrowLocalSinkBase::Close();
+  }
 
-      auto maybe_table = arrow::Table::FromRecordBatches(records_);
-      if (!maybe_table.ok()) {
-        spdlog::error("sink arrow RecordBatch failed: {}", maybe_table.status().ToString());
-      } else {
-        std::shared_ptr<arrow::Table> table = maybe_table.ValueOrDie();
-        auto s = writer_->WriteTable(*table);
-        if (!s.ok()) {
-          spdlog::error("write arrow::Table failed. [error={}]", s.ToString());
-        }
-        table.reset();
+ private:
+  void FlushRowGroup() {
+    if (records_.empty()) return;
+    auto maybe_table = ToTable(records_);
+    if (!maybe_table.ok()) {
+      spdlog::error("sink arrow RecordBatch failed: {}", maybe_table.status().ToString());
+    } else {
+      auto &table = *maybe_table;
+      // row groups are cut by the byte budget, not by the writer
+      EnsureParquetWriter(table->schema(), std::numeric_limits<int64_t>::max());
+      // one row group of all buffered rows
+      auto s = writer_->WriteTable(*table, std::max<int64_t>(1, buffered_rows_));
+      if (!s.ok()) {
+        spdlog::error("write arrow::Table failed. [error={}]", s.ToString());
       }
-      records_.clear();
     }
-
-    ArrowLocalSinkBase::Close();
+    records_.clear();
+    buffered_bytes_ = 0;
+    buffered_rows_ = 0;
   }
 
  private:
   std::vector<std::shared_ptr<arrow::RecordBatch>> records_;
+  int64_t buffered_bytes_{0};
+  int64_t buffered_rows_{0};
 };
 
 class ArrowCsvWriter : public ArrowLocalSinkBase<arrow::ipc::RecordBatchWriter, std::shared_ptr<arrow::RecordBatch>> {
  public:
+  using ArrowLocalSinkBase::ArrowLocalSinkBase;
+  static constexpr bool kSyncSupported = true;
+
   inline int Write(std::shared_ptr<arrow::RecordBatch> &&record) override {
     if (!ofs_) {
       spdlog::error("write arrow::RecordBatch failed, file stream not ready.");
       return 0;
     }
+    EnsureWriter(record->schema());
+    auto s = writer_->WriteRecordBatch(*record);
+    if (s.ok()) {
+      Taken(RecordByteSize<std::shared_ptr<arrow::RecordBatch>>{}(record));
+      return record->num_rows();
+    } else {
+      spdlog::error("write arrow::RecordBatch failed. [error={}]", s.ToString());
+      return 0;
+    }
+  }
+
+  inline int WriteBatch(RecordBatchSpan records) override {
+    auto table = ToTable(records);
+    if (!ofs_ || !table.ok()) {
+      return ArrowLocalSinkBase::WriteBatch(records);
+    }
+    EnsureWriter((*table)->schema());
+    auto s = writer_->WriteTable(**table);
+    if (s.ok()) {
+      Taken(RecordByteSize<std::shared_ptr<arrow::Table>>{}(*table));
+      return (*table)->num_rows();
+    } else {
+      spdlog::error("write arrow::Table failed. [error={}]", s.ToString());
+      return 0;
+    }
+  }
+
+  // rows are written into the stream by every Write
+  inline bool Sync() override { return SyncStream(); }
+
+ private:
+  inline void EnsureWriter(const std::shared_ptr<arrow::Schema> &schema) {
     if (!writer_) {
       auto ops = arrow::csv::WriteOptions::Defaults();
-      writer_ = arrow::csv::MakeCSVWriter(ofs_, record->schema(), ops).ValueOrDie();
+      writer_ = arrow::csv::MakeCSVWriter(ofs_, schema, ops).ValueOrDie();
+      CountHeader();
+    }
+  }
+};
+
+// arrow ipc file format (feather v2), read back with ReadMappedIpcFile
+class ArrowIpcWriter : public ArrowLocalSinkBase<arrow::ipc::RecordBatchWriter, std::shared_ptr<arrow::RecordBatch>> {
+ public:
+  using ArrowLocalSinkBase::ArrowLocalSinkBase;
+
+  inline int Write(std::shared_ptr<arrow::RecordBatch> &&record) override {
+    if (!ofs_) {
+      spdlog::error("write arrow::RecordBatch failed, file stream not ready.");
+      return 0;
     }
+    EnsureWriter(record->schema());
     auto s = writer_->WriteRecordBatch(*record);
     if (s.ok()) {
+      Taken(RecordByteSize<std::shared_ptr<arrow::RecordBatch>>{}(record));
       return record->num_rows();
     } else {
       spdlog::error("write arrow::RecordBatch failed. [error={}]", s.ToString());
       return 0;
     }
   }
+
+  inline int WriteBatch(RecordBatchSpan records) override {
+    // each batch costs a message header and a footer block, so only small ones are worth the copy
+    int rows = 0;
+    for (size_t i = 0; i < records.size();) {
+      auto j = i;
+      while (j < records.size() && records[j]->num_rows() < options_.ipc.combine_rows) ++j;
+      if (j - i > 1) {
+        rows += WriteCombined(records.subspan(i, j - i));
+      } else {
+        j = i + 1;
+        rows += Write(std::move(records[i]));
+      }
+      i = j;
+    }
+    return rows;
+  }
+
+ private:
+  inline void EnsureWriter(const std::shared_ptr<arrow::Schema> &schema) {
+    if (!writer_) {
+      auto ops = arrow::ipc::IpcWriteOptions::Defaults();
+      if (options_.ipc.compression != arrow::Compression::UNCOMPRESSED) {
+        auto codec = arrow::util::Codec::Create(options_.ipc.compression);
+        if (codec.ok()) {
+          ops.codec = std::move(codec).ValueOrDie();
+        } else {
+          spdlog::error("[ArrowIpcWriter] create codec failed, uncompressed. [error={}]", codec.status().ToString());
+        }
+      }
+      writer_ = arrow::ipc::MakeFileWriter(ofs_, schema, ops).ValueOrDie();
+      CountHeader();
+    }
+  }
+
+  inline int WriteCombined(RecordBatchSpan records) {
+    auto table = ToTable(records);
+    if (!table.ok()) {
+      return ArrowLocalSinkBase::WriteBatch(records);
+    }
+    auto batch = (*table)->CombineChunksToBatch();
+    if (!batch.ok()) {
+      return ArrowLocalSinkBase::WriteBatch(records);
+    }
+    return Write(std::move(batch).ValueOrDie());
+  }
 };
 
-using LocalArrowTableSink = BaseSink<std::shared_ptr<arrow::Table>, ArrowTableParquetWriter>;
-using LocalArrowRecordBatchSinkV1 = BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowParquetWriter>;
-using LocalArrowRecordBatchSink = BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowParquetWriterV2>;
-using ArrowCsvLocalSink = BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowCsvWriter>;
+using LocalArrowTableSink = BaseSink<std::shared_ptr<arrow::Table>, ArrowTableParquetWriter, ArrowWriterOptions>;
+using LocalArrowRecordBatchSinkV1 =
+    BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowParquetWriter, ArrowWriterOptions>;
+using LocalArrowRecordBatchSink =
+    BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowParquetWriterV2, ArrowWriterOptions>;
+using ArrowCsvLocalSink = BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowCsvWriter, ArrowWriterOptions>;
+using LocalArrowIpcSink = BaseSink<std::shared_ptr<arrow::RecordBatch>, ArrowIpcWriter, ArrowWriterOptions>;
 }  // namespace cppcommon::os
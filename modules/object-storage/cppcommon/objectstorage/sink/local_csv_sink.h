@@ -11,116 +11,340 @@
 
 #include <algorithm>
 #include <atomic>
-#include <fstream>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
 #include <mutex>
-#include <sstream>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "concurrentqueue/blockingconcurrentqueue.h"
-#include "cppcommon/extends/csv/csv.h"
 #include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/compression.h"
+#include "cppcommon/objectstorage/sink/csv_row.h"
+#include "cppcommon/objectstorage/sink/ordered_file_writer.h"
+#include "cppcommon/objectstorage/sink/sink_executor.h"
 
 namespace cppcommon::os {
 
 struct CsvWriterOptions {
   std::vector<std::string> headers;
   unsigned int writer_threads_count{std::max(1u, std::thread::hardware_concurrency() / 2)};
+  size_t chunk_rows{1024};  // rows formatted by one writer thread at a time
+  CompressionOptions compression;  // every chunk is compressed into an independent block
+  FileBackendOptions file;
+  std::shared_ptr<SinkExecutor> executor;  // format chunks on it instead of writer_threads_count threads per file
 };
 
-template <class OutputStream, char Delim>
-using CstCSVWriter = csv::DelimWriter<OutputStream, Delim, '"', false>;
+// RFC 4180, quote the field only when necessary (same as csv::DelimWriter with quote_minimal)
+template <char Delim, char Quote = '"'>
+inline void AppendCsvField(std::string &out, std::string_view field) {
+  static constexpr char kSpecials[] = {Quote, Delim, '\r', '\n'};
+  if (field.find_first_of(std::string_view(kSpecials, sizeof(kSpecials))) == std::string_view::npos) {
+    out.append(field);
+    return;
+  }
+  out.push_back(Quote);
+  for (auto ch : field) {
+    if (ch == Quote) out.push_back(Quote);
+    out.push_back(ch);
+  }
+  out.push_back(Quote);
+}
 
-static const int64_t kCsvWriterBufferSize = 4 * 1024 * 1024;  // 4MB
+template <char Delim, typename Row>
+inline void AppendCsvRow(std::string &out, const Row &row) {
+  for (size_t i = 0; i < row.size(); ++i) {
+    if (i) out.push_back(Delim);
+    AppendCsvField<Delim>(out, row[i]);
+  }
+  out.push_back('\n');
+}
 
-using CsvRow = std::vector<std::string>;
-template <char Delim>
-class CsvWriter : public SinkFileSystem<CsvRow> {
+template <>
+struct RecordByteSize<CsvRow> {
+  inline size_t operator()(const CsvRow &record) const {
+    size_t size = sizeof(CsvRow);
+    for (auto &field : record) size += sizeof(std::string) + field.size();
+    return size;
+  }
+};
+
+template <>
+struct RecordByteSize<CsvFlatRow> {
+  inline size_t operator()(const CsvFlatRow &record) const { return sizeof(CsvFlatRow) + record.ByteSize(); }
+};
+
+template <>
+struct SpillCodec<CsvRow> {
+  static constexpr bool kSupported = true;
+  static inline void Encode(const CsvRow &record, std::string &out) { EncodeSpillFields(record, out); }
+  static inline bool Decode(std::string_view payload, CsvRow &record) {
+    record.clear();
+    return DecodeSpillFields(payload, [&record](std::string_view field) { record.emplace_back(field); });
+  }
+};
+
+template <>
+struct SpillCodec<CsvFlatRow> {
+  static constexpr bool kSupported = true;
+  static inline void Encode(const CsvFlatRow &record, std::string &out) { EncodeSpillFields(record, out); }
+  static inline bool Decode(std::string_view payload, CsvFlatRow &record) {
+    record.clear();
+    return DecodeSpillFields(payload, [&record](std::string_view field) { record.Append(field); });
+  }
+};
+
+template <typename Row>
+struct CsvChunk {
+  uint64_t seq{0};
+  std::vector<Row> rows;
+  std::string data;  // formatted rows
+  uint64_t estimated{0};  // bytes of rows counted before formatting
+};
+
+/**
+ * Rows are grouped into chunks with sequence numbers, writer threads format whole chunks into reusable buffers,
+ * and the chunks are written into the file in sequence order, so the row order is kept.
+ * With CsvWriterOptions::executor, chunks are formatted by executor tasks, and Flush formats the chunks no task has
+ * taken yet itself, so it never waits for a busy executor.
+ * Row: CsvRow or CsvFlatRow
+ */
+template <char Delim, typename Row = CsvRow>
+class CsvWriter : public SinkFileSystem<Row> {
  public:
-  explicit CsvWriter(const CsvWriterOptions &options) : options_(&options) {}
+  using Chunk = CsvChunk<Row>;
+  using ChunkPtr = std::unique_ptr<Chunk>;
+  static constexpr bool kSyncSupported = true;
+
+  explicit CsvWriter(const CsvWriterOptions &options)
+      : options_(&options), file_([this](ChunkPtr &&chunk) { free_chunks_.enqueue(std::move(chunk)); }) {
+    if (options.executor) executor_state_ = std::make_shared<ExecutorState>();
+  }
+
+  ~CsvWriter() override { Close(); }
+
   void Open(const std::string &filepath) override {
     filepath_ = filepath;
-    ofs_.open(filepath, std::ios::out | std::ios::binary);  // | std::ios::app
-
-    static thread_local std::vector<char> buf(kCsvWriterBufferSize);
-    ofs_.rdbuf()->pubsetbuf(buf.data(), buf.size());
+    bytes_.Reset();
+    dropped_rows_.store(0, std::memory_order_relaxed);
+    if (!file_.Open(filepath, false, options_->file)) return;
 
-    writer_ = csv::make_csv_writer_ptr<Delim, false>(ofs_);
     header_size_ = options_->headers.size();
     if (header_size_) {
-      *writer_ << options_->headers;
+      std::string header;
+      AppendCsvRow<Delim>(header, options_->headers);
+      if (options_->compression.type != Compression::NONE) {
+        std::string compressed;
+        BlockCompressor(options_->compression).Compress(header, compressed);
+        header.swap(compressed);
+      }
+      bytes_.Reset(header.size());
+      file_.WriteDirect(header);
     }
+    pending_ = AcquireChunk();
+    if (executor_state_) return;
     // start writer threads
-    for (unsigned int i = 0; i < options_->writer_threads_count; ++i) {
+    for (unsigned int i = 0; i < std::max(1u, options_->writer_threads_count); ++i) {
       writer_threads_.emplace_back(&CsvWriter::WriteThreadFunc, this);
     }
   }
 
   inline void WriteThreadFunc() {
-    CsvRow record;
-    while (running_ || queue_.size_approx() != 0) {
-      queue_.wait_dequeue(record);
+    Formatter formatter(options_->compression);
+    ChunkPtr chunk;
+    while (true) {
+      format_queue_.wait_dequeue(chunk);
       // terminate signal
-      if (!running_ && record.empty()) {
-        break;
-      }
-      {
-        std::ostringstream oss;
-        writer_->WriteTo(oss, record);
-        {
-          std::lock_guard lock(ofs_mtx_);
-          ofs_.write(oss.str().data(), oss.str().size());
-        }
-      }
+      if (!chunk) break;
+      Format(*chunk, formatter);
+      file_.Submit(std::move(chunk));
     }
   }
 
-  inline int Write(CsvRow &&record) override {
+  inline int Write(Row &&record) override {
     if (header_size_ && header_size_ != record.size()) {
       spdlog::error("[CsvWriter] unexpected columns size. [header={}, record={}]", header_size_, record.size());
       return 0;
     }
-    queue_.enqueue(std::forward<CsvRow>(record));
+    auto estimated = EstimateRowBytes(record);
+    pending_->estimated += estimated;
+    bytes_.Add(estimated);
+    pending_->rows.emplace_back(std::forward<Row>(record));
+    if (pending_->rows.size() >= options_->chunk_rows) {
+      Dispatch();
+    }
     return 1;
   }
 
-  bool IsOpen() override { return ofs_.is_open(); }
+  inline int WriteBatch(std::span<Row> records) override {
+    int rows = 0;
+    for (auto &record : records) {
+      rows += CsvWriter::Write(std::move(record));
+    }
+    return rows;
+  }
+
+  bool IsOpen() override { return file_.IsOpen(); }
+
+  // bytes of the file, exact for the chunks formatted so far, the rest estimated from the raw fields
+  uint64_t BytesWritten() const override { return bytes_.Bytes(); }
+
+  // rows of the chunks which failed to compress, they are not written since a raw chunk would corrupt the file
+  uint64_t DroppedRows() const override { return dropped_rows_.load(std::memory_order_relaxed); }
 
   void Close() override {
-    running_ = false;
+    if (!file_.IsOpen()) return;
+    Flush();
+    if (executor_state_) {
+      // tasks which took a chunk may still be in file_.Submit
+      std::unique_lock lock(executor_state_->mtx);
+      executor_state_->cv.wait(lock, [this] { return executor_state_->active == 0; });
+    }
     // sending terminate signals
     for (size_t i = 0; i < writer_threads_.size(); ++i) {
-      queue_.enqueue({});
+      format_queue_.enqueue(nullptr);
     }
     for (auto &th : writer_threads_) {
       if (th.joinable()) th.join();
     }
-    if (ofs_) {
-      ofs_.flush();
-      ofs_.close();
-    }
+    writer_threads_.clear();
+    file_.Close();
   }
 
+  // block until all written rows are in the file
   inline void Flush() override {
-    if (ofs_) ofs_.flush();
+    if (!file_.IsOpen()) return;
+    if (!pending_->rows.empty()) {
+      Dispatch();
+    }
+    if (executor_state_) {
+      ChunkPtr chunk;
+      while (executor_state_->chunks.try_dequeue(chunk)) FormatAndSubmit(std::move(chunk));
+    }
+    file_.WaitCommitted(next_seq_);
+  }
+
+  inline bool Sync() override {
+    if (!file_.IsOpen()) return false;
+    Flush();
+    return file_.Sync();
+  }
+
+ protected:
+  struct Formatter {
+    explicit Formatter(const CompressionOptions &options) : compressor(options) {}
+    BlockCompressor compressor;
+    std::string compressed;
+  };
+
+  // shared with executor tasks, which may run after the writer is closed and find no chunk
+  struct ExecutorState {
+    moodycamel::ConcurrentQueue<ChunkPtr> chunks;
+    moodycamel::ConcurrentQueue<std::unique_ptr<Formatter>> formatters;
+    std::mutex mtx;
+    std::condition_variable cv;
+    int active{0};  // tasks which may touch the writer
+  };
+
+  inline void Format(Chunk &chunk, Formatter &formatter) {
+    auto rows = chunk.rows.size();
+    chunk.data.clear();
+    for (auto &row : chunk.rows) {
+      AppendCsvRow<Delim>(chunk.data, row);
+      RecycleCsvRow(std::move(row));
+    }
+    chunk.rows.clear();
+    if (options_->compression.type != Compression::NONE) {
+      if (formatter.compressor.Compress(chunk.data, formatter.compressed)) {
+        chunk.data.swap(formatter.compressed);
+      } else {
+        spdlog::error("[CsvWriter] compress failed, chunk dropped. [rows={}, bytes={}]", rows, chunk.data.size());
+        dropped_rows_.fetch_add(rows, std::memory_order_relaxed);
+        chunk.data.clear();
+      }
+    }
+    bytes_.Encoded(std::exchange(chunk.estimated, 0), chunk.data.size());
+  }
+
+  // formatted size of the row if every field is quoted, counted on the sink writer thread instead of formatting it
+  static inline uint64_t EstimateRowBytes(const Row &row) {
+    uint64_t bytes = std::max<size_t>(row.size() * 3, 1);
+    for (size_t i = 0; i < row.size(); ++i) bytes += std::string_view(row[i]).size();
+    return bytes;
+  }
+
+  inline void FormatAndSubmit(ChunkPtr &&chunk) {
+    std::unique_ptr<Formatter> formatter;
+    if (!executor_state_->formatters.try_dequeue(formatter)) {
+      formatter = std::make_unique<Formatter>(options_->compression);
+    }
+    Format(*chunk, *formatter);
+    file_.Submit(std::move(chunk));
+    executor_state_->formatters.enqueue(std::move(formatter));
+  }
+
+  inline void Dispatch() {
+    pending_->seq = next_seq_++;
+    if (executor_state_) {
+      executor_state_->chunks.enqueue(std::move(pending_));
+      options_->executor->Submit([this, state = executor_state_] {
+        {
+          std::lock_guard lock(state->mtx);
+          ++state->active;
+        }
+        ChunkPtr chunk;
+        if (state->chunks.try_dequeue(chunk)) FormatAndSubmit(std::move(chunk));
+        std::lock_guard lock(state->mtx);
+        if (--state->active == 0) state->cv.notify_all();
+      });
+    } else {
+      format_queue_.enqueue(std::move(pending_));
+    }
+    pending_ = AcquireChunk();
+  }
+
+  inline ChunkPtr AcquireChunk() {
+    ChunkPtr chunk;
+    if (!free_chunks_.try_dequeue(chunk)) {
+      chunk = std::make_unique<Chunk>();
+      chunk->rows.reserve(options_->chunk_rows);
+    }
+    return chunk;
   }
 
  protected:
   std::string filepath_;
-  std::ofstream ofs_;
-  std::mutex ofs_mtx_;
-  std::shared_ptr<CstCSVWriter<std::ofstream, Delim>> writer_;
   const CsvWriterOptions *options_{nullptr};
   size_t header_size_{0};
-  moodycamel::BlockingConcurrentQueue<CsvRow> queue_;
+  moodycamel::ConcurrentQueue<ChunkPtr> free_chunks_;
+  OrderedFileWriter<Chunk> file_;
+  moodycamel::BlockingConcurrentQueue<ChunkPtr> format_queue_;
   std::vector<std::thread> writer_threads_;
-  bool running_{true};
+  std::shared_ptr<ExecutorState> executor_state_;
+  ChunkPtr pending_;  // chunk being filled by the sink writer thread
+  uint64_t next_seq_{0};
+  EncodedBytes bytes_;
+  std::atomic<uint64_t> dropped_rows_{0};
 };
 
 template <char Delim>
 using CsvSinkT = BaseSink<CsvRow, CsvWriter<Delim>, CsvWriterOptions>;
 
 using CsvSink = CsvSinkT<','>;
+
+template <char Delim>
+using StaticCsvSinkT = StaticSink<CsvRow, CsvWriter<Delim>, CsvWriterOptions>;
+
+using StaticCsvSink = StaticCsvSinkT<','>;
+
+// one allocation or less per row, CsvRow is still accepted and converted
+template <char Delim>
+using CsvFlatSinkT = BaseSink<CsvFlatRow, CsvWriter<Delim, CsvFlatRow>, CsvWriterOptions>;
+
+using CsvFlatSink = CsvFlatSinkT<','>;
 }  // namespace cppcommon::os
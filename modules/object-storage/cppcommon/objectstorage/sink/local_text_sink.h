@@ -8,15 +8,24 @@
 
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <span>
 #include <string>
 
 #include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/compression.h"
+#include "cppcommon/objectstorage/sink/output_file.h"
 
 namespace cppcommon::os {
 template <typename Record>
 class LocalSinkFileSystem : public SinkFileSystem<Record> {
  public:
-  void Open(const std::string &filepath) override { ofs_.open(filepath, std::ios::out | std::ios::app); }
+  static constexpr bool kSyncSupported = true;
+
+  void Open(const std::string &filepath) override {
+    ofs_.open(filepath, std::ios::out | std::ios::app);
+    filepath_ = filepath;
+  }
   bool IsOpen() override { return ofs_.is_open(); }
 
   void Close() override {
@@ -27,17 +36,126 @@ class LocalSinkFileSystem : public SinkFileSystem<Record> {
     if (ofs_) ofs_.flush();
   }
 
+  inline bool Sync() override {
+    if (!ofs_.is_open()) return false;
+    ofs_.flush();
+    return SyncFileData(filepath_);
+  }
+
  protected:
   std::ofstream ofs_;
+  std::string filepath_;
+};
+
+struct TextWriterOptions {
+  CompressionOptions compression;
+  size_t block_size{1024 * 1024};  // bytes of uncompressed data per compressed block
+  std::shared_ptr<SinkExecutor> executor;  // compresses the blocks, SinkExecutor::Default() if null
+  FileBackendOptions file;
 };
 
 class LocalTextSinkFileSystem : public LocalSinkFileSystem<std::string> {
  public:
+  LocalTextSinkFileSystem() = default;
+  explicit LocalTextSinkFileSystem(const TextWriterOptions &options) {
+    if (options.compression.type != Compression::NONE) {
+      compressed_ = std::make_unique<CompressedFileWriter>(options.compression, options.block_size,
+                                                           options.executor, options.file);
+    } else if (options.file.type != FileBackend::STREAM) {
+      file_ = std::make_unique<OutputFile>(options.file);
+    } else {
+      preallocate_bytes_ = options.file.preallocate_bytes;
+    }
+  }
+
+  void Open(const std::string &filepath) override {
+    bytes_ = 0;
+    if (compressed_) {
+      compressed_->Open(filepath, true);
+    } else if (file_) {
+      file_->Open(filepath, true);
+    } else {
+      LocalSinkFileSystem::Open(filepath);
+      preallocated_ = preallocate_bytes_ > 0 && ofs_.is_open() && PreallocateFile(filepath, preallocate_bytes_);
+    }
+  }
+
+  uint64_t BytesWritten() const override { return compressed_ ? compressed_->BytesWritten() : bytes_; }
+  uint64_t DroppedRows() const override { return compressed_ ? compressed_->DroppedRows() : 0; }
+
+  bool IsOpen() override {
+    if (compressed_) return compressed_->IsOpen();
+    if (file_) return file_->IsOpen();
+    return LocalSinkFileSystem::IsOpen();
+  }
+
+  void Close() override {
+    if (compressed_) {
+      compressed_->Close();
+    } else if (file_) {
+      file_->Close();
+    } else {
+      LocalSinkFileSystem::Close();
+      if (preallocated_) ReleasePreallocatedFile(filepath_);
+      preallocated_ = false;
+    }
+  }
+
+  inline void Flush() override {
+    if (compressed_) {
+      compressed_->Flush();
+    } else if (file_) {
+      file_->Flush();
+    } else {
+      LocalSinkFileSystem::Flush();
+    }
+  }
+
+  inline bool Sync() override {
+    if (compressed_) return compressed_->Sync();
+    if (file_) return file_->Sync();
+    return LocalSinkFileSystem::Sync();
+  }
+
   inline int Write(std::string &&record) override {
-    ofs_ << record << "\n";
+    bytes_ += record.size() + 1;
+    if (compressed_) {
+      compressed_->Write(record);
+      compressed_->Write("\n");
+    } else if (file_) {
+      file_->Write(record.data(), record.size());
+      file_->Write("\n", 1);
+    } else {
+      ofs_ << record << "\n";
+    }
     return 1;
   }
+
+  inline int WriteBatch(std::span<std::string> records) override {
+    if (compressed_ || file_) {
+      for (auto &record : records) {
+        LocalTextSinkFileSystem::Write(std::move(record));
+      }
+      return static_cast<int>(records.size());
+    }
+    buffer_.clear();
+    for (auto &record : records) {
+      buffer_.append(record).push_back('\n');
+    }
+    ofs_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    bytes_ += buffer_.size();
+    return static_cast<int>(records.size());
+  }
+
+ private:
+  std::string buffer_;
+  uint64_t bytes_{0};
+  int64_t preallocate_bytes_{0};  // std::ofstream does not expose its descriptor, done through the path
+  bool preallocated_{false};
+  std::unique_ptr<CompressedFileWriter> compressed_;
+  std::unique_ptr<OutputFile> file_;  // FileBackend other than STREAM
 };
 
-using LocalBasicSink = BaseSink<std::string, LocalTextSinkFileSystem>;
+using LocalBasicSink = BaseSink<std::string, LocalTextSinkFileSystem, TextWriterOptions>;
+using StaticTextSink = StaticSink<std::string, LocalTextSinkFileSystem, TextWriterOptions>;
 }  // namespace cppcommon::os
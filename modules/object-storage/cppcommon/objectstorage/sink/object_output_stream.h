@@ -0,0 +1,186 @@
+/**
+ * @file object_output_stream.h
+ * @brief sequential output stream uploaded to object storage in parts while it is written
+ * @author zhenkai.sun
+ * @date 2025-06-21 09:48:12
+ */
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/transfor/storage_provider.h"
+
+namespace cppcommon::os {
+struct ObjectUploadOptions {
+  std::shared_ptr<StorageProvider> provider;  // e.g. NewObjectTransfor(ServiceProvider::S3)
+  size_t part_size{8 * 1024 * 1024};  // raised to kMinUploadPartSize
+  unsigned int upload_threads{4};  // parts uploaded in parallel, 1 for providers without ParallelParts
+  unsigned int max_pending_parts{8};  // parts buffered in memory, Write blocks beyond it
+};
+
+// s3://bucket/path/to/object -> (bucket, path/to/object), @return false without a scheme
+inline bool ParseObjectUrl(std::string_view url, std::string &bucket, std::string &key) {
+  auto pos = url.find("://");
+  if (pos == std::string_view::npos) return false;
+  url.remove_prefix(pos + 3);
+  auto slash = url.find('/');
+  if (slash == std::string_view::npos || slash == 0 || slash + 1 == url.size()) return false;
+  bucket.assign(url.substr(0, slash));
+  key.assign(url.substr(slash + 1));
+  return true;
+}
+
+/**
+ * Bytes are cut into parts of part_size and uploaded by a pool of threads while the next part is filled, the object
+ * is completed on Close, or aborted if any part failed. Not thread safe.
+ */
+class ObjectOutputStream {
+ public:
+  explicit ObjectOutputStream(const ObjectUploadOptions &options) : options_(options) {
+    options_.part_size = std::max(options_.part_size, kMinUploadPartSize);
+    options_.max_pending_parts = std::max(1u, options_.max_pending_parts);
+  }
+
+  ~ObjectOutputStream() { Close(); }
+
+  ObjectOutputStream(const ObjectOutputStream &) = delete;
+  ObjectOutputStream &operator=(const ObjectOutputStream &) = delete;
+
+  bool Open(const std::string &url) {
+    url_ = url;
+    std::string bucket, key;
+    if (!options_.provider || !ParseObjectUrl(url, bucket, key)) {
+      spdlog::error("[ObjectOutputStream] invalid object url or provider. [url={}]", url);
+      return false;
+    }
+    auto writer = options_.provider->NewObjectWriter(bucket, key);
+    if (!writer.ok()) {
+      spdlog::error("[ObjectOutputStream] create object writer failed. [url={}, error={}]", url,
+                    writer.status().ToString());
+      return false;
+    }
+    writer_ = std::move(writer).value();
+    ok_ = true;
+    stopped_ = false;
+    next_part_ = 1;
+    position_ = 0;
+    auto threads = writer_->ParallelParts() ? std::max(1u, options_.upload_threads) : 1u;
+    for (unsigned int i = 0; i < threads; ++i) {
+      threads_.emplace_back(&ObjectOutputStream::UploadThreadFunc, this);
+    }
+    buffer_.reserve(options_.part_size);
+    return true;
+  }
+
+  inline bool IsOpen() const { return static_cast<bool>(writer_); }
+  inline int64_t Tell() const { return position_; }
+
+  bool Write(const char *data, size_t size) {
+    if (!writer_) return false;
+    position_ += static_cast<int64_t>(size);
+    while (size > 0) {
+      auto n = std::min(size, options_.part_size - buffer_.size());
+      buffer_.append(data, n);
+      data += n;
+      size -= n;
+      if (buffer_.size() == options_.part_size) SubmitPart();
+    }
+    return ok_;
+  }
+
+  // parts smaller than part_size can only be the last one, buffered bytes are uploaded on Close
+  inline bool Flush() { return writer_ && ok_; }
+
+  // upload the last part and complete the object, @return false if the object is not complete
+  bool Close() {
+    if (!writer_) return true;
+    // an empty object still needs one part
+    if (!buffer_.empty() || next_part_ == 1) SubmitPart();
+    {
+      std::lock_guard lock(mtx_);
+      stopped_ = true;
+    }
+    pending_cv_.notify_all();
+    for (auto &th : threads_) {
+      if (th.joinable()) th.join();
+    }
+    threads_.clear();
+    auto ok = ok_.load();
+    auto s = ok ? writer_->Complete() : writer_->Abort();
+    if (!s.ok()) {
+      spdlog::error("[ObjectOutputStream] close object failed. [url={}, error={}]", url_, s.ToString());
+      ok = false;
+    } else if (!ok) {
+      spdlog::error("[ObjectOutputStream] object aborted after a failed part. [url={}]", url_);
+    }
+    writer_.reset();
+    return ok;
+  }
+
+ private:
+  struct Part {
+    int number;
+    std::string data;
+  };
+
+  void SubmitPart() {
+    std::unique_lock lock(mtx_);
+    space_cv_.wait(lock, [this] { return pending_.size() < options_.max_pending_parts; });
+    pending_.push_back({next_part_++, std::move(buffer_)});
+    lock.unlock();
+    pending_cv_.notify_one();
+    buffer_ = std::string();
+    buffer_.reserve(options_.part_size);
+  }
+
+  void UploadThreadFunc() {
+    while (true) {
+      Part part;
+      {
+        std::unique_lock lock(mtx_);
+        pending_cv_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+        if (pending_.empty()) break;
+        part = std::move(pending_.front());
+        pending_.pop_front();
+      }
+      space_cv_.notify_one();
+      // later parts are skipped once the upload is going to be aborted
+      if (!ok_) continue;
+      auto s = writer_->UploadPart(part.number, part.data);
+      if (!s.ok()) {
+        spdlog::error("[ObjectOutputStream] upload part failed. [url={}, error={}]", url_, s.ToString());
+        ok_ = false;
+      }
+    }
+  }
+
+ private:
+  ObjectUploadOptions options_;
+  std::string url_;
+  std::unique_ptr<ObjectWriter> writer_;
+  std::atomic<bool> ok_{true};
+  int64_t position_{0};
+  std::string buffer_;
+  int next_part_{1};
+
+  std::mutex mtx_;
+  std::condition_variable pending_cv_;
+  std::condition_variable space_cv_;
+  std::deque<Part> pending_;
+  bool stopped_{false};
+  std::vector<std::thread> threads_;
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,209 @@
+/**
+ * @file ordered_file_writer.h
+ * @brief write chunks produced by concurrent workers into a file in sequence order
+ * @author zhenkai.sun
+ * @date 2025-06-12 10:21:37
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/output_file.h"
+
+namespace cppcommon::os {
+// write all iovecs, retry on partial writes and EINTR
+inline bool WriteFully(int fd, iovec *iov, int count) {
+  while (count > 0) {
+    auto n = ::writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    auto written = static_cast<size_t>(n);
+    while (count > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+/**
+ * Chunks are submitted by any thread in any order, a committer thread writes the continuous ones with one writev,
+ * or through OutputFile if a FileBackend other than STREAM is given.
+ * Chunk should have members `uint64_t seq` (starts from 0 without gaps) and `std::string data`.
+ */
+template <typename Chunk>
+class OrderedFileWriter {
+ public:
+  using ChunkPtr = std::unique_ptr<Chunk>;
+  using RecycleFunc = std::function<void(ChunkPtr &&chunk)>;
+
+  explicit OrderedFileWriter(RecycleFunc recycle = {}) : recycle_(std::move(recycle)) {}
+  ~OrderedFileWriter() { Close(); }
+
+  bool Open(const std::string &filepath, bool append = false, const FileBackendOptions &backend = {}) {
+    if (backend.type != FileBackend::STREAM) {
+      output_ = std::make_unique<OutputFile>(backend);
+      if (!output_->Open(filepath, append)) {
+        output_.reset();
+        return false;
+      }
+    } else {
+      fd_ = ::open(filepath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+      if (fd_ < 0) {
+        spdlog::error("[OrderedFileWriter] open file failed. [filepath={}, errno={}]", filepath, errno);
+        return false;
+      }
+      struct stat st {};
+      preallocated_ = backend.preallocate_bytes > 0 && ::fstat(fd_, &st) == 0 &&
+                      PreallocateFd(fd_, st.st_size, backend.preallocate_bytes);
+    }
+    filepath_ = filepath;
+    running_ = true;
+    committer_ = std::thread(&OrderedFileWriter::CommitThreadFunc, this);
+    return true;
+  }
+
+  inline bool IsOpen() const { return fd_ >= 0 || output_; }
+
+  // write without ordering, only valid before the first chunk is submitted, e.g. headers
+  bool WriteDirect(std::string_view data) {
+    if (output_) return output_->Write(data.data(), data.size());
+    iovec iov{const_cast<char *>(data.data()), data.size()};
+    return WriteFully(fd_, &iov, 1);
+  }
+
+  void Submit(ChunkPtr &&chunk) {
+    {
+      std::lock_guard lock(mtx_);
+      auto seq = chunk->seq;
+      ready_.emplace(seq, std::move(chunk));
+    }
+    ready_cv_.notify_one();
+  }
+
+  // block until chunks [0, seq) are written
+  void WaitCommitted(uint64_t seq) {
+    std::unique_lock lock(mtx_);
+    committed_cv_.wait(lock, [this, seq] { return next_seq_ >= seq || !running_; });
+  }
+
+  // fdatasync, call it after WaitCommitted
+  bool Sync() {
+    if (output_) return output_->DataSync();
+    if (::fdatasync(fd_) != 0) {
+      spdlog::error("[OrderedFileWriter] fdatasync failed. [filepath={}, errno={}]", filepath_, errno);
+      return false;
+    }
+    return true;
+  }
+
+  // all chunks should be submitted before closing
+  void Close() {
+    if (!IsOpen()) return;
+    {
+      std::lock_guard lock(mtx_);
+      running_ = false;
+    }
+    ready_cv_.notify_all();
+    if (committer_.joinable()) committer_.join();
+    if (!ready_.empty()) {
+      spdlog::error("[OrderedFileWriter] discontinuous chunks dropped. [filepath={}, chunks={}]", filepath_,
+                    ready_.size());
+      ready_.clear();
+    }
+    if (output_) {
+      output_->Close();
+      output_.reset();
+    } else {
+      if (preallocated_) ReleasePreallocatedFd(fd_);
+      preallocated_ = false;
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  void CommitThreadFunc() {
+    std::vector<ChunkPtr> chunks;
+    std::vector<iovec> iov;
+    bool idle = true;
+    while (true) {
+      {
+        std::unique_lock lock(mtx_);
+        ready_cv_.wait(lock, [this] { return !running_ || IsNextReady(); });
+        for (auto it = ready_.begin(); it != ready_.end() && chunks.size() < IOV_MAX; it = ready_.erase(it)) {
+          if (it->first != next_seq_ + chunks.size()) break;
+          chunks.emplace_back(std::move(it->second));
+        }
+        if (chunks.empty() && !running_) break;
+        idle = !IsNextReady();
+      }
+      if (output_) {
+        for (auto &chunk : chunks) {
+          output_->Write(chunk->data.data(), chunk->data.size());
+        }
+        // committed chunks should be in the kernel, buffers are only kept while more chunks are coming
+        if (idle) output_->Flush();
+      } else {
+        iov.clear();
+        for (auto &chunk : chunks) {
+          iov.push_back({chunk->data.data(), chunk->data.size()});
+        }
+        if (!WriteFully(fd_, iov.data(), static_cast<int>(iov.size()))) {
+          spdlog::error("[OrderedFileWriter] write file failed. [filepath={}, errno={}]", filepath_, errno);
+        }
+      }
+      {
+        std::lock_guard lock(mtx_);
+        next_seq_ += chunks.size();
+      }
+      committed_cv_.notify_all();
+      for (auto &chunk : chunks) {
+        if (recycle_) recycle_(std::move(chunk));
+      }
+      chunks.clear();
+    }
+  }
+
+  inline bool IsNextReady() const { return !ready_.empty() && ready_.begin()->first == next_seq_; }
+
+ private:
+  int fd_{-1};
+  bool preallocated_{false};  // fd_ only, OutputFile releases its own
+  std::unique_ptr<OutputFile> output_;  // aligned io_uring / pwrite backend, fd_ is not used if set
+  std::string filepath_;
+  RecycleFunc recycle_;
+  std::mutex mtx_;
+  std::condition_variable ready_cv_;
+  std::condition_variable committed_cv_;
+  std::map<uint64_t, ChunkPtr> ready_;
+  uint64_t next_seq_{0};
+  bool running_{false};
+  std::thread committer_;
+};
+}  // namespace cppcommon::os
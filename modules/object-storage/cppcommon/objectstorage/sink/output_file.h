@@ -0,0 +1,516 @@
+/**
+ * @file output_file.h
+ * @brief buffered file writer with aligned, double-buffered writes through io_uring or pwrite
+ * @author zhenkai.sun
+ * @date 2025-06-18 14:06:25
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/object_output_stream.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CPPCOMMON_HAS_IO_URING 1
+#endif
+
+namespace cppcommon::os {
+enum class FileBackend {
+  STREAM,    // std::ofstream / arrow::io::FileOutputStream
+  PWRITE,    // aligned buffers written by pwrite
+  IO_URING,  // aligned buffers submitted through io_uring, falls back to pwrite if io_uring is unavailable
+  OBJECT,    // uploaded to object storage while written, file paths are urls like s3://bucket/path/to/object
+};
+
+struct FileBackendOptions {
+  FileBackend type{FileBackend::STREAM};
+  bool direct_io{false};  // O_DIRECT, ignored if the file system does not support it
+  size_t buffer_size{1024 * 1024};  // rounded up to kFileAlignment
+  unsigned int buffers_count{2};  // buffers in flight while the next one is filled
+  ObjectUploadOptions object;  // OBJECT
+  // fallocate this many bytes when a file opens, unused ones are released on close, 0: off, ignored by OBJECT
+  int64_t preallocate_bytes{0};
+};
+
+static constexpr size_t kFileAlignment = 4096;
+
+inline bool PwriteFully(int fd, const char *data, size_t size, int64_t offset) {
+  while (size > 0) {
+    auto n = ::pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// fdatasync through a new descriptor, for streams that do not expose theirs
+inline bool SyncFileData(const std::string &filepath) {
+  auto fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    spdlog::error("[SyncFileData] open file failed. [filepath={}, errno={}]", filepath, errno);
+    return false;
+  }
+  auto ok = ::fdatasync(fd) == 0;
+  if (!ok) {
+    spdlog::error("[SyncFileData] fdatasync failed. [filepath={}, errno={}]", filepath, errno);
+  }
+  ::close(fd);
+  return ok;
+}
+
+// rename which fails with EEXIST instead of replacing to, @return false with errno set
+inline bool RenameNoReplace(const std::string &from, const std::string &to) {
+#ifdef RENAME_NOREPLACE
+  if (::renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0) return true;
+  if (errno != EINVAL && errno != ENOSYS) return false;
+#endif
+  // link fails if to exists, for file systems without RENAME_NOREPLACE
+  if (::link(from.c_str(), to.c_str()) != 0) return false;
+  ::unlink(from.c_str());
+  return true;
+}
+
+/**
+ * Reserve blocks for bytes after offset, the file size is kept (FALLOC_FL_KEEP_SIZE) so readers and crashes never
+ * see a zero filled tail. @return false if fallocate failed, e.g. not supported by the file system.
+ */
+inline bool PreallocateFd(int fd, int64_t offset, int64_t bytes) {
+  if (bytes <= 0) return true;
+  int ret;
+  while ((ret = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, bytes)) != 0 && errno == EINTR) {
+  }
+  if (ret != 0) {
+    spdlog::warn("[Preallocate] fallocate failed. [bytes={}, errno={}]", bytes, errno);
+    return false;
+  }
+  return true;
+}
+
+// truncate the file to its size, which frees the blocks preallocated after it
+inline bool ReleasePreallocatedFd(int fd) {
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || ::ftruncate(fd, st.st_size) != 0) {
+    spdlog::warn("[Preallocate] truncate file failed. [errno={}]", errno);
+    return false;
+  }
+  return true;
+}
+
+// for streams that do not expose their descriptor
+inline bool PreallocateFile(const std::string &filepath, int64_t bytes) {
+  if (bytes <= 0) return true;
+  auto fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st {};
+  auto ok = ::fstat(fd, &st) == 0 && PreallocateFd(fd, st.st_size, bytes);
+  ::close(fd);
+  return ok;
+}
+
+inline bool ReleasePreallocatedFile(const std::string &filepath) {
+  auto fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  auto ok = ReleasePreallocatedFd(fd);
+  ::close(fd);
+  return ok;
+}
+
+#ifdef CPPCOMMON_HAS_IO_URING
+// minimal io_uring ring for writes, used by a single thread
+class IoUring {
+ public:
+  IoUring() = default;
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() {
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) ::munmap(sq_ptr_, sq_size_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+  }
+
+  bool Init(unsigned int entries) {
+    io_uring_params params{};
+    ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd_ < 0) return false;
+    sq_entries_ = params.sq_entries;
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    sq_ptr_ = Map(sq_size_, IORING_OFF_SQ_RING);
+    if (!sq_ptr_) return false;
+    cq_ptr_ = single_mmap ? sq_ptr_ : Map(cq_size_, IORING_OFF_CQ_RING);
+    if (!cq_ptr_) return false;
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(Map(sqes_size_, IORING_OFF_SQES));
+    if (!sqes_) return false;
+
+    auto sq = static_cast<char *>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto cq = static_cast<char *>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  inline bool IsValid() const { return sqes_ != nullptr; }
+
+  // @return false if the submission queue is full or io_uring_enter fails
+  bool SubmitWrite(int fd, const void *data, unsigned int size, int64_t offset, uint64_t user_data) {
+    auto tail = *sq_tail_;
+    if (tail - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire) >= sq_entries_) return false;
+    auto index = tail & sq_mask_;
+    auto &sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(data);
+    sqe.len = size;
+    sqe.off = static_cast<uint64_t>(offset);
+    sqe.user_data = user_data;
+    sq_array_[index] = index;
+    std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+    while (::syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        std::atomic_ref<unsigned>(*sq_tail_).store(tail, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // block until a write completes, result is the written bytes or -errno
+  bool WaitCompletion(uint64_t &user_data, int &result) {
+    while (true) {
+      auto head = *cq_head_;
+      if (head != std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire)) {
+        auto &cqe = cqes_[head & cq_mask_];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        std::atomic_ref<unsigned>(*cq_head_).store(head + 1, std::memory_order_release);
+        return true;
+      }
+      if (::syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+        return false;
+      }
+    }
+  }
+
+ private:
+  void *Map(size_t size, off_t offset) {
+    auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+ private:
+  int ring_fd_{-1};
+  unsigned sq_entries_{0};
+  void *sq_ptr_{nullptr};
+  void *cq_ptr_{nullptr};
+  size_t sq_size_{0};
+  size_t cq_size_{0};
+  size_t sqes_size_{0};
+  io_uring_sqe *sqes_{nullptr};
+  unsigned *sq_head_{nullptr};
+  unsigned *sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned *sq_array_{nullptr};
+  unsigned *cq_head_{nullptr};
+  unsigned *cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe *cqes_{nullptr};
+};
+#endif
+
+/**
+ * Data is copied into aligned buffers, a full buffer is submitted and the next one is filled while it is in flight.
+ * With O_DIRECT, the unaligned tail is written through a second, buffered descriptor on Flush, and rewritten with
+ * the following data later. With FileBackend::OBJECT, everything goes to an ObjectOutputStream. Not thread safe.
+ */
+class OutputFile {
+ public:
+  explicit OutputFile(const FileBackendOptions &options) : options_(options) {}
+  ~OutputFile() { Close(); }
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  bool Open(const std::string &filepath, bool append = false) {
+    filepath_ = filepath;
+    if (options_.type == FileBackend::OBJECT) {
+      // objects can not be appended, append is ignored
+      object_ = std::make_unique<ObjectOutputStream>(options_.object);
+      if (!object_->Open(filepath)) object_.reset();
+      return static_cast<bool>(object_);
+    }
+    auto flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+    direct_ = options_.direct_io;
+    if (direct_) {
+      fd_ = ::open(filepath.c_str(), flags | O_DIRECT, 0644);
+      if (fd_ < 0 && errno == EINVAL) direct_ = false;  // not supported by the file system
+    }
+    if (fd_ < 0) fd_ = ::open(filepath.c_str(), flags, 0644);
+    if (fd_ < 0) {
+      spdlog::error("[OutputFile] open file failed. [filepath={}, errno={}]", filepath, errno);
+      return false;
+    }
+    struct stat st {};
+    file_offset_ = ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+    if (direct_ && (file_offset_ % kFileAlignment)) {
+      // appending to an unaligned file, continue without O_DIRECT
+      ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) & ~O_DIRECT);
+      direct_ = false;
+    }
+    position_ = file_offset_;
+    preallocated_ = options_.preallocate_bytes > 0 && PreallocateFd(fd_, file_offset_, options_.preallocate_bytes);
+    AllocateBuffers();
+#ifdef CPPCOMMON_HAS_IO_URING
+    if (options_.type == FileBackend::IO_URING && !ring_) {
+      ring_ = std::make_unique<IoUring>();
+      if (!ring_->Init(static_cast<unsigned int>(buffers_.size()))) {
+        spdlog::warn("[OutputFile] io_uring is unavailable, fallback to pwrite. [errno={}]", errno);
+        ring_.reset();
+      }
+    }
+#endif
+    return true;
+  }
+
+  inline bool IsOpen() const { return fd_ >= 0 || object_; }
+  inline bool IsDirect() const { return direct_; }
+  // logical size of the file, including buffered data
+  inline int64_t Tell() const { return object_ ? object_->Tell() : position_; }
+  inline const std::string &FilePath() const { return filepath_; }
+
+  bool Write(const char *data, size_t size) {
+    if (object_) return object_->Write(data, size);
+    if (fd_ < 0) return false;
+    position_ += static_cast<int64_t>(size);
+    while (size > 0) {
+      auto &buffer = buffers_[current_];
+      auto n = std::min(size, capacity_ - buffer.size);
+      std::memcpy(buffer.data.get() + buffer.size, data, n);
+      buffer.size += n;
+      data += n;
+      size -= n;
+      if (buffer.size == capacity_) {
+        SubmitCurrent();
+      }
+    }
+    return ok_;
+  }
+
+  // hand all written data to the kernel
+  bool Flush() {
+    if (object_) return object_->Flush();
+    if (fd_ < 0) return false;
+    WaitAll();
+    auto &buffer = buffers_[current_];
+    if (buffer.size == 0) return ok_;
+    if (!direct_) {
+      Pwrite(fd_, buffer.data.get(), buffer.size, file_offset_);
+      file_offset_ += static_cast<int64_t>(buffer.size);
+      buffer.size = 0;
+      return ok_;
+    }
+    auto aligned = buffer.size / kFileAlignment * kFileAlignment;
+    auto tail = buffer.size - aligned;
+    if (aligned) {
+      Pwrite(fd_, buffer.data.get(), aligned, file_offset_);
+      file_offset_ += static_cast<int64_t>(aligned);
+    }
+    if (tail) {
+      // kept in the buffer, the aligned write of the whole block overwrites it later
+      std::memmove(buffer.data.get(), buffer.data.get() + aligned, tail);
+      Pwrite(TailFd(), buffer.data.get(), tail, file_offset_);
+    }
+    buffer.size = tail;
+    return ok_;
+  }
+
+  inline bool Sync() { return Flush() && DataSync(); }
+
+  // fdatasync without flushing the buffers, objects are durable once closed
+  inline bool DataSync() {
+    if (object_) return false;
+    if (::fdatasync(fd_) != 0 || (tail_fd_ >= 0 && ::fdatasync(tail_fd_) != 0)) {
+      spdlog::error("[OutputFile] fdatasync failed. [filepath={}, errno={}]", filepath_, errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool Close() {
+    if (object_) {
+      auto ok = object_->Close();
+      object_.reset();
+      return ok;
+    }
+    if (fd_ < 0) return ok_;
+    Flush();
+    if (preallocated_) {
+      // unaligned tails of O_DIRECT are written through tail_fd_, the file is complete after Flush
+      ReleasePreallocatedFd(fd_);
+      preallocated_ = false;
+    }
+    ::close(fd_);
+    fd_ = -1;
+    if (tail_fd_ >= 0) {
+      ::close(tail_fd_);
+      tail_fd_ = -1;
+    }
+    for (auto &buffer : buffers_) buffer.size = 0;
+    auto ok = ok_;
+    ok_ = true;
+    return ok;
+  }
+
+ private:
+  struct AlignedFree {
+    inline void operator()(char *ptr) const { std::free(ptr); }
+  };
+
+  struct Buffer {
+    std::unique_ptr<char, AlignedFree> data;
+    size_t size{0};
+    int64_t offset{0};
+    bool in_flight{false};
+  };
+
+  void AllocateBuffers() {
+    if (!buffers_.empty()) return;
+    capacity_ = (std::max<size_t>(1, options_.buffer_size) + kFileAlignment - 1) / kFileAlignment * kFileAlignment;
+    buffers_.resize(std::max(1u, options_.buffers_count));
+    for (auto &buffer : buffers_) {
+      buffer.data.reset(static_cast<char *>(std::aligned_alloc(kFileAlignment, capacity_)));
+    }
+  }
+
+  // submit the full current buffer and move to the next one
+  void SubmitCurrent() {
+    auto &buffer = buffers_[current_];
+    buffer.offset = file_offset_;
+    file_offset_ += static_cast<int64_t>(buffer.size);
+#ifdef CPPCOMMON_HAS_IO_URING
+    if (ring_ && ring_->SubmitWrite(fd_, buffer.data.get(), static_cast<unsigned int>(buffer.size), buffer.offset,
+                                    current_)) {
+      buffer.in_flight = true;
+    } else {
+      Pwrite(fd_, buffer.data.get(), buffer.size, buffer.offset);
+    }
+#else
+    Pwrite(fd_, buffer.data.get(), buffer.size, buffer.offset);
+#endif
+    current_ = (current_ + 1) % buffers_.size();
+    WaitBuffer(current_);
+    buffers_[current_].size = 0;
+  }
+
+  inline void WaitBuffer(size_t index) {
+    while (buffers_[index].in_flight) {
+      if (!Reap()) break;
+    }
+  }
+
+  inline void WaitAll() {
+    for (size_t i = 0; i < buffers_.size(); ++i) WaitBuffer(i);
+  }
+
+  // complete one in flight write, @return false if no completion could be reaped
+  bool Reap() {
+#ifdef CPPCOMMON_HAS_IO_URING
+    uint64_t index;
+    int result;
+    if (!ring_ || !ring_->WaitCompletion(index, result)) {
+      // the ring is broken, rewrite in flight buffers synchronously
+      for (auto &buffer : buffers_) {
+        if (buffer.in_flight) {
+          Pwrite(fd_, buffer.data.get(), buffer.size, buffer.offset);
+          buffer.in_flight = false;
+        }
+      }
+      ring_.reset();
+      return false;
+    }
+    auto &buffer = buffers_[index];
+    buffer.in_flight = false;
+    if (result < 0) {
+      // e.g. IORING_OP_WRITE is not supported by the kernel
+      Pwrite(fd_, buffer.data.get(), buffer.size, buffer.offset);
+    } else if (static_cast<size_t>(result) < buffer.size) {
+      Pwrite(TailFd(), buffer.data.get() + result, buffer.size - result, buffer.offset + result);
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  inline void Pwrite(int fd, const char *data, size_t size, int64_t offset) {
+    if (!PwriteFully(fd, data, size, offset)) {
+      spdlog::error("[OutputFile] write file failed. [filepath={}, errno={}]", filepath_, errno);
+      ok_ = false;
+    }
+  }
+
+  // unaligned writes when O_DIRECT is on
+  inline int TailFd() {
+    if (!direct_) return fd_;
+    if (tail_fd_ < 0) {
+      tail_fd_ = ::open(filepath_.c_str(), O_WRONLY | O_CLOEXEC);
+      if (tail_fd_ < 0) {
+        spdlog::error("[OutputFile] open file failed. [filepath={}, errno={}]", filepath_, errno);
+        return fd_;
+      }
+    }
+    return tail_fd_;
+  }
+
+ private:
+  FileBackendOptions options_;
+  std::string filepath_;
+  int fd_{-1};
+  int tail_fd_{-1};
+  bool direct_{false};
+  bool ok_{true};
+  bool preallocated_{false};
+  int64_t file_offset_{0};  // file offset of the current buffer
+  int64_t position_{0};
+  size_t capacity_{0};
+  std::vector<Buffer> buffers_;
+  size_t current_{0};
+  std::unique_ptr<ObjectOutputStream> object_;
+#ifdef CPPCOMMON_HAS_IO_URING
+  std::unique_ptr<IoUring> ring_;
+#endif
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,491 @@
+/**
+ * @file parquet_compactor.h
+ * @brief background compaction of small rolled parquet files of the same time partition
+ * @author zhenkai.sun
+ * @date 2025-06-20 10:16:37
+ */
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/file_reader.h>
+#include <parquet/metadata.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/local_arrow_sink.h"
+#include "cppcommon/objectstorage/sink/output_file.h"
+
+namespace cppcommon::os {
+struct ParquetCompactorOptions {
+  int64_t target_bytes{128 * 1024 * 1024};  // size of merged files, larger inputs are left alone
+  size_t min_files{2};  // fewer files of a partition are not worth merging
+  int64_t bytes_per_second{64 * 1024 * 1024};  // read rate of row groups (uncompressed), 0: unlimited
+  std::chrono::milliseconds interval{60 * 1000};  // compaction (and directory scan) interval of the worker
+  std::chrono::milliseconds idle{5 * 60 * 1000};  // a partition without new files for idle is merged entirely
+  std::string suffix{"parquet"};  // watched files
+  RollPeriod period{RollPeriod::HOURLY};  // watched files are partitioned by modification time
+  std::chrono::milliseconds min_age{60 * 1000};  // watched files modified within min_age may still be open
+  ParquetWriterOptions parquet;  // merged files, row_group_bytes also bounds the rows buffered in memory
+};
+
+/**
+ * Merges closed parquet files of the same partition into files of about target_bytes. Row groups are copied one by
+ * one (small ones are coalesced up to parquet.row_group_bytes), so whole tables are never materialized.
+ * The merged file is written to a hidden temp file and synced, its inputs are listed in a manifest next to it, then it
+ * is renamed into place without replacing any file and the inputs and the manifest are removed. Watch repairs a crash
+ * from leftover manifests only: inputs of a renamed file are removed if their size and mtime are unchanged, so files
+ * named like them later (e.g. by a restarted sink) are kept.
+ * usage:
+ *   ParquetCompactor compactor;  // must outlive the sink
+ *   options.on_roll_callback = compactor.RollCallback();
+ *   compactor.Start();
+ */
+class ParquetCompactor {
+ public:
+  static constexpr const char *kCompactedMark = ".compacted";
+  static constexpr const char *kCompactingSuffix = ".compacting";  // .<merged filename>.compacting, the temp file
+  static constexpr const char *kManifestSuffix = ".manifest";  // .<merged filename>.compacting.manifest
+
+  explicit ParquetCompactor(ParquetCompactorOptions options = {}) : options_(std::move(options)) {
+    options_.min_files = std::max<size_t>(1, options_.min_files);
+  }
+
+  ~ParquetCompactor() { Stop(); }
+
+  ParquetCompactor(const ParquetCompactor &) = delete;
+  ParquetCompactor &operator=(const ParquetCompactor &) = delete;
+
+  // rolled files are partitioned by directory and time roll period
+  OnRollFileCallback RollCallback() {
+    return [this](const std::string &filepath, const TimeRollPolicy &policy) {
+      auto partition = std::filesystem::path(filepath).parent_path().string();
+      if (policy.period != RollPeriod::UNSPECIFIED) {
+        partition += "@" + std::to_string(policy.last_rolling_ts_ms);
+      }
+      Add(filepath, partition);
+    };
+  }
+
+  // add a closed file
+  void Add(const std::string &filepath, const std::string &partition) {
+    std::error_code ec;
+    auto size = static_cast<int64_t>(std::filesystem::file_size(filepath, ec));
+    if (ec) {
+      spdlog::error("[ParquetCompactor] stat file failed. [filepath={}, error={}]", filepath, ec.message());
+      return;
+    }
+    std::lock_guard lock(mtx_);
+    AddLocked(filepath, size, partition, cppcommon::CoarseClock::Instance().NowMs());
+  }
+
+  // scan dir (recursively) for closed files every interval, interrupted compactions are repaired first
+  void Watch(const std::string &dir) {
+    Recover(dir);
+    std::lock_guard lock(mtx_);
+    watched_dirs_.push_back(dir);
+  }
+
+  void Start() {
+    std::lock_guard lock(mtx_);
+    if (worker_.joinable()) return;
+    stopped_ = false;
+    worker_ = std::thread(&ParquetCompactor::WorkerThreadFunc, this);
+  }
+
+  void Stop() {
+    {
+      std::lock_guard lock(mtx_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) worker_.join();
+  }
+
+  /**
+   * Merge partitions holding at least target_bytes, or idle ones.
+   * @param force merge every partition, e.g. after the sink is closed
+   * @return number of merged files
+   */
+  size_t Compact(bool force = false) {
+    std::lock_guard compact_lock(compact_mtx_);
+    ScanWatchedDirs();
+    size_t merged = 0;
+    for (auto &job : TakeJobs(force)) {
+      if (Merge(job)) ++merged;
+      if (IsStopped()) break;
+    }
+    return merged;
+  }
+
+ private:
+  struct CompactFile {
+    std::string filepath;
+    int64_t size{0};
+  };
+
+  struct Partition {
+    std::vector<CompactFile> files;
+    int64_t bytes{0};
+    int64_t last_update_ms{0};
+  };
+
+  void AddLocked(const std::string &filepath, int64_t size, const std::string &partition, int64_t update_ms) {
+    if (size >= options_.target_bytes || !known_.insert(filepath).second) return;
+    auto &p = partitions_[partition];
+    p.files.push_back({filepath, size});
+    p.bytes += size;
+    p.last_update_ms = std::max(p.last_update_ms, update_ms);
+  }
+
+  void WorkerThreadFunc() {
+    std::unique_lock lock(mtx_);
+    while (!stopped_) {
+      cv_.wait_for(lock, options_.interval, [this] { return stopped_; });
+      if (stopped_) break;
+      lock.unlock();
+      Compact();
+      lock.lock();
+    }
+  }
+
+  inline bool IsStopped() {
+    std::lock_guard lock(mtx_);
+    return stopped_;
+  }
+
+  // files grouped into bins of about target_bytes
+  std::vector<std::vector<CompactFile>> TakeJobs(bool force) {
+    std::vector<std::vector<CompactFile>> jobs;
+    auto now = cppcommon::CoarseClock::Instance().NowMs();
+    std::lock_guard lock(mtx_);
+    for (auto it = partitions_.begin(); it != partitions_.end();) {
+      auto &p = it->second;
+      bool idle = force || now - p.last_update_ms >= options_.idle.count();
+      std::sort(p.files.begin(), p.files.end(), [](auto &a, auto &b) { return a.filepath < b.filepath; });
+      std::vector<CompactFile> bin, rest;
+      int64_t bin_bytes = 0;
+      for (auto &file : p.files) {
+        bin.push_back(std::move(file));
+        bin_bytes += bin.back().size;
+        if (bin_bytes >= options_.target_bytes) {
+          TakeBin(bin, rest, jobs);
+          bin_bytes = 0;
+        }
+      }
+      if (idle) {
+        TakeBin(bin, rest, jobs);
+      } else {
+        std::move(bin.begin(), bin.end(), std::back_inserter(rest));
+      }
+      p.files = std::move(rest);
+      p.bytes = 0;
+      for (auto &file : p.files) p.bytes += file.size;
+      if (p.files.empty() || idle) {
+        // single files of idle partitions are never merged, forget them
+        for (auto &file : p.files) known_.erase(file.filepath);
+        it = partitions_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return jobs;
+  }
+
+  inline void TakeBin(std::vector<CompactFile> &bin, std::vector<CompactFile> &rest,
+                      std::vector<std::vector<CompactFile>> &jobs) {
+    if (bin.size() >= options_.min_files && bin.size() > 1) {
+      jobs.push_back(std::move(bin));
+    } else {
+      std::move(bin.begin(), bin.end(), std::back_inserter(rest));
+    }
+    bin.clear();
+  }
+
+  // outputs are named after the first input, e.g. table_20250620_101500_0.compacted.parquet, or
+  // table_20250620_101500_0.<attempt>.compacted.parquet if the name is taken
+  static std::filesystem::path MergedPath(const std::filesystem::path &first, int attempt = 0) {
+    auto path = first;
+    auto stem = first.stem().string();
+    if (attempt > 0) stem += "." + std::to_string(attempt);
+    path.replace_filename(stem + kCompactedMark + first.extension().string());
+    return path;
+  }
+
+  static constexpr int kMaxRenameAttempts = 1000;
+
+  static inline bool IsMerged(const std::filesystem::path &path) {
+    return path.stem().string().ends_with(kCompactedMark);
+  }
+
+  static arrow::Result<std::unique_ptr<parquet::arrow::FileReader>> OpenReader(const std::string &filepath) {
+    ARROW_ASSIGN_OR_RAISE(auto input, arrow::io::ReadableFile::Open(filepath));
+    parquet::arrow::FileReaderBuilder builder;
+    ARROW_RETURN_NOT_OK(builder.Open(input));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(builder.Build(&reader));
+    return reader;
+  }
+
+  bool Merge(const std::vector<CompactFile> &files) {
+    auto target = MergedPath(files.front().filepath);
+    auto tmp = target.parent_path() / ("." + target.filename().string() + kCompactingSuffix);
+    auto manifest = tmp.string() + kManifestSuffix;
+    std::vector<std::string> merged;
+    auto s = MergeInto(files, tmp.string(), merged);
+    // the manifest is removed before tmp, Recover takes a manifest without tmp for a renamed file
+    auto discard = [&] {
+      std::error_code ec;
+      std::filesystem::remove(manifest, ec);
+      std::filesystem::remove(tmp, ec);
+      Forget(files);
+      return false;
+    };
+    if (!s.ok() || merged.size() < 2 || !SyncFileData(tmp.string()) || !WriteManifest(manifest, merged)) {
+      if (!s.ok()) {
+        spdlog::error("[ParquetCompactor] merge files failed. [target={}, error={}]", target.string(), s.ToString());
+      }
+      return discard();
+    }
+    // never replace a file, e.g. the output of an earlier merge named after an input of the same name
+    int attempt = 0;
+    while (!RenameNoReplace(tmp.string(), target.string())) {
+      if (errno != EEXIST || ++attempt > kMaxRenameAttempts) {
+        spdlog::error("[ParquetCompactor] rename merged file failed. [target={}, errno={}]", target.string(), errno);
+        return discard();
+      }
+      target = MergedPath(files.front().filepath, attempt);
+    }
+    std::error_code ec;
+    for (auto &filepath : merged) {
+      if (!std::filesystem::remove(filepath, ec) && ec) {
+        spdlog::error("[ParquetCompactor] remove merged input failed. [filepath={}, error={}]", filepath, ec.message());
+      }
+    }
+    std::filesystem::remove(manifest, ec);
+    Forget(files);
+    spdlog::info("[ParquetCompactor] merge files success. [target={}, files={}]", target.string(), merged.size());
+    return true;
+  }
+
+  // a line of size, mtime and filename for every input, synced before the merged file is renamed into place
+  static bool WriteManifest(const std::string &manifest, const std::vector<std::string> &inputs) {
+    {
+      std::ofstream ofs(manifest, std::ios::trunc);
+      for (auto &filepath : inputs) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(filepath, ec);
+        auto mtime = std::filesystem::last_write_time(filepath, ec);
+        if (ec) {
+          spdlog::error("[ParquetCompactor] stat merged input failed. [filepath={}, error={}]", filepath, ec.message());
+          return false;
+        }
+        ofs << size << '\t' << mtime.time_since_epoch().count() << '\t'
+            << std::filesystem::path(filepath).filename().string() << '\n';
+      }
+      if (!ofs.flush()) {
+        spdlog::error("[ParquetCompactor] write manifest failed. [manifest={}]", manifest);
+        return false;
+      }
+    }
+    return SyncFileData(manifest);
+  }
+
+  // remove the inputs of a manifest which still are the files merged
+  static void RemoveManifestInputs(const std::filesystem::path &manifest) {
+    std::ifstream ifs(manifest);
+    uintmax_t size;
+    int64_t mtime;
+    std::string filename;
+    while (ifs >> size >> mtime && ifs.get() == '\t' && std::getline(ifs, filename)) {
+      auto input = manifest.parent_path() / filename;
+      std::error_code ec;
+      auto input_size = std::filesystem::file_size(input, ec);
+      if (ec) continue;
+      auto input_mtime = std::filesystem::last_write_time(input, ec);
+      if (ec) continue;
+      if (input_size != size || input_mtime.time_since_epoch().count() != mtime) {
+        spdlog::warn("[ParquetCompactor] keep input replaced by another file. [filepath={}]", input.string());
+        continue;
+      }
+      if (std::filesystem::remove(input, ec)) {
+        spdlog::info("[ParquetCompactor] remove merged input. [filepath={}]", input.string());
+      }
+    }
+  }
+
+  // @param merged inputs copied into the file, inputs which are missing, unreadable or of another schema are skipped
+  arrow::Status MergeInto(const std::vector<CompactFile> &files, const std::string &tmp,
+                          std::vector<std::string> &merged) {
+    // footers are read twice, readers are not kept open to bound the number of open files
+    std::shared_ptr<arrow::Schema> schema;
+    for (auto &file : files) {
+      auto reader = OpenReader(file.filepath);
+      if (!reader.ok()) {
+        // e.g. removed by max_backup_files
+        spdlog::warn("[ParquetCompactor] skip unreadable file. [filepath={}, error={}]", file.filepath,
+                     reader.status().ToString());
+        continue;
+      }
+      std::shared_ptr<arrow::Schema> file_schema;
+      ARROW_RETURN_NOT_OK((*reader)->GetSchema(&file_schema));
+      if (!schema) {
+        schema = file_schema;
+      } else if (!schema->Equals(*file_schema, false)) {
+        spdlog::warn("[ParquetCompactor] skip file of another schema. [filepath={}]", file.filepath);
+        continue;
+      }
+      merged.push_back(file.filepath);
+    }
+    if (merged.size() < 2) return arrow::Status::OK();
+
+    ARROW_ASSIGN_OR_RAISE(auto output, arrow::io::FileOutputStream::Open(tmp));
+    ARROW_ASSIGN_OR_RAISE(auto writer, parquet::arrow::FileWriter::Open(
+                                           *schema, arrow::default_memory_pool(), output,
+                                           MakeParquetProperties(options_.parquet, std::numeric_limits<int64_t>::max()),
+                                           MakeArrowParquetProperties(options_.parquet)));
+    std::vector<std::shared_ptr<arrow::Table>> tables;
+    int64_t buffered_bytes = 0;
+    auto flush = [&]() -> arrow::Status {
+      if (tables.empty()) return arrow::Status::OK();
+      ARROW_ASSIGN_OR_RAISE(auto table, arrow::ConcatenateTables(tables));
+      tables.clear();
+      buffered_bytes = 0;
+      // schema metadata is not compared
+      return writer->WriteTable(*table, std::max<int64_t>(1, table->num_rows()));
+    };
+    for (auto &filepath : merged) {
+      ARROW_ASSIGN_OR_RAISE(auto reader, OpenReader(filepath));
+      auto file_metadata = reader->parquet_reader()->metadata();
+      for (int i = 0; i < reader->num_row_groups(); ++i) {
+        auto bytes = file_metadata->RowGroup(i)->total_byte_size();
+        Throttle(bytes);
+        std::shared_ptr<arrow::Table> table;
+        ARROW_RETURN_NOT_OK(reader->ReadRowGroup(i, &table));
+        tables.push_back(std::move(table));
+        buffered_bytes += bytes;
+        if (buffered_bytes >= options_.parquet.row_group_bytes) ARROW_RETURN_NOT_OK(flush());
+      }
+    }
+    ARROW_RETURN_NOT_OK(flush());
+    ARROW_RETURN_NOT_OK(writer->Close());
+    return output->Close();
+  }
+
+  // sleep until bytes are within bytes_per_second
+  void Throttle(int64_t bytes) {
+    if (options_.bytes_per_second <= 0) return;
+    auto now = std::chrono::steady_clock::now();
+    next_read_ = std::max(next_read_, now) +
+                 std::chrono::microseconds(bytes * 1000 * 1000 / options_.bytes_per_second);
+    std::unique_lock lock(mtx_);
+    cv_.wait_until(lock, next_read_, [this] { return stopped_; });
+  }
+
+  inline void Forget(const std::vector<CompactFile> &files) {
+    std::lock_guard lock(mtx_);
+    for (auto &file : files) known_.erase(file.filepath);
+  }
+
+  void ScanWatchedDirs() {
+    std::vector<std::string> dirs;
+    {
+      std::lock_guard lock(mtx_);
+      dirs = watched_dirs_;
+    }
+    auto now = std::filesystem::file_time_type::clock::now();
+    auto period = std::chrono::milliseconds(static_cast<int64_t>(options_.period));
+    for (auto &dir : dirs) {
+      std::error_code ec;
+      for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+           !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        auto &path = it->path();
+        std::error_code file_ec;
+        if (!it->is_regular_file(file_ec) || path.extension() != "." + options_.suffix ||
+            path.filename().string().starts_with(".") || IsMerged(path)) {
+          continue;
+        }
+        auto mtime = it->last_write_time(file_ec);
+        if (file_ec || now - mtime < options_.min_age) continue;
+        auto sys_mtime = std::chrono::file_clock::to_sys(mtime);
+        auto mtime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sys_mtime.time_since_epoch()).count();
+        auto partition = path.parent_path().string();
+        if (period.count() > 0) {
+          partition += "@" + std::to_string(mtime_ms - mtime_ms % period.count());
+        }
+        auto size = static_cast<int64_t>(it->file_size(file_ec));
+        if (file_ec) continue;
+        std::lock_guard lock(mtx_);
+        AddLocked(path.string(), size, partition, mtime_ms);
+      }
+    }
+  }
+
+  /**
+   * Finish or roll back compactions interrupted by a crash, from their leftover manifests:
+   * the temp file exists: not renamed, the temp file and the manifest are removed, inputs are kept;
+   * the temp file is gone: renamed into place, unchanged inputs are removed, then the manifest.
+   */
+  void Recover(const std::string &dir) {
+    std::error_code ec;
+    std::vector<std::filesystem::path> temps, manifests;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+      auto &path = it->path();
+      auto filename = path.filename().string();
+      if (!filename.starts_with(".")) continue;
+      if (filename.ends_with(std::string(kCompactingSuffix) + kManifestSuffix)) {
+        manifests.push_back(path);
+      } else if (filename.ends_with(kCompactingSuffix)) {
+        temps.push_back(path);
+      }
+    }
+    for (auto &manifest : manifests) {
+      auto tmp = manifest;
+      tmp.replace_extension();
+      std::error_code remove_ec;
+      if (!std::filesystem::exists(tmp, remove_ec)) RemoveManifestInputs(manifest);
+      std::filesystem::remove(manifest, remove_ec);
+    }
+    for (auto &tmp : temps) {
+      std::error_code remove_ec;
+      std::filesystem::remove(tmp, remove_ec);
+    }
+  }
+
+ private:
+  ParquetCompactorOptions options_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stopped_{false};
+  std::thread worker_;
+  std::vector<std::string> watched_dirs_;
+  std::map<std::string, Partition> partitions_;
+  std::set<std::string> known_;
+
+  // compaction state
+  std::mutex compact_mtx_;
+  std::chrono::steady_clock::time_point next_read_{};
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,362 @@
+/**
+ * @file partitioned_sink.h
+ * @brief sink writing records into hive style partition directories picked by record fields
+ * @author zhenkai.sun
+ * @date 2025-06-25 11:41:09
+ */
+#pragma once
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <initializer_list>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "concurrentqueue/blockingconcurrentqueue.h"
+#include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/post_roll.h"
+
+namespace cppcommon::os {
+// {"country", "US"}, {"app", "x"} -> country=US/app=x, '/' '=' and '%' in values are escaped as %XX
+inline std::string HivePartition(std::initializer_list<std::pair<std::string_view, std::string_view>> fields) {
+  std::string partition;
+  for (auto &[key, value] : fields) {
+    if (!partition.empty()) partition.push_back('/');
+    partition.append(key).push_back('=');
+    if (value.empty()) {
+      partition.append("__HIVE_DEFAULT_PARTITION__");
+      continue;
+    }
+    for (auto c : value) {
+      if (c == '/' || c == '=' || c == '%' || static_cast<unsigned char>(c) < 0x20) {
+        partition.append(fmt::format("%{:02X}", static_cast<unsigned char>(c)));
+      } else {
+        partition.push_back(c);
+      }
+    }
+  }
+  return partition;
+}
+
+/**
+ * Records are routed by the partition path of partition_func into {path}/{partition}/{name}[_shard{id}]_<date>_<idx>
+ * files. Each shard owns a writer thread and up to max_open_files / shards open files, the least recently written one
+ * is closed to open another, and files idle for idle_timeout are closed. Closed files go through the post roll
+ * pipeline like rolled files of BaseSink, and a partition written again later gets a new file.
+ * Queues are bounded by queue_options like BaseSink, SPILL is not supported.
+ * usage:
+ *   PartitionedSink<std::string, LocalTextSinkFileSystem, TextWriterOptions> sink(
+ *       {.name = "events", .path = "/data/events",
+ *        .partition_func = [](const std::string &r) { return HivePartition({{"app", r.substr(0, 3)}}); }});
+ */
+template <typename Record, typename FS = SinkFileSystem<Record>, typename OfsOptions = void>
+class PartitionedSink {
+ public:
+  using PartitionFunc = std::function<std::string(const Record &)>;
+
+  struct Options {
+    std::string name;
+    std::string path{""};
+    PartitionFunc partition_func;  // relative directory of the record, called by producers
+    std::string suffix{"log"};
+    int64_t max_rows_per_file{1000000};
+    size_t max_open_files{256};  // over all shards
+    std::chrono::milliseconds idle_timeout{60 * 1000};
+    int shards{1};  // records of a partition always go to the same shard
+    size_t write_batch_size{256};
+    // calling with closed filepath, after post roll steps. files are not rolled by time, so the time_roll_policy
+    // argument is a default one without period
+    OnRollFileCallback on_roll_callback{};
+    [[no_unique_address]] std::conditional_t<std::is_void_v<OfsOptions>, int, OfsOptions> ofs_options;
+    PostRollOptions post_roll;
+    SinkQueueOptions queue_options;  // bytes of a queued record are RecordByteSize plus its partition
+  };
+
+  explicit PartitionedSink(Options &&options) : options_(std::move(options)) {
+    if (!options_.partition_func) {
+      throw std::invalid_argument("partition_func is required");
+    }
+    if (options_.shards < 1) {
+      throw std::invalid_argument("shards should be positive");
+    }
+    auto &qo = options_.queue_options;
+    if (qo.policy == OverflowPolicy::SAMPLE && qo.sample_rate < 1) {
+      throw std::invalid_argument("sample_rate should be positive");
+    }
+    if (qo.capacity && qo.policy == OverflowPolicy::SPILL) {
+      throw std::invalid_argument("spilling is not supported by PartitionedSink");
+    }
+    if (!options_.post_roll.pool) options_.post_roll.pool = PostRollPool::Default();
+    auto files_per_shard = std::max<size_t>(1, options_.max_open_files / options_.shards);
+    for (int i = 0; i < options_.shards; ++i) {
+      auto shard = std::make_unique<Shard>();
+      shard->id = i;
+      shard->max_open_files = files_per_shard;
+      shards_.emplace_back(std::move(shard));
+    }
+    for (auto &shard : shards_) {
+      shard->writer = std::thread(&PartitionedSink::WriteThreadFunc, this, shard.get());
+    }
+  }
+
+  virtual ~PartitionedSink() { Close(); }
+
+  PartitionedSink(const PartitionedSink &) = delete;
+  PartitionedSink &operator=(const PartitionedSink &) = delete;
+
+  template <typename T>
+  WriteStatus Write(T &&record) {
+    if (stopped_) return WriteStatus::STOPPED;
+    Entry entry{.record = Record(std::forward<T>(record))};
+    entry.partition = options_.partition_func(entry.record);
+    auto &shard = shards_.size() == 1 ? *shards_.front()
+                                      : *shards_[std::hash<std::string>{}(entry.partition) % shards_.size()];
+    auto &qo = options_.queue_options;
+    if (qo.capacity) {
+      auto cost = EntryCost(entry);
+      if (!shard.budget.TryReserve(cost, static_cast<int64_t>(qo.capacity))) {
+        auto status = shard.budget.Overflow(qo, cost, stopped_, [&](int64_t c) { DropOldest(shard, c); });
+        if (status != WriteStatus::OK) return status;
+      }
+    }
+    shard.queue.enqueue(std::move(entry));
+    return WriteStatus::OK;
+  }
+
+  inline size_t Size() const {
+    size_t size = 0;
+    for (auto &shard : shards_) size += shard->queue.size_approx();
+    return size;
+  }
+
+  inline size_t OpenFiles() const {
+    size_t files = 0;
+    for (auto &shard : shards_) files += shard->open_files.load(std::memory_order_relaxed);
+    return files;
+  }
+
+  // files closed to stay under max_open_files, and files closed after idle_timeout
+  inline uint64_t EvictedFiles() const { return evicted_.load(std::memory_order_relaxed); }
+  inline uint64_t IdleClosedFiles() const { return idle_closed_.load(std::memory_order_relaxed); }
+
+  std::vector<PostRollStepStats> PostRollStats() { return post_roll_stats_.Snapshot(); }
+
+  SinkDropStats DropStats() const {
+    SinkDropStats stats;
+    for (auto &shard : shards_) shard->budget.AddDrops(stats);
+    stats.dropped_encode = dropped_encode_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void Close() {
+    stopped_ = true;
+    for (auto &shard : shards_) shard->budget.WakeAll();
+    for (auto &shard : shards_) {
+      if (shard->writer.joinable()) shard->writer.join();
+    }
+    std::unique_lock lock(post_roll_mtx_);
+    post_roll_cv_.wait(lock, [this] { return post_roll_inflight_ == 0; });
+  }
+
+ protected:
+  struct Entry {
+    std::string partition;
+    Record record;
+  };
+
+  struct PartitionFile {
+    std::string partition;
+    std::string filepath;
+    std::shared_ptr<FS> ofs;
+    int64_t rows{0};
+    std::chrono::steady_clock::time_point last_write;
+  };
+  using LruList = std::list<PartitionFile>;  // most recently written first
+
+  struct Shard {
+    int id{0};
+    size_t max_open_files{1};
+    moodycamel::BlockingConcurrentQueue<Entry> queue;
+    QueueBudget budget;
+    std::thread writer;
+    // owned by the writer thread
+    LruList lru;
+    std::unordered_map<std::string_view, typename LruList::iterator> files;  // keys point into lru
+    std::atomic<size_t> open_files{0};
+    uint64_t next_index{0};  // never reused, files of a partition reopened later are not overwritten
+  };
+
+  void WriteThreadFunc(Shard *shard) {
+    std::vector<Entry> batch(std::max<size_t>(1, options_.write_batch_size));
+    std::vector<Record> records;
+    auto timeout = std::clamp<std::chrono::milliseconds>(options_.idle_timeout, std::chrono::milliseconds(1),
+                                                          std::chrono::milliseconds(100));
+    while (!stopped_ || shard->queue.size_approx() != 0) {
+      auto count = shard->queue.wait_dequeue_bulk_timed(batch.begin(), batch.size(), timeout);
+      ReleaseQueued(*shard, std::span<Entry>(batch.data(), count));
+      // records of a partition are written at once, in their order
+      std::stable_sort(batch.begin(), batch.begin() + count,
+                       [](const Entry &a, const Entry &b) { return a.partition < b.partition; });
+      for (size_t i = 0; i < count;) {
+        auto j = i + 1;
+        while (j < count && batch[j].partition == batch[i].partition) ++j;
+        records.clear();
+        for (auto k = i; k < j; ++k) records.emplace_back(std::move(batch[k].record));
+        WritePartition(*shard, batch[i].partition, records);
+        i = j;
+      }
+      CloseIdleFiles(*shard);
+    }
+    while (!shard->lru.empty()) CloseFile(*shard, std::prev(shard->lru.end()));
+  }
+
+  inline int64_t EntryCost(const Entry &entry) const {
+    if (options_.queue_options.unit == QueueCapacityUnit::RECORDS) return 1;
+    return static_cast<int64_t>(RecordByteSize<Record>{}(entry.record) + entry.partition.size());
+  }
+
+  void DropOldest(Shard &shard, int64_t cost) {
+    auto capacity = static_cast<int64_t>(options_.queue_options.capacity);
+    while (!shard.budget.TryReserve(cost, capacity)) {
+      Entry oldest;
+      if (!shard.queue.try_dequeue(oldest)) {
+        // queued records are taken by the writer, admit the record anyway
+        shard.budget.queued += cost;
+        return;
+      }
+      shard.budget.queued -= EntryCost(oldest);
+      shard.budget.drops.oldest.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void ReleaseQueued(Shard &shard, std::span<Entry> entries) {
+    if (options_.queue_options.capacity == 0 || entries.empty()) return;
+    int64_t cost = 0;
+    for (auto &entry : entries) cost += EntryCost(entry);
+    shard.budget.Release(cost);
+  }
+
+  void WritePartition(Shard &shard, const std::string &partition, std::span<Record> records) {
+    while (!records.empty()) {
+      auto it = AcquireFile(shard, partition);
+      if (it == shard.lru.end()) return;
+      auto count = std::min<size_t>(records.size(), std::max<int64_t>(1, options_.max_rows_per_file - it->rows));
+      it->rows += it->ofs->WriteBatch(records.first(count));
+      it->last_write = std::chrono::steady_clock::now();
+      records = records.subspan(count);
+      if (it->rows >= options_.max_rows_per_file) CloseFile(shard, it);
+    }
+  }
+
+  // the file of the partition moved to the front of lru, lru.end() if it can not be opened
+  typename LruList::iterator AcquireFile(Shard &shard, const std::string &partition) {
+    auto found = shard.files.find(partition);
+    if (found != shard.files.end()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+      return found->second;
+    }
+    if (shard.lru.size() >= shard.max_open_files) {
+      evicted_.fetch_add(1, std::memory_order_relaxed);
+      CloseFile(shard, std::prev(shard.lru.end()));
+    }
+    auto dir = std::filesystem::path(options_.path.empty() ? "." : options_.path) / partition;
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    auto filepath = NextFilePath(shard, dir);
+    std::shared_ptr<FS> ofs;
+    if constexpr (std::is_void_v<OfsOptions>) {
+      ofs = std::make_shared<FS>();
+    } else {
+      ofs = std::make_shared<FS>(options_.ofs_options);
+    }
+    ofs->Open(filepath);
+    if (!ofs->IsOpen()) {
+      spdlog::error("[PartitionedSink] open file failed, records are dropped. [filepath={}]", filepath);
+      return shard.lru.end();
+    }
+    shard.lru.push_front({.partition = partition, .filepath = filepath, .ofs = std::move(ofs), .rows = 0,
+                          .last_write = std::chrono::steady_clock::now()});
+    shard.files.emplace(shard.lru.front().partition, shard.lru.begin());
+    shard.open_files.store(shard.lru.size(), std::memory_order_relaxed);
+    return shard.lru.begin();
+  }
+
+  std::string NextFilePath(Shard &shard, const std::filesystem::path &dir) {
+    while (true) {
+      std::ostringstream filename;
+      filename << options_.name;
+      if (shards_.size() > 1) filename << "_shard" << shard.id;
+      filename << "_" << GetDateFileName() << "_" << shard.next_index++ << "." << options_.suffix;
+      if constexpr (requires { options_.ofs_options.compression.type; }) {
+        filename << CompressionSuffix(options_.ofs_options.compression.type);
+      }
+      auto filepath = (dir / filename.str()).string();
+      if (!FS::IsExists(filepath)) return filepath;
+    }
+  }
+
+  void CloseIdleFiles(Shard &shard) {
+    auto now = std::chrono::steady_clock::now();
+    while (!shard.lru.empty() && now - shard.lru.back().last_write >= options_.idle_timeout) {
+      idle_closed_.fetch_add(1, std::memory_order_relaxed);
+      CloseFile(shard, std::prev(shard.lru.end()));
+    }
+  }
+
+  void CloseFile(Shard &shard, typename LruList::iterator it) {
+    shard.files.erase(it->partition);
+    auto task = [this, ofs = std::move(it->ofs), file = RolledFile{.filepath = std::move(it->filepath)}]() mutable {
+      auto start = SteadyNowNs();
+      ofs->Close();
+      dropped_encode_.fetch_add(ofs->DroppedRows(), std::memory_order_relaxed);
+      ofs.reset();
+      post_roll_stats_.Record("close", true, 0, static_cast<uint64_t>((SteadyNowNs() - start) / 1000));
+      RunPostRollSteps(*options_.post_roll.pool, options_.post_roll.steps, std::move(file), post_roll_stats_,
+                       [this](RolledFile &file) {
+                         if (options_.on_roll_callback) options_.on_roll_callback(file.filepath, TimeRollPolicy{});
+                         std::lock_guard lock(post_roll_mtx_);
+                         if (--post_roll_inflight_ == 0) post_roll_cv_.notify_all();
+                       });
+    };
+    shard.lru.erase(it);
+    shard.open_files.store(shard.lru.size(), std::memory_order_relaxed);
+    {
+      std::lock_guard lock(post_roll_mtx_);
+      ++post_roll_inflight_;
+    }
+    options_.post_roll.pool->Submit(std::move(task));
+  }
+
+ protected:
+  Options options_;
+  std::atomic<bool> stopped_{false};
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> evicted_{0};
+  std::atomic<uint64_t> idle_closed_{0};
+  std::atomic<uint64_t> dropped_encode_{0};
+
+  std::mutex post_roll_mtx_;
+  std::condition_variable post_roll_cv_;
+  size_t post_roll_inflight_{0};
+  cppcommon::os::PostRollStats post_roll_stats_;
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,309 @@
+/**
+ * @file post_roll.h
+ * @brief post roll pipeline of sinks, closing and shipping rolled files on a shared bounded worker pool
+ * @author zhenkai.sun
+ * @date 2025-06-22 14:35:06
+ */
+#pragma once
+
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/transfor/storage_provider.h"
+
+namespace cppcommon::os {
+/**
+ * Fixed workers with a bounded queue, Submit blocks while the queue is full. One pool is shared by all sinks by
+ * default, so its workers are the concurrency limit of closing, compressing and uploading in the process. Tasks of
+ * SubmitAfter, e.g. retries of admitted work, wait for their deadline outside the queue without holding a worker.
+ */
+class PostRollPool {
+ public:
+  static constexpr unsigned int kDefaultThreads = 4;
+  static constexpr size_t kDefaultCapacity = 1024;
+
+  PostRollPool(unsigned int threads, size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {
+    for (unsigned int i = 0; i < std::max(1u, threads); ++i) {
+      workers_.emplace_back(&PostRollPool::WorkerThreadFunc, this);
+    }
+  }
+
+  // pending tasks, delayed ones included, are finished before the workers exit
+  ~PostRollPool() {
+    {
+      std::lock_guard lock(mtx_);
+      stopped_ = true;
+    }
+    task_cv_.notify_all();
+    for (auto &worker : workers_) {
+      if (worker.joinable()) worker.join();
+    }
+  }
+
+  PostRollPool(const PostRollPool &) = delete;
+  PostRollPool &operator=(const PostRollPool &) = delete;
+
+  static const std::shared_ptr<PostRollPool> &Default() {
+    static const auto pool = std::make_shared<PostRollPool>(kDefaultThreads, kDefaultCapacity);
+    return pool;
+  }
+
+  void Submit(std::function<void()> task) {
+    std::unique_lock lock(mtx_);
+    space_cv_.wait(lock, [this] { return tasks_.size() < capacity_; });
+    tasks_.push_back(std::move(task));
+    lock.unlock();
+    task_cv_.notify_one();
+  }
+
+  // never blocks, the task runs on a worker once the delay passed, ahead of the queued tasks
+  void SubmitAfter(std::chrono::milliseconds delay, std::function<void()> task) {
+    {
+      std::lock_guard lock(mtx_);
+      delayed_.emplace(std::chrono::steady_clock::now() + delay, std::move(task));
+    }
+    // the earliest deadline may have changed, every waiting worker re-reads it
+    task_cv_.notify_all();
+  }
+
+  inline size_t Size() {
+    std::lock_guard lock(mtx_);
+    return tasks_.size() + delayed_.size();
+  }
+
+  inline size_t Threads() const { return workers_.size(); }
+
+ private:
+  void WorkerThreadFunc() {
+    while (true) {
+      std::function<void()> task;
+      bool queued = false;
+      {
+        std::unique_lock lock(mtx_);
+        while (true) {
+          if (!delayed_.empty() && delayed_.begin()->first <= std::chrono::steady_clock::now()) {
+            task = std::move(delayed_.begin()->second);
+            delayed_.erase(delayed_.begin());
+            break;
+          }
+          if (!tasks_.empty()) {
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+            queued = true;
+            break;
+          }
+          if (delayed_.empty()) {
+            if (stopped_) return;
+            task_cv_.wait(lock);
+          } else {
+            task_cv_.wait_until(lock, delayed_.begin()->first);
+          }
+        }
+      }
+      if (queued) space_cv_.notify_one();
+      task();
+    }
+  }
+
+ private:
+  size_t capacity_;
+  std::mutex mtx_;
+  std::condition_variable task_cv_;
+  std::condition_variable space_cv_;
+  std::deque<std::function<void()>> tasks_;
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> delayed_;
+  bool stopped_{false};
+  std::vector<std::thread> workers_;
+};
+
+// a closed file passing through the post roll steps
+struct RolledFile {
+  std::string filepath;  // updated by steps which replace the file, e.g. GzipStep
+  int64_t period_start_ms{-1};  // TimeRollPolicy::last_rolling_ts_ms of the file
+  std::string checksum;  // set by ChecksumStep
+};
+
+struct PostRollStep {
+  std::string name;
+  std::function<bool(RolledFile &)> func;  // @return false on failure, retried up to max_retries
+  int max_retries{0};
+  std::chrono::milliseconds retry_backoff{1000};  // doubled after every retry
+};
+
+struct PostRollStepStats {
+  std::string name;
+  uint64_t ok{0};
+  uint64_t failed{0};  // failed after all retries, later steps of the file are skipped
+  uint64_t retries{0};
+  uint64_t total_us{0};
+  uint64_t max_us{0};
+};
+
+struct PostRollOptions {
+  std::vector<PostRollStep> steps;  // run in order after the file is closed, e.g. {GzipStep(), UploadStep(...)}
+  std::shared_ptr<PostRollPool> pool;  // nullptr: PostRollPool::Default()
+};
+
+// per step counters of one sink
+class PostRollStats {
+ public:
+  void Record(const std::string &name, bool ok, int retries, uint64_t us) {
+    std::lock_guard lock(mtx_);
+    auto it = std::find_if(stats_.begin(), stats_.end(), [&name](auto &s) { return s.name == name; });
+    if (it == stats_.end()) it = stats_.insert(stats_.end(), PostRollStepStats{.name = name});
+    ok ? ++it->ok : ++it->failed;
+    it->retries += retries;
+    it->total_us += us;
+    it->max_us = std::max(it->max_us, us);
+  }
+
+  std::vector<PostRollStepStats> Snapshot() {
+    std::lock_guard lock(mtx_);
+    return stats_;
+  }
+
+ private:
+  std::mutex mtx_;
+  std::vector<PostRollStepStats> stats_;
+};
+
+// the post roll steps of one file, resumed by the retry tasks of RunPostRollSteps
+struct PostRollRun {
+  PostRollPool *pool;
+  const std::vector<PostRollStep> *steps;
+  PostRollStats *stats;
+  RolledFile file;
+  std::function<void(RolledFile &)> done;
+  size_t next{0};  // step to run
+  int retries{0};  // of the next step
+  std::chrono::milliseconds backoff{0};  // of the next retry
+  std::chrono::steady_clock::time_point start;  // of the next step, retries included
+};
+
+inline void ContinuePostRollSteps(std::shared_ptr<PostRollRun> run) {
+  for (; run->next < run->steps->size(); ++run->next) {
+    auto &step = (*run->steps)[run->next];
+    if (run->retries == 0) {
+      run->start = std::chrono::steady_clock::now();
+      run->backoff = step.retry_backoff;
+    }
+    bool ok = step.func(run->file);
+    if (!ok && run->retries < step.max_retries) {
+      auto *pool = run->pool;
+      auto backoff = std::exchange(run->backoff, run->backoff * 2);
+      ++run->retries;
+      pool->SubmitAfter(backoff, [run = std::move(run)]() mutable { ContinuePostRollSteps(std::move(run)); });
+      return;
+    }
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - run->start);
+    run->stats->Record(step.name, ok, run->retries, static_cast<uint64_t>(us.count()));
+    if (!ok) {
+      spdlog::error("[PostRoll] step failed. [step={}, filepath={}, retries={}]", step.name, run->file.filepath,
+                    run->retries);
+      break;
+    }
+    run->retries = 0;
+  }
+  run->done(run->file);
+}
+
+/**
+ * Runs the steps of a file in order, a step failing all its retries skips the rest. A failed step is retried by a
+ * task submitted to the pool after its backoff, so no worker sleeps through it and the rest of the steps run on that
+ * task. done is called once, on the thread running the last step; pool, steps and stats must outlive it.
+ */
+inline void RunPostRollSteps(PostRollPool &pool, const std::vector<PostRollStep> &steps, RolledFile file,
+                             PostRollStats &stats, std::function<void(RolledFile &)> done) {
+  ContinuePostRollSteps(std::make_shared<PostRollRun>(
+      PostRollRun{.pool = &pool, .steps = &steps, .stats = &stats, .file = std::move(file), .done = std::move(done)}));
+}
+
+// replace the file with file.gz
+inline PostRollStep GzipStep(int level = Z_DEFAULT_COMPRESSION) {
+  return {.name = "gzip", .func = [level](RolledFile &file) {
+            auto gz_filepath = file.filepath + ".gz";
+            std::ifstream ifs(file.filepath, std::ios::binary);
+            auto gz = gzopen(gz_filepath.c_str(), ("wb" + std::to_string(std::clamp(level, -1, 9))).c_str());
+            if (!ifs || !gz) {
+              spdlog::error("[PostRoll] open file failed. [filepath={}]", file.filepath);
+              if (gz) gzclose(gz);
+              return false;
+            }
+            std::string buffer(1024 * 1024, '\0');
+            bool ok = true;
+            while (ok && ifs) {
+              ifs.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+              auto n = static_cast<unsigned int>(ifs.gcount());
+              if (n > 0 && gzwrite(gz, buffer.data(), n) != static_cast<int>(n)) ok = false;
+            }
+            ok = gzclose(gz) == Z_OK && ok && ifs.eof();
+            std::error_code ec;
+            if (!ok) {
+              std::filesystem::remove(gz_filepath, ec);
+              return false;
+            }
+            std::filesystem::remove(file.filepath, ec);
+            file.filepath = gz_filepath;
+            return true;
+          }};
+}
+
+// crc32 of the file content, in hex
+inline PostRollStep ChecksumStep() {
+  return {.name = "checksum", .func = [](RolledFile &file) {
+            std::ifstream ifs(file.filepath, std::ios::binary);
+            if (!ifs) return false;
+            std::string buffer(1024 * 1024, '\0');
+            uLong crc = crc32(0L, Z_NULL, 0);
+            while (ifs) {
+              ifs.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+              auto n = static_cast<uInt>(ifs.gcount());
+              if (n > 0) crc = crc32(crc, reinterpret_cast<const Bytef *>(buffer.data()), n);
+            }
+            if (!ifs.eof()) return false;
+            file.checksum = fmt::format("{:08x}", static_cast<uint32_t>(crc));
+            return true;
+          }};
+}
+
+// upload to {prefix}/{filename}
+inline PostRollStep UploadStep(std::shared_ptr<StorageProvider> provider, std::string bucket, std::string prefix,
+                               int max_retries = 3) {
+  prefix = cppcommon::TrimSuffix(prefix, "/");
+  auto func = [provider = std::move(provider), bucket = std::move(bucket), prefix](RolledFile &file) {
+    auto filename = std::filesystem::path(file.filepath).filename().string();
+    auto remote = prefix.empty() ? filename : prefix + "/" + filename;
+    auto s = provider->Upload({.bucket = bucket, .remote_file_path = remote, .local_file_path = file.filepath});
+    if (!s.ok()) {
+      spdlog::error("[PostRoll] upload file failed. [filepath={}, error={}]", file.filepath, s.ToString());
+    }
+    return s.ok();
+  };
+  return {.name = "upload", .func = std::move(func), .max_retries = max_retries};
+}
+
+inline PostRollStep DeleteStep() {
+  return {.name = "delete", .func = [](RolledFile &file) {
+            std::error_code ec;
+            std::filesystem::remove(file.filepath, ec);
+            return !ec;
+          }};
+}
+}  // namespace cppcommon::os
@@ -0,0 +1,394 @@
+/**
+ * @file replay_reader.h
+ * @brief parallel reader of files rolled by text and csv sinks, in roll order
+ * @author zhenkai.sun
+ * @date 2025-06-24 15:03:51
+ */
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/extends/csv/csv.h"
+#include "cppcommon/objectstorage/sink/csv_row.h"
+
+namespace cppcommon::os {
+// a rolled file, fields are parsed from {name}[_shard{id}][_{hostname}][_{%Y%m%d_%H%M%S}][_{ts_ms}][_{idx}].{suffix}
+struct ReplayFile {
+  std::string filepath;
+  uintmax_t size{0};
+  int shard{-1};  // -1: not sharded
+  int index{-1};  // -1: not rotated
+  int64_t start_ms{-1};  // date or timestamp of the name, last write time if the name has neither
+  int64_t mtime_ms{-1};  // last write time, the end of the file
+};
+
+struct ReplayOptions {
+  std::string dir;  // searched recursively, hidden files are skipped
+  std::string name;  // sink name, empty: any
+  std::string suffix{"log"};  // e.g. "csv", compressed files (.csv.gz) are not matched
+  bool name_with_hostname{false};  // otherwise names with unknown parts, e.g. of sink {name}_other, are skipped
+  int64_t begin_ms{std::numeric_limits<int64_t>::min()};  // files overlapping [begin_ms, end_ms)
+  int64_t end_ms{std::numeric_limits<int64_t>::max()};
+  unsigned int threads{0};  // 0: hardware concurrency
+  bool ordered{true};  // batches in roll order, otherwise as soon as they are parsed
+  size_t max_pending_batches{0};  // parsed batches buffered ahead of the consumer, 0: 2 * threads
+  size_t chunk_bytes{16 * 1024 * 1024};  // text files are split into chunks at line boundaries
+};
+
+// files of a sink, e.g. ReplayOptionsOf(sink_options), then narrow the time range
+template <typename SinkOptions>
+ReplayOptions ReplayOptionsOf(const SinkOptions &options) {
+  return {.dir = options.path.empty() ? "." : options.path,
+          .name = options.name,
+          .suffix = options.name_options.suffix,
+          .name_with_hostname = options.name_options.name_with_hostname};
+}
+
+inline bool IsAllDigits(std::string_view s) {
+  return !s.empty() && std::all_of(s.begin(), s.end(), [](char c) { return c >= '0' && c <= '9'; });
+}
+
+// @return false if the filename does not belong to the sink
+inline bool ParseReplayFileName(std::string_view filename, std::string_view name, std::string_view suffix,
+                                bool with_hostname, ReplayFile &file) {
+  auto ext = "." + std::string(suffix);
+  if (filename.empty() || filename.front() == '.' || !filename.ends_with(ext)) return false;
+  auto stem = filename.substr(0, filename.size() - ext.size());
+  if (!stem.starts_with(name)) return false;
+  stem.remove_prefix(name.size());
+  if (!name.empty()) {
+    if (!stem.empty() && stem.front() != '_') return false;
+    if (!stem.empty()) stem.remove_prefix(1);
+  }
+  std::vector<std::string_view> tokens;
+  while (!stem.empty()) {
+    auto pos = stem.find('_');
+    tokens.push_back(stem.substr(0, pos));
+    stem = pos == std::string_view::npos ? std::string_view() : stem.substr(pos + 1);
+  }
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    auto &token = tokens[i];
+    if (token.size() == 8 && IsAllDigits(token) && i + 1 < tokens.size() && tokens[i + 1].size() == 6 &&
+        IsAllDigits(tokens[i + 1])) {
+      std::tm tm{};
+      auto date = std::string(token) + std::string(tokens[i + 1]);
+      if (strptime(date.c_str(), "%Y%m%d%H%M%S", &tm)) file.start_ms = static_cast<int64_t>(timegm(&tm)) * 1000;
+      ++i;
+    } else if (token.starts_with("shard") && IsAllDigits(token.substr(5))) {
+      file.shard = std::stoi(std::string(token.substr(5)));
+    } else if (IsAllDigits(token) && token.size() >= 10) {
+      if (file.start_ms < 0) file.start_ms = std::stoll(std::string(token));
+    } else if (IsAllDigits(token) && i + 1 == tokens.size() && token.size() < 10) {
+      file.index = std::stoi(std::string(token));
+    } else if (with_hostname && i == (file.shard >= 0 ? 1 : 0)) {
+      // hostname follows the name or the shard
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// matched files in roll order: start time, file index, shard
+inline std::vector<ReplayFile> ListReplayFiles(const ReplayOptions &options) {
+  std::vector<ReplayFile> files;
+  std::error_code ec;
+  std::filesystem::recursive_directory_iterator it(options.dir, ec), end;
+  if (ec) {
+    spdlog::error("[ReplayReader] list dir failed. [dir={}, error={}]", options.dir, ec.message());
+    return files;
+  }
+  for (; it != end; it.increment(ec)) {
+    std::error_code entry_ec;
+    if (!it->is_regular_file(entry_ec)) continue;
+    ReplayFile file;
+    if (!ParseReplayFileName(it->path().filename().string(), options.name, options.suffix,
+                             options.name_with_hostname, file)) {
+      continue;
+    }
+    file.filepath = it->path().string();
+    file.size = it->file_size(entry_ec);
+    auto mtime = it->last_write_time(entry_ec);
+    file.mtime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::file_clock::to_sys(mtime).time_since_epoch())
+                        .count();
+    if (file.start_ms < 0) file.start_ms = file.mtime_ms;
+    if (file.start_ms >= options.end_ms || file.mtime_ms < options.begin_ms) continue;
+    files.emplace_back(std::move(file));
+  }
+  std::sort(files.begin(), files.end(), [](const ReplayFile &a, const ReplayFile &b) {
+    return std::tie(a.start_ms, a.index, a.shard, a.filepath) < std::tie(b.start_ms, b.index, b.shard, b.filepath);
+  });
+  return files;
+}
+
+// lines of LocalBasicSink files, '\r' before '\n' is removed
+struct TextReplayParser {
+  using Row = std::string;
+  static constexpr bool kSplittable = true;
+
+  void Parse(std::string_view data, std::vector<Row> &rows) const {
+    while (!data.empty()) {
+      auto pos = data.find('\n');
+      auto line = data.substr(0, pos);
+      if (line.ends_with('\r')) line.remove_suffix(1);
+      rows.emplace_back(line);
+      if (pos == std::string_view::npos) break;
+      data.remove_prefix(pos + 1);
+    }
+  }
+};
+
+// rows of CsvSink files, parsed by csv::CSVReader (memory mapped)
+template <char Delim = ','>
+struct CsvReplayParser {
+  using Row = CsvRow;
+  static constexpr bool kSplittable = false;
+  bool has_header{true};  // skip the first row, CsvWriterOptions::headers is not empty
+
+  void Parse(const std::string &filepath, std::vector<Row> &rows) const {
+    csv::CSVFormat format;
+    format.delimiter(Delim).quote('"');
+    if (has_header) {
+      format.header_row(0);
+    } else {
+      format.no_header();
+    }
+    format.variable_columns(csv::VariableColumnPolicy::KEEP);
+    csv::CSVReader reader(filepath, format);
+    for (auto &row : reader) {
+      auto &out = rows.emplace_back();
+      out.reserve(row.size());
+      for (auto &field : row) out.emplace_back(field.template get<csv::string_view>());
+    }
+  }
+};
+
+template <typename Row>
+struct ReplayBatch {
+  const ReplayFile *file{nullptr};
+  size_t seq{0};  // roll order of the batch over all files
+  std::vector<Row> rows;
+};
+
+/**
+ * Matched files are cut into tasks in roll order, csv files as a whole and text files in chunks of chunk_bytes, and
+ * parsed by a pool of threads. Batches are either delivered in roll order, while at most max_pending_batches are
+ * parsed ahead, or as soon as they are parsed.
+ * usage:
+ *   auto options = ReplayOptionsOf(sink_options);
+ *   options.begin_ms = begin_ms;
+ *   TextReplayReader reader(options);
+ *   reader.Run([](TextReplayReader::Batch &&batch) { ... });
+ *   // or
+ *   reader.Start();
+ *   TextReplayReader::Batch batch;
+ *   while (reader.Next(batch)) { ... }
+ */
+template <typename Parser>
+class ReplayReader {
+ public:
+  using Row = typename Parser::Row;
+  using Batch = ReplayBatch<Row>;
+  using Callback = std::function<void(Batch &&)>;
+
+  explicit ReplayReader(ReplayOptions options, Parser parser = {})
+      : options_(std::move(options)), parser_(std::move(parser)), files_(ListReplayFiles(options_)) {
+    if (options_.threads == 0) options_.threads = std::max(1u, std::thread::hardware_concurrency());
+    if (options_.max_pending_batches == 0) options_.max_pending_batches = 2 * options_.threads;
+    options_.chunk_bytes = std::max<size_t>(options_.chunk_bytes, 4096);
+    for (size_t i = 0; i < files_.size(); ++i) {
+      auto chunks = Parser::kSplittable ? std::max<uintmax_t>(1, (files_[i].size + options_.chunk_bytes - 1) /
+                                                                     options_.chunk_bytes)
+                                        : 1;
+      for (uintmax_t c = 0; c < chunks; ++c) {
+        tasks_.push_back({i, c * options_.chunk_bytes, Parser::kSplittable ? options_.chunk_bytes : 0});
+      }
+    }
+  }
+
+  ~ReplayReader() { Stop(); }
+
+  ReplayReader(const ReplayReader &) = delete;
+  ReplayReader &operator=(const ReplayReader &) = delete;
+
+  inline const std::vector<ReplayFile> &Files() const { return files_; }
+
+  /**
+   * Read all files, @return number of rows. Ordered batches are passed to the callback on the calling thread,
+   * unordered ones on the reader threads concurrently.
+   */
+  size_t Run(const Callback &callback) {
+    if (options_.ordered) {
+      Start();
+      size_t rows = 0;
+      Batch batch;
+      while (Next(batch)) {
+        rows += batch.rows.size();
+        callback(std::move(batch));
+      }
+      return rows;
+    }
+    callback_ = &callback;
+    Start();
+    Stop();
+    callback_ = nullptr;
+    return rows_;
+  }
+
+  void Start() {
+    if (!threads_.empty()) return;
+    for (unsigned int i = 0; i < options_.threads; ++i) {
+      threads_.emplace_back(&ReplayReader::ReadThreadFunc, this);
+    }
+  }
+
+  // @return false after the last batch
+  bool Next(Batch &batch) {
+    std::unique_lock lock(mtx_);
+    if (options_.ordered) {
+      ready_cv_.wait(lock, [this] { return stopped_ || ready_.contains(next_seq_) || next_seq_ == tasks_.size(); });
+      auto it = ready_.find(next_seq_);
+      if (it == ready_.end()) return false;
+      batch = std::move(it->second);
+      ready_.erase(it);
+      ++next_seq_;
+    } else {
+      ready_cv_.wait(lock, [this] { return stopped_ || !unordered_.empty() || delivered_ == tasks_.size(); });
+      if (unordered_.empty()) return false;
+      batch = std::move(unordered_.front());
+      unordered_.pop_front();
+      ++delivered_;
+    }
+    lock.unlock();
+    space_cv_.notify_all();
+    return true;
+  }
+
+  // wait for the reader threads, pending batches are dropped if they are not consumed by Next
+  void Stop() {
+    {
+      std::lock_guard lock(mtx_);
+      if (!callback_) stopped_ = true;
+    }
+    space_cv_.notify_all();
+    ready_cv_.notify_all();
+    for (auto &th : threads_) {
+      if (th.joinable()) th.join();
+    }
+    threads_.clear();
+  }
+
+ private:
+  struct Task {
+    size_t file;
+    uintmax_t offset;
+    uintmax_t length;  // 0: whole file
+  };
+
+  void ReadThreadFunc() {
+    while (true) {
+      auto seq = next_task_.fetch_add(1, std::memory_order_relaxed);
+      if (seq >= tasks_.size()) break;
+      // ordered batches are parsed at most max_pending_batches ahead of the consumer
+      if (options_.ordered || !callback_) {
+        std::unique_lock lock(mtx_);
+        space_cv_.wait(lock, [this, seq] {
+          return stopped_ || (options_.ordered ? seq < next_seq_ + options_.max_pending_batches
+                                               : unordered_.size() < options_.max_pending_batches);
+        });
+        if (stopped_) break;
+      }
+      Batch batch{.file = &files_[tasks_[seq].file], .seq = seq};
+      ReadTask(tasks_[seq], batch.rows);
+      if (callback_) {
+        rows_ += batch.rows.size();
+        (*callback_)(std::move(batch));
+        continue;
+      }
+      {
+        std::lock_guard lock(mtx_);
+        if (options_.ordered) {
+          ready_.emplace(seq, std::move(batch));
+        } else {
+          unordered_.push_back(std::move(batch));
+        }
+      }
+      ready_cv_.notify_all();
+    }
+  }
+
+  void ReadTask(const Task &task, std::vector<Row> &rows) {
+    auto &file = files_[task.file];
+    if constexpr (Parser::kSplittable) {
+      if (file.size == 0) return;
+      std::error_code ec;
+      auto mmap = mio::make_mmap_source(file.filepath, ec);
+      if (ec) {
+        spdlog::error("[ReplayReader] map file failed. [filepath={}, error={}]", file.filepath, ec.message());
+        return;
+      }
+      std::string_view data(mmap.data(), mmap.size());
+      // a chunk owns the lines starting in it
+      auto begin = static_cast<size_t>(std::min<uintmax_t>(task.offset, data.size()));
+      if (begin > 0) {
+        auto pos = data.find('\n', begin - 1);
+        begin = pos == std::string_view::npos ? data.size() : pos + 1;
+      }
+      auto end = static_cast<size_t>(std::min<uintmax_t>(task.offset + task.length, data.size()));
+      if (end < data.size()) {
+        auto pos = data.find('\n', end - 1);
+        end = pos == std::string_view::npos ? data.size() : pos + 1;
+      }
+      if (begin < end) parser_.Parse(data.substr(begin, end - begin), rows);
+    } else {
+      try {
+        parser_.Parse(file.filepath, rows);
+      } catch (const std::exception &e) {
+        spdlog::error("[ReplayReader] parse file failed. [filepath={}, error={}]", file.filepath, e.what());
+      }
+    }
+  }
+
+ private:
+  ReplayOptions options_;
+  Parser parser_;
+  std::vector<ReplayFile> files_;
+  std::vector<Task> tasks_;
+  const Callback *callback_{nullptr};  // unordered Run
+  std::atomic<size_t> rows_{0};
+  std::atomic<size_t> next_task_{0};
+  std::vector<std::thread> threads_;
+
+  std::mutex mtx_;
+  std::condition_variable ready_cv_;
+  std::condition_variable space_cv_;
+  std::map<size_t, Batch> ready_;  // ordered, by seq
+  std::deque<Batch> unordered_;
+  size_t next_seq_{0};
+  size_t delivered_{0};
+  bool stopped_{false};
+};
+
+using TextReplayReader = ReplayReader<TextReplayParser>;
+using CsvReplayReader = ReplayReader<CsvReplayParser<','>>;
+}  // namespace cppcommon::os
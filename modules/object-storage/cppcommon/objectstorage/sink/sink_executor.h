@@ -0,0 +1,205 @@
+/**
+ * @file sink_executor.h
+ * @brief fixed worker threads shared by the writers of many sinks
+ * @author zhenkai.sun
+ * @date 2025-06-27 15:08:44
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace cppcommon::os {
+/**
+ * Workers run units, the writers of registered sink shards, and plain tasks from one FIFO ready queue. A unit is run
+ * by one worker at a time, so its files are written in order, and it is only queued while it has work: producers
+ * call Notify after enqueuing. A busy unit runs up to priority batches per turn and goes back to the end of the
+ * queue, so units share the workers in proportion to their priority.
+ * Every tick one worker notifies all units for their timed work, e.g. DurabilityMode::INTERVAL, the others only
+ * wake up for work.
+ */
+class SinkExecutor {
+ public:
+  static constexpr std::chrono::milliseconds kDefaultTick{100};
+
+  // run up to budget batches, @return true if work is left
+  using StepFunc = std::function<bool(int budget)>;
+
+  class Unit {
+   public:
+    Unit(StepFunc step, int priority) : step_(std::move(step)), priority_(std::max(1, priority)) {}
+
+   private:
+    friend class SinkExecutor;
+    enum State { IDLE, SCHEDULED, RUNNING, NOTIFIED, CLOSED };  // NOTIFIED: running, run again after it
+
+    StepFunc step_;
+    int priority_;
+    std::atomic<int> state_{IDLE};
+    std::atomic<bool> closing_{false};
+  };
+  using UnitPtr = std::shared_ptr<Unit>;
+
+  explicit SinkExecutor(unsigned int threads, std::chrono::milliseconds tick = kDefaultTick)
+      : tick_(std::max(tick, std::chrono::milliseconds(1))) {
+    for (unsigned int i = 0; i < std::max(1u, threads); ++i) {
+      workers_.emplace_back(&SinkExecutor::WorkerThreadFunc, this, i == 0);
+    }
+  }
+
+  // sinks should be closed before, pending tasks are finished before the workers exit
+  ~SinkExecutor() {
+    {
+      std::lock_guard lock(mtx_);
+      stopped_ = true;
+    }
+    ready_cv_.notify_all();
+    for (auto &worker : workers_) {
+      if (worker.joinable()) worker.join();
+    }
+  }
+
+  SinkExecutor(const SinkExecutor &) = delete;
+  SinkExecutor &operator=(const SinkExecutor &) = delete;
+
+  static const std::shared_ptr<SinkExecutor> &Default() {
+    static const auto executor = std::make_shared<SinkExecutor>(std::max(2u, std::thread::hardware_concurrency() / 4));
+    return executor;
+  }
+
+  UnitPtr Register(StepFunc step, int priority = 1) {
+    auto unit = std::make_shared<Unit>(std::move(step), priority);
+    std::lock_guard lock(mtx_);
+    units_.push_back(unit);
+    return unit;
+  }
+
+  // lock free unless the unit is idle, called by producers after every enqueue
+  void Notify(const UnitPtr &unit) {
+    auto state = unit->state_.load(std::memory_order_acquire);
+    while (true) {
+      switch (state) {
+        case Unit::IDLE:
+          if (unit->state_.compare_exchange_weak(state, Unit::SCHEDULED, std::memory_order_acq_rel)) {
+            Push({.unit = unit});
+            return;
+          }
+          break;
+        case Unit::RUNNING:
+          if (unit->state_.compare_exchange_weak(state, Unit::NOTIFIED, std::memory_order_acq_rel)) return;
+          break;
+        default:
+          return;
+      }
+    }
+  }
+
+  // run the unit until no work is left and remove it, producers should be stopped before
+  void Unregister(const UnitPtr &unit) {
+    if (!unit || unit->state_.load(std::memory_order_acquire) == Unit::CLOSED) return;
+    unit->closing_.store(true, std::memory_order_release);
+    Notify(unit);
+    std::unique_lock lock(mtx_);
+    closed_cv_.wait(lock, [&unit] { return unit->state_.load(std::memory_order_acquire) == Unit::CLOSED; });
+    units_.erase(std::remove(units_.begin(), units_.end(), unit), units_.end());
+  }
+
+  void Submit(std::function<void()> task) { Push({.task = std::move(task)}); }
+
+  inline size_t Threads() const { return workers_.size(); }
+
+ private:
+  struct Item {
+    UnitPtr unit;
+    std::function<void()> task;
+  };
+
+  inline void Push(Item &&item) {
+    {
+      std::lock_guard lock(mtx_);
+      ready_.push_back(std::move(item));
+    }
+    ready_cv_.notify_one();
+  }
+
+  void WorkerThreadFunc(bool ticker) {
+    auto next_tick = std::chrono::steady_clock::now() + tick_;
+    std::vector<UnitPtr> ticked;
+    while (true) {
+      Item item;
+      {
+        std::unique_lock lock(mtx_);
+        auto ready = [this] { return stopped_ || !ready_.empty(); };
+        if (ticker) {
+          ready_cv_.wait_until(lock, next_tick, ready);
+          if (std::chrono::steady_clock::now() >= next_tick) {
+            next_tick = std::chrono::steady_clock::now() + tick_;
+            ticked = units_;
+          }
+        } else {
+          ready_cv_.wait(lock, ready);
+        }
+        if (!ready_.empty()) {
+          item = std::move(ready_.front());
+          ready_.pop_front();
+        } else if (stopped_) {
+          break;
+        }
+      }
+      for (auto &unit : ticked) Notify(unit);
+      ticked.clear();
+      if (item.task) {
+        item.task();
+      } else if (item.unit) {
+        Run(item.unit);
+      }
+    }
+  }
+
+  void Run(const UnitPtr &unit) {
+    unit->state_.store(Unit::RUNNING, std::memory_order_release);
+    if (unit->step_(unit->priority_)) {
+      unit->state_.store(Unit::SCHEDULED, std::memory_order_release);
+      Push({.unit = unit});
+      return;
+    }
+    int state = Unit::RUNNING;
+    // reading closing_ before the transition, Unregister notifies after setting it, so one more run sees it
+    auto done = unit->closing_.load(std::memory_order_acquire) ? Unit::CLOSED : Unit::IDLE;
+    if (!unit->state_.compare_exchange_strong(state, done, std::memory_order_acq_rel)) {
+      // notified while running
+      unit->state_.store(Unit::SCHEDULED, std::memory_order_release);
+      Push({.unit = unit});
+      return;
+    }
+    if (done == Unit::CLOSED) {
+      std::lock_guard lock(mtx_);
+      closed_cv_.notify_all();
+    }
+  }
+
+ private:
+  std::chrono::milliseconds tick_;
+  std::mutex mtx_;
+  std::condition_variable ready_cv_;
+  std::condition_variable closed_cv_;
+  std::deque<Item> ready_;
+  std::vector<UnitPtr> units_;
+  bool stopped_{false};
+  std::vector<std::thread> workers_;
+};
+
+struct SinkExecutorOptions {
+  std::shared_ptr<SinkExecutor> pool;  // nullptr: a writer thread per shard
+  int priority{1};  // batches written per turn while other units wait
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,178 @@
+/**
+ * @file sink_metrics.h
+ * @brief counters and latency histograms of sinks
+ * @author zhenkai.sun
+ * @date 2025-06-23 10:12:37
+ */
+#pragma once
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/post_roll.h"
+
+namespace cppcommon::os {
+// one of every kLatencyProbeInterval enqueued records is timestamped to sample the enqueue to write latency
+static constexpr uint64_t kLatencyProbeInterval = 64;
+
+inline int64_t SteadyNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct LatencySummary {
+  uint64_t count{0};
+  double mean_us{0};
+  double p50_us{0};
+  double p90_us{0};
+  double p99_us{0};
+  double max_us{0};
+};
+
+/**
+ * Power of two buckets of nanoseconds, percentiles are the upper bound of their bucket (at most 2x off).
+ * Record is lock free, recorded by writer and post roll threads, never by producers.
+ */
+class LatencyHistogram {
+ public:
+  static constexpr size_t kBuckets = 48;
+
+  void Record(int64_t ns) {
+    auto v = static_cast<uint64_t>(std::max<int64_t>(ns, 0));
+    auto bucket = std::min<size_t>(std::bit_width(v), kBuckets - 1);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+    auto max = max_.load(std::memory_order_relaxed);
+    while (v > max && !max_.compare_exchange_weak(max, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  LatencySummary Summary() const {
+    std::array<uint64_t, kBuckets> buckets;
+    uint64_t count = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+      count += buckets[i];
+    }
+    LatencySummary summary;
+    if (count == 0) return summary;
+    auto max_ns = static_cast<double>(max_.load(std::memory_order_relaxed));
+    auto percentile = [&](double p) {
+      auto rank = static_cast<uint64_t>(p * static_cast<double>(count - 1)) + 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) return std::min(static_cast<double>(i ? (1ULL << i) - 1 : 0), max_ns) / 1000.0;
+      }
+      return max_ns / 1000.0;
+    };
+    summary.count = count;
+    summary.mean_us = static_cast<double>(sum_.load(std::memory_order_relaxed)) / static_cast<double>(count) / 1000.0;
+    summary.p50_us = percentile(0.5);
+    summary.p90_us = percentile(0.9);
+    summary.p99_us = percentile(0.99);
+    summary.max_us = max_ns / 1000.0;
+    return summary;
+  }
+
+ private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// records dropped by overflow policies
+struct SinkDropStats {
+  uint64_t dropped_newest{0};
+  uint64_t dropped_oldest{0};
+  uint64_t dropped_sampled{0};
+  uint64_t dropped_timeout{0};
+  uint64_t dropped_spill{0};  // spill file is full or unavailable, or spilled records can not be read back
+  uint64_t dropped_encode{0};  // rows of blocks which failed to compress, counted when their file is closed
+
+  inline uint64_t Total() const {
+    return dropped_newest + dropped_oldest + dropped_sampled + dropped_timeout + dropped_spill + dropped_encode;
+  }
+};
+
+struct SinkMetrics {
+  std::string name;
+  double uptime_s{0};
+  uint64_t enqueued{0};  // records put into the queues
+  double enqueue_rate{0};  // records per second since the previous snapshot
+  uint64_t queue_depth{0};
+  uint64_t queue_depth_hwm{0};  // highest depth seen by the writer threads
+  uint64_t rows_written{0};
+  uint64_t bytes_written{0};  // bytes of the files, compressed or encoded ones estimated until they are closed
+  uint64_t files_rolled{0};  // closed files, including the current ones closed by Close
+  LatencySummary enqueue_to_write;  // sampled, see kLatencyProbeInterval
+  LatencySummary write_batch;  // SinkFileSystem::WriteBatch
+  LatencySummary roll;  // writer thread blocked by rolling
+  LatencySummary close;  // closing rolled files
+  LatencySummary roll_callback;
+  SinkDropStats drops;
+  std::vector<PostRollStepStats> post_roll;
+
+  std::string ToJson() const;
+};
+
+inline std::string JsonEscape(std::string_view s) {
+  std::string out;
+  out.reserve(s.size());
+  for (auto c : s) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += fmt::format("\\u{:04x}", static_cast<int>(c));
+        } else {
+          out += c;
+        }
+    }
+  }
+  return out;
+}
+
+inline std::string ToJson(const LatencySummary &s) {
+  return fmt::format(
+      R"({{"count":{},"mean_us":{:.3f},"p50_us":{:.3f},"p90_us":{:.3f},"p99_us":{:.3f},"max_us":{:.3f}}})", s.count,
+      s.mean_us, s.p50_us, s.p90_us, s.p99_us, s.max_us);
+}
+
+inline std::string SinkMetrics::ToJson() const {
+  using cppcommon::os::ToJson;
+  std::string post_roll_json;
+  for (auto &step : post_roll) {
+    if (!post_roll_json.empty()) post_roll_json += ',';
+    post_roll_json += fmt::format(R"({{"name":"{}","ok":{},"failed":{},"retries":{},"total_us":{},"max_us":{}}})",
+                                  JsonEscape(step.name), step.ok, step.failed, step.retries, step.total_us,
+                                  step.max_us);
+  }
+  return fmt::format(
+      R"({{"name":"{}","uptime_s":{:.3f},"enqueued":{},"enqueue_rate":{:.1f},"queue_depth":{},"queue_depth_hwm":{},)"
+      R"("rows_written":{},"bytes_written":{},"files_rolled":{},"enqueue_to_write":{},"write_batch":{},"roll":{},)"
+      R"("close":{},"roll_callback":{},"drops":{{"newest":{},"oldest":{},"sampled":{},"timeout":{},"spill":{},)"
+      R"("encode":{}}},)"
+      R"("post_roll":[{}]}})",
+      JsonEscape(name), uptime_s, enqueued, enqueue_rate, queue_depth, queue_depth_hwm, rows_written, bytes_written,
+      files_rolled, ToJson(enqueue_to_write), ToJson(write_batch), ToJson(roll), ToJson(close), ToJson(roll_callback),
+      drops.dropped_newest, drops.dropped_oldest, drops.dropped_sampled, drops.dropped_timeout, drops.dropped_spill,
+      drops.dropped_encode, post_roll_json);
+}
+}  // namespace cppcommon::os
@@ -0,0 +1,229 @@
+/**
+ * @file spill_file.h
+ * @brief append-only spill file, buffers records on disk when the sink writer falls behind
+ * @author zhenkai.sun
+ * @date 2025-06-16 15:32:08
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "cppcommon/objectstorage/sink/output_file.h"
+
+namespace cppcommon::os {
+/**
+ * Encoding of records in spill files, specialize it to support spilling a record type.
+ *   static void Encode(const Record &record, std::string &out);  // append the payload to out
+ *   static bool Decode(std::string_view payload, Record &record);
+ */
+template <typename Record>
+struct SpillCodec {
+  static constexpr bool kSupported = false;
+};
+
+template <>
+struct SpillCodec<std::string> {
+  static constexpr bool kSupported = true;
+  static inline void Encode(const std::string &record, std::string &out) { out.append(record); }
+  static inline bool Decode(std::string_view payload, std::string &record) {
+    record.assign(payload);
+    return true;
+  }
+};
+
+inline void PutFixed32(std::string &out, uint32_t value) { out.append(reinterpret_cast<const char *>(&value), 4); }
+
+inline uint32_t GetFixed32(const char *p) {
+  uint32_t value;
+  std::memcpy(&value, p, 4);
+  return value;
+}
+
+// [count][len][bytes][len][bytes]...
+template <typename Row>
+inline void EncodeSpillFields(const Row &row, std::string &out) {
+  PutFixed32(out, static_cast<uint32_t>(row.size()));
+  for (size_t i = 0; i < row.size(); ++i) {
+    std::string_view field = row[i];
+    PutFixed32(out, static_cast<uint32_t>(field.size()));
+    out.append(field);
+  }
+}
+
+template <typename AppendFunc>
+inline bool DecodeSpillFields(std::string_view payload, AppendFunc &&append) {
+  if (payload.size() < 4) return false;
+  auto count = GetFixed32(payload.data());
+  payload.remove_prefix(4);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (payload.size() < 4) return false;
+    auto len = GetFixed32(payload.data());
+    if (payload.size() < 4 + static_cast<size_t>(len)) return false;
+    append(payload.substr(4, len));
+    payload.remove_prefix(4 + len);
+  }
+  return true;
+}
+
+/**
+ * Frames are [payload length: 4 bytes][payload], appended by producers and read back by the sink writer in FIFO
+ * order. The file is truncated once all records are read, until then it stays active so that new records are
+ * spilled after the older ones.
+ */
+template <typename Record>
+class SpillFile {
+ public:
+  static constexpr size_t kReadBlockSize = 1024 * 1024;
+
+  SpillFile(std::string filepath, int64_t max_bytes) : filepath_(std::move(filepath)), max_bytes_(max_bytes) {
+    fd_ = ::open(filepath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      spdlog::error("[SpillFile] open spill file failed. [filepath={}, errno={}]", filepath_, errno);
+    }
+  }
+
+  ~SpillFile() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      std::error_code ec;
+      std::filesystem::remove(filepath_, ec);
+    }
+  }
+
+  inline bool Active() const { return active_.load(std::memory_order_acquire); }
+  inline size_t Size() const { return records_.load(std::memory_order_relaxed); }
+
+  // thread safe, @return false if the file is full or unavailable
+  bool Append(const Record &record) {
+    static thread_local std::string frame;
+    frame.assign(4, '\0');
+    SpillCodec<Record>::Encode(record, frame);
+    auto len = static_cast<uint32_t>(frame.size() - 4);
+    std::memcpy(frame.data(), &len, 4);
+
+    std::lock_guard lock(mtx_);
+    if (fd_ < 0 || write_offset_ + static_cast<int64_t>(frame.size()) > max_bytes_) return false;
+    if (!PwriteFully(fd_, frame.data(), frame.size(), write_offset_)) {
+      spdlog::error("[SpillFile] write spill file failed. [filepath={}, errno={}]", filepath_, errno);
+      return false;
+    }
+    write_offset_ += static_cast<int64_t>(frame.size());
+    records_.fetch_add(1, std::memory_order_relaxed);
+    active_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * reader (sink writer thread) only, records which can not be read back are counted into lost
+   * @return number of records read into out
+   */
+  size_t Read(Record *out, size_t max, size_t &lost) {
+    int64_t end;
+    {
+      std::lock_guard lock(mtx_);
+      end = write_offset_;
+    }
+    size_t count = 0;
+    while (count < max) {
+      auto available = buffer_.size() - buffer_pos_;
+      uint32_t len = available >= 4 ? GetFixed32(buffer_.data() + buffer_pos_) : 0;
+      if (available < 4 || available < 4 + static_cast<size_t>(len)) {
+        if (Fill(end, available < 4 ? 4 : 4 + len)) continue;
+        // frames are appended whole, so anything short of end is a failed read or a truncated file
+        if (buffer_.size() > buffer_pos_ || file_pos_ < end) Discard(lost);
+        break;
+      }
+      std::string_view payload(buffer_.data() + buffer_pos_ + 4, len);
+      buffer_pos_ += 4 + len;
+      records_.fetch_sub(1, std::memory_order_relaxed);
+      if (SpillCodec<Record>::Decode(payload, out[count])) {
+        ++count;
+      } else {
+        ++lost;
+        spdlog::error("[SpillFile] decode spilled record failed. [filepath={}]", filepath_);
+      }
+    }
+    if (buffer_pos_ == buffer_.size() && file_pos_ == end) {
+      TryReset();
+    }
+    return count;
+  }
+
+ private:
+  // read more bytes from file_pos_, keeping unread bytes, @return false if there is not enough data
+  bool Fill(int64_t end, size_t need) {
+    buffer_.erase(0, buffer_pos_);
+    buffer_pos_ = 0;
+    auto left = end - file_pos_;
+    if (static_cast<int64_t>(need - buffer_.size()) > left) return false;
+    auto size = std::min<int64_t>(left, std::max(kReadBlockSize, need - buffer_.size()));
+    auto offset = buffer_.size();
+    buffer_.resize(offset + size);
+    auto n = ::pread(fd_, buffer_.data() + offset, size, file_pos_);
+    if (n <= 0) {
+      buffer_.resize(offset);
+      return false;
+    }
+    buffer_.resize(offset + n);
+    file_pos_ += n;
+    return true;
+  }
+
+  // all records are read, truncate the file unless new records were appended meanwhile
+  void TryReset() {
+    std::lock_guard lock(mtx_);
+    if (write_offset_ != file_pos_) return;
+    ResetLocked();
+  }
+
+  // frame boundaries after a failed read are unknown, all spilled records are dropped instead of retried forever
+  void Discard(size_t &lost) {
+    auto err = errno;
+    std::lock_guard lock(mtx_);
+    auto records = records_.exchange(0, std::memory_order_relaxed);
+    lost += records;
+    spdlog::error("[SpillFile] read spill file failed, spilled records are dropped. [filepath={}, records={}, errno={}]",
+                  filepath_, records, err);
+    ResetLocked();
+  }
+
+  void ResetLocked() {
+    if (::ftruncate(fd_, 0) != 0) {
+      spdlog::error("[SpillFile] truncate spill file failed. [filepath={}, errno={}]", filepath_, errno);
+    }
+    write_offset_ = 0;
+    file_pos_ = 0;
+    buffer_.clear();
+    buffer_pos_ = 0;
+    active_.store(false, std::memory_order_release);
+  }
+
+ private:
+  std::string filepath_;
+  int64_t max_bytes_;
+  int fd_{-1};
+
+  std::mutex mtx_;
+  int64_t write_offset_{0};
+  std::atomic<bool> active_{false};
+  std::atomic<size_t> records_{0};
+
+  // reader state
+  int64_t file_pos_{0};  // file offset of buffer_ end
+  std::string buffer_;
+  size_t buffer_pos_{0};
+};
+}  // namespace cppcommon::os
@@ -0,0 +1,268 @@
+/**
+ * @file tee_sink.h
+ * @brief sink delivering one record stream to several branches, each with its own writer, queue and roll policy
+ * @author zhenkai.sun
+ * @date 2025-06-28 10:36:52
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/base_sink.h"
+
+namespace cppcommon::os {
+// encodes a record into out (empty), branches of the same encoding share the bytes of every record
+template <typename Record>
+using TeeEncodeFunc = std::function<void(const Record &, std::string &out)>;
+
+template <typename Record>
+class TeeSink;
+
+/**
+ * A record shared by all branches of a TeeSink, copied into the branch writer only when it is written, and moved by
+ * the last branch holding it. Bytes of an encoding are encoded by the first branch asking for them.
+ * Branches which drop the record release it, so the last writing branch still moves it.
+ */
+template <typename Record>
+class TeeRecord {
+ public:
+  TeeRecord() = default;
+  TeeRecord(TeeRecord &&other) noexcept : entry_(std::move(other.entry_)), encoding_(other.encoding_) {}
+  TeeRecord &operator=(TeeRecord &&other) noexcept {
+    if (this != &other) {
+      Release();
+      entry_ = std::move(other.entry_);
+      encoding_ = other.encoding_;
+    }
+    return *this;
+  }
+  ~TeeRecord() { Release(); }
+
+  inline const Record &Get() const { return entry_->record; }
+
+  // encoding of the branch, -1: the branch writes records
+  inline int Encoding() const { return encoding_; }
+
+  Record Take() { return TakeOwned(entry_->record); }
+
+  std::string TakeBytes() {
+    auto &entry = *entry_;
+    auto &slot = entry.slots[encoding_];
+    std::call_once(slot.once, [&entry, &slot, this] { (*entry.encodings)[encoding_](entry.record, slot.bytes); });
+    return TakeOwned(slot.bytes);
+  }
+
+ private:
+  friend class TeeSink<Record>;
+
+  struct Slot {
+    std::once_flag once;
+    std::string bytes;
+  };
+
+  struct Entry {
+    std::atomic<int> owners{0};  // handles not taken or released yet
+    Record record;
+    const std::vector<TeeEncodeFunc<Record>> *encodings{nullptr};
+    std::unique_ptr<Slot[]> slots;
+  };
+
+  TeeRecord(std::shared_ptr<Entry> entry, int encoding) : entry_(std::move(entry)), encoding_(encoding) {}
+
+  // moved by the last owner, others copy before releasing, so the value is never moved while being copied
+  template <typename T>
+  inline T TakeOwned(T &value) {
+    auto entry = std::move(entry_);
+    if (entry->owners.load(std::memory_order_acquire) == 1) {
+      entry->owners.store(0, std::memory_order_relaxed);
+      return std::move(value);
+    }
+    T copy = value;
+    entry->owners.fetch_sub(1, std::memory_order_release);
+    return copy;
+  }
+
+  inline void Release() {
+    if (!entry_) return;
+    entry_->owners.fetch_sub(1, std::memory_order_release);
+    entry_.reset();
+  }
+
+  std::shared_ptr<Entry> entry_;
+  int encoding_{-1};
+};
+
+template <typename Record>
+struct RecordByteSize<TeeRecord<Record>> {
+  inline size_t operator()(const TeeRecord<Record> &record) const { return RecordByteSize<Record>{}(record.Get()); }
+};
+
+/**
+ * Writes TeeRecords into FS, a SinkFileSystem of Record, or of std::string for branches with an encoding.
+ * Records of a batch are taken into a reused vector and written by FS::WriteBatch at once.
+ */
+template <typename Record, typename FS>
+class TeeFileSystem : public SinkFileSystem<TeeRecord<Record>> {
+ public:
+  using Target = typename FS::RecordType;
+  static constexpr bool kSyncSupported = FS::kSyncSupported;
+  static_assert(std::is_same_v<Target, Record> || std::is_same_v<Target, std::string>,
+                "FS should write the records, or the bytes of an encoding");
+
+  template <typename... Args>
+  explicit TeeFileSystem(Args &&...args) : fs_(std::forward<Args>(args)...) {}
+
+  void Open(const std::string &filepath) override { fs_.Open(filepath); }
+
+  inline int Write(TeeRecord<Record> &&record) override { return fs_.Write(Convert(record)); }
+
+  inline int WriteBatch(std::span<TeeRecord<Record>> records) override {
+    targets_.clear();
+    for (auto &record : records) targets_.emplace_back(Convert(record));
+    return fs_.WriteBatch(targets_);
+  }
+
+  bool IsOpen() override { return fs_.IsOpen(); }
+  uint64_t BytesWritten() const override { return fs_.BytesWritten(); }
+  uint64_t DroppedRows() const override { return fs_.DroppedRows(); }
+  void Close() override { fs_.Close(); }
+  void Flush() override { fs_.Flush(); }
+  bool Sync() override { return fs_.Sync(); }
+
+ private:
+  static inline Target Convert(TeeRecord<Record> &record) {
+    if constexpr (std::is_same_v<Target, Record>) {
+      if constexpr (std::is_same_v<Record, std::string>) {
+        if (record.Encoding() >= 0) return record.TakeBytes();
+      }
+      return record.Take();
+    } else {
+      return record.TakeBytes();
+    }
+  }
+
+  FS fs_;
+  std::vector<Target> targets_;
+};
+
+// a branch of TeeSink, written like BaseSink<Record, FS, OfsOptions>
+template <typename Record, typename FS = SinkFileSystem<Record>, typename OfsOptions = void>
+using TeeBranchSink = BaseSink<TeeRecord<Record>, TeeFileSystem<Record, FS>, OfsOptions>;
+
+/**
+ * Every record is allocated once and shared by the branches, instead of a copy per sink. Each branch is a BaseSink
+ * with its own queue, roll, shard and overflow options, so a branch falling behind only applies its own policy:
+ * DROP_NEWEST, DROP_OLDEST or SAMPLE keep the producers and other branches going, BLOCK waits up to block_timeout.
+ * SPILL is not supported. Branches and encodings are added before the first Write.
+ * usage:
+ *   TeeSink<CsvRow> tee;
+ *   auto line = tee.AddEncoding([](const CsvRow &r, std::string &out) { AppendCsvRow<','>(out, r); out.pop_back(); });
+ *   tee.AddBranch<CsvWriter<','>, CsvWriterOptions>({.name = "debug", .path = "/data/debug"});
+ *   tee.AddBranch<LocalTextSinkFileSystem, TextWriterOptions>({.name = "a", .path = "/data/a"}, line);
+ *   tee.AddBranch<LocalTextSinkFileSystem, TextWriterOptions>({.name = "b", .path = "/data/b"}, line);
+ *   tee.Write(CsvRow{"1", "x"});  // formatted once for a and b
+ */
+template <typename Record>
+class TeeSink {
+ public:
+  TeeSink() = default;
+  virtual ~TeeSink() { Close(); }
+
+  TeeSink(const TeeSink &) = delete;
+  TeeSink &operator=(const TeeSink &) = delete;
+
+  // @return id of the encoding, for AddBranch
+  int AddEncoding(TeeEncodeFunc<Record> encode) {
+    if (!encode) throw std::invalid_argument("encode is required");
+    encodings_.push_back(std::move(encode));
+    return static_cast<int>(encodings_.size()) - 1;
+  }
+
+  // encoding: id of AddEncoding if FS writes the encoded bytes, -1 if it writes records
+  template <typename FS, typename OfsOptions = void>
+  TeeBranchSink<Record, FS, OfsOptions> &AddBranch(typename TeeBranchSink<Record, FS, OfsOptions>::Options &&options,
+                                                   int encoding = -1) {
+    if (encoding >= static_cast<int>(encodings_.size())) {
+      throw std::invalid_argument("unknown encoding");
+    }
+    if (encoding < 0 && !std::is_same_v<typename FS::RecordType, Record>) {
+      throw std::invalid_argument("encoding is required by the branch");
+    }
+    auto branch = std::make_unique<BranchImpl<TeeBranchSink<Record, FS, OfsOptions>>>(std::move(options));
+    branch->encoding = encoding;
+    auto &sink = branch->sink;
+    branches_.emplace_back(std::move(branch));
+    return sink;
+  }
+
+  /**
+   * Enqueue the record into every branch.
+   * @return OK if all branches took it, otherwise the status of the first branch which did not
+   */
+  template <typename T>
+  WriteStatus Write(T &&record) {
+    if (stopped_) return WriteStatus::STOPPED;
+    auto entry = std::make_shared<typename TeeRecord<Record>::Entry>();
+    entry->owners.store(static_cast<int>(branches_.size()), std::memory_order_relaxed);
+    entry->record = Record(std::forward<T>(record));
+    if (!encodings_.empty()) {
+      entry->encodings = &encodings_;
+      entry->slots = std::make_unique<typename TeeRecord<Record>::Slot[]>(encodings_.size());
+    }
+    auto status = WriteStatus::OK;
+    for (size_t i = 0; i < branches_.size(); ++i) {
+      auto &branch = *branches_[i];
+      // the last branch takes over the reference, a writer done before may move the record
+      auto shared = i + 1 == branches_.size() ? std::move(entry) : entry;
+      auto ret = branch.Write(TeeRecord<Record>(std::move(shared), branch.encoding));
+      if (ret != WriteStatus::OK && status == WriteStatus::OK) status = ret;
+    }
+    return status;
+  }
+
+  inline size_t Branches() const { return branches_.size(); }
+
+  // records queued by all branches
+  inline size_t Size() const {
+    size_t size = 0;
+    for (auto &branch : branches_) size += branch->Size();
+    return size;
+  }
+
+  void Close() {
+    stopped_ = true;
+    for (auto &branch : branches_) branch->Close();
+  }
+
+ protected:
+  struct Branch {
+    virtual ~Branch() = default;
+    virtual WriteStatus Write(TeeRecord<Record> &&record) = 0;
+    virtual size_t Size() const = 0;
+    virtual void Close() = 0;
+    int encoding{-1};
+  };
+
+  template <typename Sink>
+  struct BranchImpl : Branch {
+    explicit BranchImpl(typename Sink::Options &&options) : sink(std::move(options)) {}
+    WriteStatus Write(TeeRecord<Record> &&record) override { return sink.Write(std::move(record)); }
+    size_t Size() const override { return sink.Size(); }
+    void Close() override { sink.Close(); }
+    Sink sink;
+  };
+
+  std::vector<TeeEncodeFunc<Record>> encodings_;
+  std::vector<std::unique_ptr<Branch>> branches_;
+  std::atomic<bool> stopped_{false};
+};
+}  // namespace cppcommon::os
@@ -6,6 +6,7 @@
  */
 #pragma once
 #include <filesystem>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -27,6 +28,7 @@ struct StorageProviderOptions {
   std::string access_key_secret;
   std::string region;
   std::string endpoint;
+  bool path_style{false};  // S3: path style urls, required by most S3 compatible servers, e.g. MinIO
 };
 
 struct TransferMeta {
@@ -45,12 +47,34 @@ namespace fs = std::filesystem;
 using FileList = std::vector<std::string>;
 using FilePathList = std::vector<std::filesystem::path>;
 
+// parts are at least 5MB except the last one, S3 and OSS reject smaller ones
+static constexpr size_t kMinUploadPartSize = 5 * 1024 * 1024;
+
+/**
+ * Streaming upload of one object, multipart upload (S3, OSS) or resumable upload (GCS).
+ * Parts are numbered from 1, the object is visible after Complete.
+ */
+class ObjectWriter {
+ public:
+  virtual ~ObjectWriter() = default;
+  // thread safe if ParallelParts, otherwise parts are uploaded in order by one thread
+  virtual absl::Status UploadPart(int part_number, const std::string &data) = 0;
+  virtual absl::Status Complete() = 0;
+  virtual absl::Status Abort() = 0;
+  virtual bool ParallelParts() const { return true; }
+};
+
 class StorageProvider {
  public:
+  virtual ~StorageProvider() = default;
   virtual absl::StatusOr<FileList> List(const std::string &bucket, const std::string &path) = 0;
   virtual absl::Status Upload(const TransferMeta &meta) = 0;
   virtual absl::Status DownloadFile(const TransferMeta &meta) = 0;
   virtual absl::StatusOr<FilePathList> Download(const TransferMeta &meta) = 0;
+  virtual absl::StatusOr<std::unique_ptr<ObjectWriter>> NewObjectWriter(const std::string &bucket,
+                                                                        const std::string &key) {
+    return absl::UnimplementedError("streaming upload is not supported");
+  }
 
  protected:
   absl::Status EnsureLocalPath(const fs::path &p, bool overwrite = false);
@@ -100,4 +100,55 @@ absl::StatusOr<FilePathList> GcsStorageProvider::Download(const TransferMeta &m)
   }
   return result;
 }
+
+// resumable upload session, parts are streamed in order
+class GcsObjectWriter : public ObjectWriter {
+ public:
+  GcsObjectWriter(std::shared_ptr<gcs::Client> client, const std::string &bucket, std::string key)
+      : client_(std::move(client)), key_(std::move(key)), writer_(client_->WriteObject(bucket, key_)) {}
+
+  bool ParallelParts() const override { return false; }
+
+  absl::Status UploadPart(int part_number, const std::string &data) override {
+    writer_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!writer_) {
+      return absl::InternalError(FMT("upload gcs part failed. [key={}, part={}, error={}]", key_, part_number,
+                                     writer_.last_status().message()));
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Complete() override {
+    writer_.Close();
+    auto metadata = writer_.metadata();
+    if (!metadata) {
+      return absl::InternalError(
+          FMT("complete gcs resumable upload failed. [key={}, error={}]", key_, metadata.status().message()));
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Abort() override {
+    auto session_id = writer_.resumable_session_id();
+    std::move(writer_).Suspend();
+    auto status = client_->DeleteResumableUpload(session_id);
+    if (!status.ok()) {
+      return absl::InternalError(
+          FMT("abort gcs resumable upload failed. [key={}, error={}]", key_, status.message()));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  std::shared_ptr<gcs::Client> client_;
+  std::string key_;
+  gcs::ObjectWriteStream writer_;
+};
+
+absl::StatusOr<std::unique_ptr<ObjectWriter>> GcsStorageProvider::NewObjectWriter(const std::string &bucket,
+                                                                                  const std::string &key) {
+  ExpectOrInternal(client_, "client not inited");
+  auto rfp = TryRemoveCloudStoragePrefix(ServiceProvider::GCS, bucket, key);
+  return std::make_unique<GcsObjectWriter>(client_, bucket, rfp);
+}
 }  // namespace cppcommon::os
@@ -6,8 +6,12 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/status/status.h"
@@ -139,4 +143,75 @@ absl::StatusOr<FilePathList> OssStorageProvider::Download(const TransferMeta &me
   }
   return result;
 }
+
+class OssObjectWriter : public ObjectWriter {
+ public:
+  OssObjectWriter(std::shared_ptr<oss::OssClient> client, std::string bucket, std::string key, std::string upload_id)
+      : client_(std::move(client)),
+        bucket_(std::move(bucket)),
+        key_(std::move(key)),
+        upload_id_(std::move(upload_id)) {}
+
+  absl::Status UploadPart(int part_number, const std::string &data) override {
+    auto content = std::make_shared<std::stringstream>(data);
+    oss::UploadPartRequest request(bucket_, key_, part_number, upload_id_, content);
+    request.setContentLength(data.size());
+    auto outcome = client_->UploadPart(request);
+    if (!outcome.isSuccess()) {
+      return absl::InternalError(FMT("upload oss part failed. [key={}, part={}, code={}, message={}]", key_,
+                                     part_number, outcome.error().Code(), outcome.error().Message()));
+    }
+    std::lock_guard lock(mtx_);
+    etags_[part_number] = outcome.result().ETag();
+    return absl::OkStatus();
+  }
+
+  absl::Status Complete() override {
+    oss::PartList parts;
+    {
+      std::lock_guard lock(mtx_);
+      for (auto &[part_number, etag] : etags_) {
+        parts.emplace_back(part_number, etag);
+      }
+    }
+    oss::CompleteMultipartUploadRequest request(bucket_, key_);
+    request.setUploadId(upload_id_);
+    request.setPartList(parts);
+    auto outcome = client_->CompleteMultipartUpload(request);
+    if (!outcome.isSuccess()) {
+      return absl::InternalError(FMT("complete oss multipart upload failed. [key={}, code={}, message={}]", key_,
+                                     outcome.error().Code(), outcome.error().Message()));
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Abort() override {
+    oss::AbortMultipartUploadRequest request(bucket_, key_, upload_id_);
+    auto outcome = client_->AbortMultipartUpload(request);
+    if (!outcome.isSuccess()) {
+      return absl::InternalError(FMT("abort oss multipart upload failed. [key={}, code={}, message={}]", key_,
+                                     outcome.error().Code(), outcome.error().Message()));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  std::shared_ptr<oss::OssClient> client_;
+  std::string bucket_;
+  std::string key_;
+  std::string upload_id_;
+  std::mutex mtx_;
+  std::map<int, std::string> etags_;
+};
+
+absl::StatusOr<std::unique_ptr<ObjectWriter>> OssStorageProvider::NewObjectWriter(const std::string &bucket,
+                                                                                  const std::string &key) {
+  ExpectOrInternal(client_, "client not inited");
+  auto rfp = TryRemoveCloudStoragePrefix(ServiceProvider::OSS, bucket, key);
+  oss::InitiateMultipartUploadRequest request(bucket, rfp);
+  auto outcome = client_->InitiateMultipartUpload(request);
+  ExpectOrInternal(outcome.isSuccess(), FMT("initiate oss multipart upload failed. [key={}, message={}]", rfp,
+                                            outcome.error().Message()));
+  return std::make_unique<OssObjectWriter>(client_, bucket, rfp, outcome.result().UploadId());
+}
 }  // namespace cppcommon::os
@@ -23,6 +23,8 @@ class OssStorageProvider : public StorageProvider {
   absl::Status Upload(const TransferMeta &m) override;
   absl::Status DownloadFile(const TransferMeta &meta) override;
   absl::StatusOr<FilePathList> Download(const TransferMeta &meta) override;
+  absl::StatusOr<std::unique_ptr<ObjectWriter>> NewObjectWriter(const std::string &bucket,
+                                                                const std::string &key) override;
 
  private:
   std::shared_ptr<oss::OssClient> client_;
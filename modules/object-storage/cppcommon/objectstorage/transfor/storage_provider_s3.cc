@@ -5,17 +5,26 @@
 #include <aws/core/Aws.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
 #include <aws/s3/S3Client.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/ListBucketsRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
 #include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
 #include <spdlog/spdlog.h>
 
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/status/status.h"
@@ -32,11 +41,13 @@ StorageProviderOptions GetS3OptionsFromEnv() {
   options.access_key_secret = cppcommon::GetEnv("AWS_SECRET_ACCESS_KEY", "");
   options.region = cppcommon::GetEnv("AWS_REGION", "");
   options.endpoint = cppcommon::GetEnv("AWS_ENDPOINT", "");
+  options.path_style = cppcommon::GetEnv("AWS_S3_PATH_STYLE", "") == "true";
   return options;
 }
 
 S3StorageProvider::S3StorageProvider(StorageProviderOptions &&options) {
-  Aws::Client::ClientConfiguration config;
+  Aws::S3::S3ClientConfiguration config;
+  config.useVirtualAddressing = !options.path_style;
   if (!options.endpoint.empty()) {
     config.endpointOverride = options.endpoint;
   }
@@ -151,4 +162,80 @@ absl::StatusOr<FilePathList> S3StorageProvider::Download(const TransferMeta &met
   }
   return result;
 }
+
+class S3ObjectWriter : public ObjectWriter {
+ public:
+  S3ObjectWriter(std::shared_ptr<Aws::S3::S3Client> client, std::string bucket, std::string key,
+                 std::string upload_id)
+      : client_(std::move(client)),
+        bucket_(std::move(bucket)),
+        key_(std::move(key)),
+        upload_id_(std::move(upload_id)) {}
+
+  absl::Status UploadPart(int part_number, const std::string &data) override {
+    Aws::S3::Model::UploadPartRequest request;
+    request.WithBucket(bucket_).WithKey(key_).WithUploadId(upload_id_).WithPartNumber(part_number);
+    auto body = Aws::MakeShared<Aws::StringStream>("UploadPartStream");
+    body->write(data.data(), static_cast<std::streamsize>(data.size()));
+    request.SetBody(body);
+    request.SetContentLength(static_cast<int64_t>(data.size()));
+    auto outcome = client_->UploadPart(request);
+    if (!outcome.IsSuccess()) {
+      return absl::InternalError(FMT("upload s3 part failed. [key={}, part={}, error={}]", key_, part_number,
+                                     outcome.GetError().GetMessage()));
+    }
+    std::lock_guard lock(mtx_);
+    etags_[part_number] = outcome.GetResult().GetETag();
+    return absl::OkStatus();
+  }
+
+  absl::Status Complete() override {
+    Aws::S3::Model::CompletedMultipartUpload upload;
+    {
+      std::lock_guard lock(mtx_);
+      for (auto &[part_number, etag] : etags_) {
+        upload.AddParts(Aws::S3::Model::CompletedPart().WithPartNumber(part_number).WithETag(etag));
+      }
+    }
+    Aws::S3::Model::CompleteMultipartUploadRequest request;
+    request.WithBucket(bucket_).WithKey(key_).WithUploadId(upload_id_).WithMultipartUpload(upload);
+    auto outcome = client_->CompleteMultipartUpload(request);
+    if (!outcome.IsSuccess()) {
+      return absl::InternalError(
+          FMT("complete s3 multipart upload failed. [key={}, error={}]", key_, outcome.GetError().GetMessage()));
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Abort() override {
+    Aws::S3::Model::AbortMultipartUploadRequest request;
+    request.WithBucket(bucket_).WithKey(key_).WithUploadId(upload_id_);
+    auto outcome = client_->AbortMultipartUpload(request);
+    if (!outcome.IsSuccess()) {
+      return absl::InternalError(
+          FMT("abort s3 multipart upload failed. [key={}, error={}]", key_, outcome.GetError().GetMessage()));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  std::shared_ptr<Aws::S3::S3Client> client_;
+  std::string bucket_;
+  std::string key_;
+  std::string upload_id_;
+  std::mutex mtx_;
+  std::map<int, Aws::String> etags_;
+};
+
+absl::StatusOr<std::unique_ptr<ObjectWriter>> S3StorageProvider::NewObjectWriter(const std::string &bucket,
+                                                                                 const std::string &key) {
+  ExpectOrInternal(client_, "client not inited");
+  auto rfp = TryRemoveCloudStoragePrefix(ServiceProvider::S3, bucket, key);
+  Aws::S3::Model::CreateMultipartUploadRequest request;
+  request.WithBucket(bucket).WithKey(rfp);
+  auto outcome = client_->CreateMultipartUpload(request);
+  ExpectOrInternal(outcome.IsSuccess(), FMT("create s3 multipart upload failed. [key={}, error={}]", rfp,
+                                            outcome.GetError().GetMessage()));
+  return std::make_unique<S3ObjectWriter>(client_, bucket, rfp, outcome.GetResult().GetUploadId());
+}
 }  // namespace cppcommon::os
@@ -1,8 +1,11 @@
 #include "arrow_utils.h"
 
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "arrow/io/file.h"
+
 namespace cppcommon::os {
 arrow::Result<std::shared_ptr<arrow::RecordBatch>> MergeRecordBatchesByColumns(
     const std::vector<std::shared_ptr<arrow::RecordBatch>>& batches) {
@@ -29,4 +32,20 @@ arrow::Result<std::shared_ptr<arrow::RecordBatch>> MergeRecordBatchesByColumns(
   auto merged_schema = arrow::schema(all_fields);
   return arrow::RecordBatch::Make(merged_schema, num_rows, all_columns);
 }
+
+arrow::Result<std::shared_ptr<arrow::ipc::RecordBatchFileReader>> OpenMappedIpcFile(const std::string& filepath) {
+  ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(filepath, arrow::io::FileMode::READ));
+  return arrow::ipc::RecordBatchFileReader::Open(file);
+}
+
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> ReadMappedIpcFile(const std::string& filepath) {
+  ARROW_ASSIGN_OR_RAISE(auto reader, OpenMappedIpcFile(filepath));
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+  batches.reserve(reader->num_record_batches());
+  for (int i = 0; i < reader->num_record_batches(); ++i) {
+    ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(i));
+    batches.push_back(std::move(batch));
+  }
+  return batches;
+}
 }  // namespace cppcommon::os
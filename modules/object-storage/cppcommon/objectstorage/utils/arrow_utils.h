@@ -7,11 +7,19 @@
  */
 #pragma once
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "arrow/api.h"
+#include "arrow/ipc/reader.h"
 
 namespace cppcommon::os {
 arrow::Result<std::shared_ptr<arrow::RecordBatch>> MergeRecordBatchesByColumns(
     const std::vector<std::shared_ptr<arrow::RecordBatch>>& batches);
+
+// memory-map an arrow ipc file, batches are zero copy slices of the mapping unless the buffers are compressed
+arrow::Result<std::shared_ptr<arrow::ipc::RecordBatchFileReader>> OpenMappedIpcFile(const std::string& filepath);
+
+// all batches of a mapped ipc file, the mapping lives as long as any of them
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> ReadMappedIpcFile(const std::string& filepath);
 }
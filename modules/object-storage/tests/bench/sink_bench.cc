@@ -0,0 +1,251 @@
+/**
+ * @file sink_bench.cc
+ * @brief throughput and enqueue latency of sinks
+ * @author zhenkai.sun
+ * @date 2025-06-26 10:22:15
+ *
+ * usage:
+ *   sink_bench --benchmark_out=sink_bench.json --benchmark_out_format=json
+ *   sink_bench --benchmark_filter='BM_TextSink/producers:4/.*'
+ * counters: rows_per_second, bytes_per_second, enqueue p50/p99/p999 (ns) and peak_rss (bytes) of the run
+ */
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cppcommon/objectstorage/sink/arrow_row_sink.h"
+#include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/local_arrow_sink.h"
+#include "cppcommon/objectstorage/sink/local_csv_sink.h"
+#include "cppcommon/objectstorage/sink/local_text_sink.h"
+
+using namespace cppcommon::os;
+
+namespace {
+constexpr int64_t kBytesPerRun = 256LL * 1024 * 1024;
+
+// producers, record bytes, rows per file (0: no rotation)
+void SinkArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"producers", "record_bytes", "rows_per_file"})
+      ->ArgsProduct({{1, 4, 16, 64}, {64, 1024, 16384}, {0, 100000}})
+      ->Iterations(1)
+      ->UseManualTime()
+      ->Unit(benchmark::kMillisecond);
+}
+
+std::filesystem::path BenchDir() {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_bench";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  return dir;
+}
+
+template <typename Options>
+void ApplyRoll(Options &options, int64_t rows_per_file) {
+  options.roll_options.is_rotate = rows_per_file > 0;
+  options.roll_options.max_rows_per_file = rows_per_file > 0 ? rows_per_file : std::numeric_limits<int64_t>::max();
+}
+
+// VmHWM is reset by writing 5 into clear_refs, so the peak belongs to the current run
+void ResetPeakRss() { std::ofstream("/proc/self/clear_refs") << "5"; }
+
+int64_t PeakRss() {
+  std::ifstream ifs("/proc/self/status");
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.starts_with("VmHWM:")) return std::stoll(line.substr(6)) * 1024;
+  }
+  return 0;
+}
+
+/**
+ * Producers start together and write rows of record_bytes as fast as they can, the run ends when the sink is closed
+ * and every row is in files. Every Write is timed for the enqueue latency, the samples (4 bytes per row) are part of
+ * the peak RSS.
+ * make_sink(dir, rows_per_file) returns a unique_ptr of the sink, make_record(record_bytes, seq) returns a record.
+ */
+template <typename MakeSink, typename MakeRecord>
+void RunSinkBench(benchmark::State &state, MakeSink &&make_sink, MakeRecord &&make_record) {
+  auto producers = static_cast<int>(state.range(0));
+  auto record_bytes = state.range(1);
+  auto rows_per_file = state.range(2);
+  auto rows_per_producer = std::max<int64_t>(1, kBytesPerRun / record_bytes / producers);
+  std::vector<uint32_t> latencies;
+  for (auto _ : state) {
+    auto dir = BenchDir();
+    ResetPeakRss();
+    auto sink = make_sink(dir, rows_per_file);
+    std::vector<std::vector<uint32_t>> samples(producers);
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+      threads.emplace_back([&, p] {
+        auto &lat = samples[p];
+        lat.reserve(rows_per_producer);
+        auto record = make_record(record_bytes, p);
+        ++ready;
+        while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+        for (int64_t i = 0; i < rows_per_producer; ++i) {
+          auto copy = record;
+          auto start = std::chrono::steady_clock::now();
+          sink->Write(std::move(copy));
+          auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+          lat.push_back(static_cast<uint32_t>(std::min<int64_t>(ns.count(), std::numeric_limits<uint32_t>::max())));
+        }
+      });
+    }
+    while (ready.load() < producers) std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &th : threads) th.join();
+    sink->Close();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    state.SetIterationTime(elapsed);
+    state.counters["peak_rss"] = benchmark::Counter(static_cast<double>(PeakRss()));
+    sink.reset();
+    latencies.clear();
+    for (auto &lat : samples) latencies.insert(latencies.end(), lat.begin(), lat.end());
+    std::filesystem::remove_all(dir);
+  }
+  auto rows = static_cast<double>(rows_per_producer * producers);
+  state.counters["rows_per_second"] = benchmark::Counter(rows, benchmark::Counter::kIsRate);
+  state.SetBytesProcessed(static_cast<int64_t>(rows) * record_bytes);
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    if (latencies.empty()) return 0.0;
+    return static_cast<double>(latencies[static_cast<size_t>(p * static_cast<double>(latencies.size() - 1))]);
+  };
+  state.counters["enqueue_p50_ns"] = percentile(0.5);
+  state.counters["enqueue_p99_ns"] = percentile(0.99);
+  state.counters["enqueue_p999_ns"] = percentile(0.999);
+}
+
+std::string TextRecord(int64_t bytes, int producer) {
+  std::string record(static_cast<size_t>(std::max<int64_t>(1, bytes - 1)), static_cast<char>('a' + producer % 26));
+  return record;
+}
+
+// 4 fields, record_bytes over all fields and delimiters
+CsvRow CsvRecord(int64_t bytes, int producer) {
+  auto field = static_cast<size_t>(std::max<int64_t>(1, (bytes - 4) / 4));
+  return CsvRow(4, std::string(field, static_cast<char>('a' + producer % 26)));
+}
+
+void BM_TextSink(benchmark::State &state) {
+  RunSinkBench(
+      state,
+      [](const std::filesystem::path &dir, int64_t rows_per_file) {
+        LocalBasicSink::Options options{.name = "bench", .path = dir.string()};
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<LocalBasicSink>(std::move(options));
+      },
+      TextRecord);
+}
+
+void BM_TextSinkFileBackend(benchmark::State &state) {
+  RunSinkBench(
+      state,
+      [](const std::filesystem::path &dir, int64_t rows_per_file) {
+        LocalBasicSink::Options options{
+            .name = "bench", .path = dir.string(), .ofs_options{.file{.type = FileBackend::PWRITE}}};
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<LocalBasicSink>(std::move(options));
+      },
+      TextRecord);
+}
+
+void BM_StaticTextSink(benchmark::State &state) {
+  RunSinkBench(
+      state,
+      [](const std::filesystem::path &dir, int64_t rows_per_file) {
+        StaticTextSink::Options options{.name = "bench", .path = dir.string()};
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<StaticTextSink>(std::move(options));
+      },
+      TextRecord);
+}
+
+void BM_CsvSink(benchmark::State &state) {
+  RunSinkBench(
+      state,
+      [](const std::filesystem::path &dir, int64_t rows_per_file) {
+        CsvSink::Options options{.name = "bench",
+                                 .path = dir.string(),
+                                 .name_options{.suffix = "csv"},
+                                 .ofs_options{.headers = {"a", "b", "c", "d"}}};
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<CsvSink>(std::move(options));
+      },
+      CsvRecord);
+}
+
+void BM_StaticCsvSink(benchmark::State &state) {
+  RunSinkBench(
+      state,
+      [](const std::filesystem::path &dir, int64_t rows_per_file) {
+        StaticCsvSink::Options options{.name = "bench",
+                                       .path = dir.string(),
+                                       .name_options{.suffix = "csv"},
+                                       .ofs_options{.headers = {"a", "b", "c", "d"}}};
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<StaticCsvSink>(std::move(options));
+      },
+      CsvRecord);
+}
+
+// arrow sinks are written through ArrowRowSink, rows are converted into record batches by producers
+struct BenchRow {
+  int64_t seq;
+  int64_t ts;
+  std::string payload;
+};
+}  // namespace
+
+template <>
+struct cppcommon::os::ArrowRowSchema<BenchRow> {
+  static constexpr auto kFields = std::make_tuple(ArrowField{"seq", &BenchRow::seq}, ArrowField{"ts", &BenchRow::ts},
+                                                  ArrowField{"payload", &BenchRow::payload});
+};
+
+namespace {
+BenchRow ArrowRecord(int64_t bytes, int producer) {
+  return {producer, 0, std::string(static_cast<size_t>(std::max<int64_t>(1, bytes - 16)), 'x')};
+}
+
+template <typename Sink>
+void BM_ArrowSink(benchmark::State &state, const char *suffix) {
+  RunSinkBench(
+      state,
+      [suffix](const std::filesystem::path &dir, int64_t rows_per_file) {
+        typename Sink::Options options{.name = "bench", .path = dir.string(), .name_options{.suffix = suffix}};
+        // rows of the record batches are counted, a file rolls after the batch crossing rows_per_file
+        ApplyRoll(options, rows_per_file);
+        return std::make_unique<ArrowRowSink<BenchRow, Sink>>(std::move(options));
+      },
+      ArrowRecord);
+}
+}  // namespace
+
+BENCHMARK(BM_TextSink)->Apply(SinkArgs);
+BENCHMARK(BM_TextSinkFileBackend)->Apply(SinkArgs);
+BENCHMARK(BM_StaticTextSink)->Apply(SinkArgs);
+BENCHMARK(BM_CsvSink)->Apply(SinkArgs);
+BENCHMARK(BM_StaticCsvSink)->Apply(SinkArgs);
+BENCHMARK_CAPTURE(BM_ArrowSink<LocalArrowRecordBatchSinkV1>, parquet_v1, "parquet")->Apply(SinkArgs);
+BENCHMARK_CAPTURE(BM_ArrowSink<LocalArrowRecordBatchSink>, parquet_v2, "parquet")->Apply(SinkArgs);
+BENCHMARK_CAPTURE(BM_ArrowSink<LocalArrowIpcSink>, ipc, "arrow")->Apply(SinkArgs);
+BENCHMARK_CAPTURE(BM_ArrowSink<ArrowCsvLocalSink>, arrow_csv, "csv")->Apply(SinkArgs);
+
+BENCHMARK_MAIN();
@@ -1,5 +1,18 @@
 #include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
 #include <string>
 #include <thread>
 #include <utility>
@@ -7,6 +20,8 @@
 
 #include "cppcommon/objectstorage/api.h"
 #include "cppcommon/objectstorage/sink/base_sink.h"
+#include "cppcommon/objectstorage/sink/partitioned_sink.h"
+#include "cppcommon/objectstorage/sink/replay_reader.h"
 #include "cppcommon/utils/time.h"
 #include "gtest/gtest.h"
 
@@ -113,3 +128,912 @@ TEST(Sink, Mt) {
 
   // std::this_thread::sleep_for(std::chrono::seconds(10));
 }
+
+TEST(Sink, Sharded) {
+  LocalBasicSink::Options options{
+      .name = "runtime",
+      .roll_options{
+          .max_rows_per_file = 1000,
+          .max_backup_files = 8,
+      },
+      .on_roll_callback = [](const std::string &fn, auto) { spdlog::info("rollfile: {}", fn); },
+      .shard_options{.shards = 4}};
+  LocalBasicSink s(std::move(options));
+
+  constexpr int kThreadCount = 8;
+  constexpr int kWritesPerThread = 10000;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreadCount; ++i) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < kWritesPerThread; ++i) {
+        s.Write("data_" + std::to_string(i));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+TEST(Sink, ShardedByKey) {
+  LocalBasicSink::Options options{
+      .name = "runtime",
+      .shard_options{
+          .shards = 3,
+          .routing = ShardRouting::KEY_HASH,
+          .key_func = [](const std::string &record) { return std::hash<std::string>{}(record.substr(0, 1)); },
+      }};
+  LocalBasicSink s(std::move(options));
+  for (int i = 0; i < 100; ++i) {
+    s.Write(std::string(1, static_cast<char>('a' + i % 26)) + std::to_string(i));
+  }
+}
+
+TEST(Sink, BatchRoll) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_batch_roll";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  {
+    LocalBasicSink::Options options{
+        .name = "batch",
+        .path = dir.string(),
+        .roll_options{
+            .max_rows_per_file = 3,
+        },
+        .write_batch_size = 64};
+    LocalBasicSink s(std::move(options));
+    for (int i = 0; i < 10; ++i) {
+      s.Write(std::to_string(i));
+    }
+  }
+  std::vector<size_t> lines;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    lines.emplace_back(std::count(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>(), '\n'));
+  }
+  std::sort(lines.begin(), lines.end());
+  ASSERT_EQ(lines, (std::vector<size_t>{1, 3, 3, 3}));
+}
+
+TEST(Sink, Static) {
+  static_assert(StaticTextSink::kStaticDispatch && !LocalBasicSink::kStaticDispatch);
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_static";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::vector<std::string> rolled;
+  {
+    StaticTextSink s({.name = "static",
+                      .path = dir.string(),
+                      .roll_options{.max_rows_per_file = 3},
+                      .on_roll_callback = [&rolled](std::string filepath, auto) { rolled.push_back(filepath); },
+                      .post_roll{.pool = std::make_shared<PostRollPool>(1, 16)}});
+    for (int i = 0; i < 10; ++i) {
+      s.Write(std::to_string(i));
+    }
+    s.Close();
+    auto metrics = s.Metrics();
+    EXPECT_EQ(metrics.rows_written, 10);
+    EXPECT_EQ(metrics.bytes_written, 20);
+    EXPECT_EQ(metrics.files_rolled, 4);
+  }
+  ASSERT_EQ(rolled.size(), 4);
+  std::vector<size_t> lines;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    lines.emplace_back(std::count(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>(), '\n'));
+  }
+  std::sort(lines.begin(), lines.end());
+  ASSERT_EQ(lines, (std::vector<size_t>{1, 3, 3, 3}));
+}
+
+TEST(Sink, BytesRoll) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_bytes_roll";
+  for (auto backend : {FileBackend::STREAM, FileBackend::PWRITE}) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    {
+      LocalBasicSink s({.name = "bytes",
+                        .path = dir.string(),
+                        .roll_options{.max_rows_per_file = 1000, .max_bytes_per_file = 100},
+                        .ofs_options{.file{.type = backend, .preallocate_bytes = 1 << 20}},
+                        .write_batch_size = 64});
+      for (int i = 0; i < 95; ++i) {
+        s.Write(fmt::format("{:09d}", i));
+      }
+    }
+    std::vector<uintmax_t> sizes;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+      sizes.push_back(entry.file_size());
+      struct stat st {};
+      ASSERT_EQ(::stat(entry.path().c_str(), &st), 0);
+      // preallocated blocks are released on close
+      EXPECT_LT(st.st_blocks * 512, 1 << 20) << entry.path();
+    }
+    std::sort(sizes.begin(), sizes.end());
+    ASSERT_EQ(sizes, (std::vector<uintmax_t>{50, 100, 100, 100, 100, 100, 100, 100, 100, 100}));
+  }
+}
+
+class SlowTextSinkFileSystem : public LocalTextSinkFileSystem {
+ public:
+  inline int WriteBatch(std::span<std::string> records) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return LocalTextSinkFileSystem::WriteBatch(records);
+  }
+};
+
+using SlowSink = BaseSink<std::string, SlowTextSinkFileSystem>;
+
+TEST(Sink, BoundedQueue) {
+  for (auto policy : {OverflowPolicy::BLOCK, OverflowPolicy::DROP_NEWEST, OverflowPolicy::DROP_OLDEST,
+                      OverflowPolicy::SAMPLE}) {
+    SlowSink::Options options{.name = "bounded",
+                              .roll_options{.is_rotate = false},
+                              .queue_options{
+                                  .capacity = 10,
+                                  .policy = policy,
+                                  .block_timeout = std::chrono::milliseconds(1),
+                              }};
+    SlowSink s(std::move(options));
+    int ok = 0;
+    for (int i = 0; i < 1000; ++i) {
+      if (s.Write(std::to_string(i)) == WriteStatus::OK) ++ok;
+    }
+    auto stats = s.DropStats();
+    spdlog::info("policy={}, ok={}, newest={}, oldest={}, sampled={}, timeout={}", static_cast<int>(policy), ok,
+                 stats.dropped_newest, stats.dropped_oldest, stats.dropped_sampled, stats.dropped_timeout);
+    ASSERT_GT(stats.Total(), 0);
+    if (policy == OverflowPolicy::DROP_OLDEST) {
+      ASSERT_EQ(ok, 1000);
+    } else {
+      ASSERT_EQ(ok + stats.Total(), 1000);
+    }
+    ASSERT_LE(s.Size(), 20);
+  }
+}
+
+TEST(Sink, Producer) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_producer";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  constexpr int kProducers = 4;
+  constexpr int kRowsPerProducer = 10000;
+  {
+    LocalBasicSink s(
+        {.name = "producer", .path = dir.string(), .roll_options{.is_rotate = false}, .shard_options{.shards = 2}});
+    std::vector<std::thread> threads;
+    for (int p = 0; p < kProducers; ++p) {
+      threads.emplace_back([&s, p] {
+        auto producer = s.CreateProducer();
+        std::vector<std::string> bulk;
+        // chunks of 16 rows, written by Write and WriteBulk in turn
+        for (int i = 0; i < kRowsPerProducer; ++i) {
+          auto record = std::to_string(p) + " " + std::to_string(i);
+          if (i / 16 % 2 == 0) {
+            ASSERT_EQ(producer.Write(std::move(record)), WriteStatus::OK);
+            continue;
+          }
+          bulk.push_back(std::move(record));
+          if (bulk.size() == 16) {
+            ASSERT_EQ(producer.WriteBulk(bulk), WriteStatus::OK);
+            bulk.clear();
+          }
+        }
+        ASSERT_EQ(producer.WriteBulk(bulk), WriteStatus::OK);
+      });
+    }
+    for (auto &t : threads) t.join();
+    s.Close();
+    EXPECT_EQ(s.Metrics().rows_written, kProducers * kRowsPerProducer);
+  }
+  // records of a producer are in one file, in the order they are written
+  std::map<int, std::vector<int>> rows;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    std::set<int> producers;
+    int p, i;
+    while (ifs >> p >> i) {
+      rows[p].push_back(i);
+      producers.insert(p);
+    }
+    for (auto producer : producers) EXPECT_EQ(rows[producer].size(), kRowsPerProducer);
+  }
+  ASSERT_EQ(rows.size(), kProducers);
+  for (auto &[p, seq] : rows) {
+    ASSERT_EQ(seq.size(), kRowsPerProducer);
+    EXPECT_TRUE(std::is_sorted(seq.begin(), seq.end())) << p;
+  }
+
+  // bulks which do not fit a bounded queue go through the overflow policy record by record
+  SlowSink bounded({.name = "producer_bounded",
+                    .roll_options{.is_rotate = false},
+                    .queue_options{.capacity = 10, .policy = OverflowPolicy::DROP_NEWEST}});
+  auto producer = bounded.CreateProducer();
+  std::vector<std::string> bulk(25, "bounded");
+  EXPECT_EQ(producer.WriteBulk(bulk), WriteStatus::DROPPED);
+  EXPECT_EQ(bulk.size() - bounded.DropStats().dropped_newest, bounded.Metrics().enqueued);
+}
+
+TEST(Sink, Executor) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_executor";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  constexpr int kSinks = 6;
+  constexpr int kRowsPerSink = 20000;
+  auto executor = std::make_shared<SinkExecutor>(2, std::chrono::milliseconds(10));
+  std::vector<std::unique_ptr<LocalBasicSink>> sinks;
+  for (int n = 0; n < kSinks; ++n) {
+    sinks.push_back(std::make_unique<LocalBasicSink>(LocalBasicSink::Options{
+        .name = "executor" + std::to_string(n),
+        .path = dir.string(),
+        .roll_options{.max_rows_per_file = 3000},
+        .shard_options{.shards = n % 2 + 1,
+                       .routing = ShardRouting::KEY_HASH,
+                       .key_func = [](const std::string &r) { return std::stoul(r.substr(r.find(' ') + 1)); }},
+        .durability_options{.mode = n == 0 ? DurabilityMode::INTERVAL : DurabilityMode::NONE,
+                            .interval = std::chrono::milliseconds(20)},
+        .executor{.pool = executor, .priority = n % 3 + 1}}));
+  }
+  // 12 shards on 2 workers, no thread per shard
+  std::vector<std::thread> producers;
+  for (int n = 0; n < kSinks; ++n) {
+    producers.emplace_back([&sinks, n] {
+      for (int i = 0; i < kRowsPerSink; ++i) {
+        ASSERT_EQ(sinks[n]->Write(std::to_string(n) + " " + std::to_string(i)), WriteStatus::OK);
+      }
+      // the worker running the shard commits durable writes too
+      ASSERT_EQ(sinks[n]->WriteDurable(std::to_string(n) + " " + std::to_string(kRowsPerSink)), WriteStatus::OK);
+    });
+  }
+  for (auto &t : producers) t.join();
+  for (auto &s : sinks) {
+    s->Close();
+    EXPECT_EQ(s->Metrics().rows_written, kRowsPerSink + 1);
+  }
+  // rows of a shard are in order within every file, the durable row included
+  std::map<int, int> rows;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    int n, i, last = -1;
+    while (ifs >> n >> i) {
+      ++rows[n];
+      EXPECT_LT(last, i) << entry.path();
+      last = i;
+    }
+  }
+  ASSERT_EQ(rows.size(), kSinks);
+  for (auto &[n, count] : rows) EXPECT_EQ(count, kRowsPerSink + 1) << n;
+}
+
+TEST(Sink, Spill) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_spill";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  {
+    SlowSink::Options options{.name = "spill",
+                              .path = dir.string(),
+                              .roll_options{.is_rotate = false},
+                              .write_batch_size = 16,
+                              .queue_options{
+                                  .capacity = 10,
+                                  .policy = OverflowPolicy::SPILL,
+                              }};
+    SlowSink s(std::move(options));
+    for (int i = 0; i < 1000; ++i) {
+      ASSERT_EQ(s.Write(std::to_string(i)), WriteStatus::OK);
+    }
+    ASSERT_GT(s.Size(), 10);
+    ASSERT_EQ(s.DropStats().Total(), 0);
+  }
+  std::vector<std::filesystem::path> files;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) files.emplace_back(entry.path());
+  ASSERT_EQ(files.size(), 1);  // the spill file is removed on close
+  std::ifstream ifs(files[0]);
+  std::string line;
+  int expected = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_EQ(line, std::to_string(expected++));
+  }
+  ASSERT_EQ(expected, 1000);
+}
+
+TEST(Sink, SpillReadError) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_spill_read_error";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto filepath = (dir / "error.spill").string();
+  SpillFile<std::string> spill(filepath, 1 << 20);
+  for (int i = 0; i < 10; ++i) ASSERT_TRUE(spill.Append("record " + std::to_string(i)));
+  // 4 whole frames of 12 bytes are left, the 5th is cut
+  std::filesystem::resize_file(filepath, 4 * 12 + 5);
+  std::vector<std::string> records(16);
+  size_t lost = 0;
+  ASSERT_EQ(spill.Read(records.data(), records.size(), lost), 4);
+  EXPECT_EQ(records[3], "record 3");
+  // the rest is dropped, not retried by the writer
+  EXPECT_EQ(lost, 6);
+  EXPECT_FALSE(spill.Active());
+  EXPECT_EQ(spill.Size(), 0);
+  // the file is reused by later records
+  ASSERT_TRUE(spill.Append("record 10"));
+  ASSERT_EQ(spill.Read(records.data(), records.size(), lost), 1);
+  EXPECT_EQ(records[0], "record 10");
+  EXPECT_EQ(lost, 6);
+}
+
+// concatenated gzip members are read as one stream
+static std::string ReadGzipFile(const std::string &filepath) {
+  std::string content;
+  auto gz = gzopen(filepath.c_str(), "rb");
+  if (!gz) return content;
+  char buf[64 * 1024];
+  int n;
+  while ((n = gzread(gz, buf, sizeof(buf))) > 0) content.append(buf, n);
+  gzclose(gz);
+  return content;
+}
+
+TEST(Sink, Compressed) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_compressed";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::string expected;
+  {
+    LocalBasicSink::Options options{.name = "compressed",
+                                    .path = dir.string(),
+                                    .roll_options{.is_rotate = false},
+                                    .ofs_options{
+                                        .compression{.type = Compression::GZIP},
+                                        .block_size = 4096,
+                                    }};
+    LocalBasicSink s(std::move(options));
+    for (int i = 0; i < 10000; ++i) {
+      s.Write("line " + std::to_string(i));
+      expected += "line " + std::to_string(i) + "\n";
+    }
+  }
+  std::vector<std::filesystem::path> files;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) files.emplace_back(entry.path());
+  ASSERT_EQ(files.size(), 1);
+  ASSERT_EQ(files[0].extension(), ".gz");
+  ASSERT_LT(std::filesystem::file_size(files[0]), expected.size());
+  ASSERT_EQ(ReadGzipFile(files[0].string()), expected);
+}
+
+TEST(Sink, CompressedBytesRoll) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_compressed_bytes_roll";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  constexpr int64_t kMaxBytes = 16 * 1024;
+  constexpr int kRows = 100000;
+  {
+    LocalBasicSink s({.name = "compressed",
+                      .path = dir.string(),
+                      .roll_options{.max_bytes_per_file = kMaxBytes},
+                      .ofs_options{.compression{.type = Compression::GZIP}, .block_size = 4096}});
+    for (int i = 0; i < kRows; ++i) s.Write("line " + std::to_string(i));
+  }
+  // compressed bytes are counted, only the last file is below the limit
+  size_t rows = 0, small = 0, files = 0;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    auto size = static_cast<int64_t>(entry.file_size());
+    if (size < kMaxBytes) ++small;
+    EXPECT_LE(size, kMaxBytes + 4096) << entry.path();
+    auto content = ReadGzipFile(entry.path().string());
+    rows += std::count(content.begin(), content.end(), '\n');
+    ++files;
+  }
+  EXPECT_GT(files, 1);
+  EXPECT_LE(small, 1);
+  EXPECT_EQ(rows, kRows);
+}
+
+TEST(Sink, FileBackend) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_file_backend";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  for (auto backend : {FileBackend::PWRITE, FileBackend::IO_URING}) {
+    for (auto direct_io : {false, true}) {
+      FileBackendOptions file{.type = backend, .direct_io = direct_io, .buffer_size = 4096};
+      // unaligned flushes in the middle of the file
+      auto filepath = (dir / "output_file").string();
+      std::string expected;
+      {
+        OutputFile f(file);
+        ASSERT_TRUE(f.Open(filepath));
+        for (int i = 0; i < 10; ++i) {
+          std::string data(1000 + i * 777, static_cast<char>('a' + i));
+          ASSERT_TRUE(f.Write(data.data(), data.size()));
+          ASSERT_TRUE(f.Flush());
+          expected += data;
+        }
+        ASSERT_EQ(f.Tell(), expected.size());
+        ASSERT_TRUE(f.Close());
+      }
+      std::ifstream ifs(filepath);
+      ASSERT_EQ(std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()), expected);
+
+      auto sink_dir = dir / "sink";
+      std::filesystem::remove_all(sink_dir);
+      std::filesystem::create_directories(sink_dir);
+      LocalBasicSink::Options options{.name = "backend",
+                                      .path = sink_dir.string(),
+                                      .roll_options{.is_rotate = false},
+                                      .ofs_options{.file = file}};
+      expected.clear();
+      {
+        LocalBasicSink s(std::move(options));
+        for (int i = 0; i < 20000; ++i) {
+          s.Write("line " + std::to_string(i));
+          expected += "line " + std::to_string(i) + "\n";
+        }
+      }
+      auto sink_filepath = std::filesystem::directory_iterator(sink_dir)->path();
+      std::ifstream sink_ifs(sink_filepath);
+      ASSERT_EQ(std::string(std::istreambuf_iterator<char>(sink_ifs), std::istreambuf_iterator<char>()), expected);
+    }
+  }
+}
+
+TEST(Sink, Durable) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_durable";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  LocalBasicSink::Options options{.name = "durable",
+                                  .path = dir.string(),
+                                  .roll_options{.max_rows_per_file = 300},
+                                  .shard_options{.shards = 2},
+                                  .durability_options{.mode = DurabilityMode::GROUP_COMMIT}};
+  LocalBasicSink s(std::move(options));
+  std::vector<std::thread> producers;
+  std::atomic<int> ok{0};
+  for (int t = 0; t < 8; ++t) {
+    producers.emplace_back([&s, &ok, t] {
+      for (int i = 0; i < 100; ++i) {
+        s.Write("plain " + std::to_string(t * 100 + i));
+        if (s.WriteDurable("durable " + std::to_string(t * 100 + i)) == WriteStatus::OK) ++ok;
+      }
+    });
+  }
+  for (auto &th : producers) th.join();
+  ASSERT_EQ(ok, 800);
+  // every durable record is in the files before the sink is closed
+  size_t durable_lines = 0;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    std::string line;
+    while (std::getline(ifs, line)) {
+      if (line.starts_with("durable ")) ++durable_lines;
+    }
+  }
+  ASSERT_EQ(durable_lines, 800);
+  s.Close();
+  ASSERT_EQ(s.WriteDurable(std::string("closed")), WriteStatus::STOPPED);
+  // a commit writes the records queued with its waiters, producers flooding the shard do not hold it
+  {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    SlowSink flooded({.name = "flooded",
+                      .path = dir.string(),
+                      .roll_options{.is_rotate = false},
+                      .queue_options{.capacity = 1000, .policy = OverflowPolicy::DROP_NEWEST}});
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> floods;
+    for (int t = 0; t < 4; ++t) {
+      floods.emplace_back([&flooded, &stop] {
+        while (!stop) flooded.Write(std::string("plain"));
+      });
+    }
+    for (int i = 0; i < 20; ++i) ASSERT_EQ(flooded.WriteDurable("durable " + std::to_string(i)), WriteStatus::OK);
+    stop = true;
+    for (auto &th : floods) th.join();
+  }
+  // objects can not be synced before they are closed
+  EXPECT_THROW(LocalBasicSink({.name = "durable_object",
+                               .ofs_options{.file{.type = FileBackend::OBJECT}},
+                               .durability_options{.mode = DurabilityMode::INTERVAL}}),
+               std::invalid_argument);
+}
+
+// object storage in memory, objects are visible after Complete
+class MemoryStorageProvider : public StorageProvider {
+ public:
+  class Writer : public ObjectWriter {
+   public:
+    Writer(MemoryStorageProvider *provider, std::string key) : provider_(provider), key_(std::move(key)) {}
+
+    absl::Status UploadPart(int part_number, const std::string &data) override {
+      std::lock_guard lock(mtx_);
+      parts_[part_number] = data;
+      return absl::OkStatus();
+    }
+
+    absl::Status Complete() override {
+      std::string object;
+      for (auto &[_, data] : parts_) object += data;
+      std::lock_guard lock(provider_->mtx_);
+      provider_->objects_[key_] = std::move(object);
+      provider_->parts_[key_] = parts_.size();
+      return absl::OkStatus();
+    }
+
+    absl::Status Abort() override { return absl::OkStatus(); }
+
+   private:
+    MemoryStorageProvider *provider_;
+    std::string key_;
+    std::mutex mtx_;
+    std::map<int, std::string> parts_;
+  };
+
+  absl::StatusOr<FileList> List(const std::string &, const std::string &) override {
+    std::lock_guard lock(mtx_);
+    FileList keys;
+    for (auto &[key, _] : objects_) keys.push_back(key);
+    return keys;
+  }
+  absl::Status Upload(const TransferMeta &meta) override {
+    std::ifstream ifs(meta.local_file_path, std::ios::binary);
+    if (!ifs) return absl::NotFoundError(meta.local_file_path);
+    std::string object((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    std::lock_guard lock(mtx_);
+    objects_[meta.bucket + "/" + meta.remote_file_path] = std::move(object);
+    return absl::OkStatus();
+  }
+  absl::Status DownloadFile(const TransferMeta &) override { return absl::UnimplementedError(""); }
+  absl::StatusOr<FilePathList> Download(const TransferMeta &) override { return absl::UnimplementedError(""); }
+  absl::StatusOr<std::unique_ptr<ObjectWriter>> NewObjectWriter(const std::string &bucket,
+                                                                const std::string &key) override {
+    return std::make_unique<Writer>(this, bucket + "/" + key);
+  }
+
+  std::mutex mtx_;
+  std::map<std::string, std::string> objects_;
+  std::map<std::string, size_t> parts_;
+};
+
+TEST(Sink, ObjectStorage) {
+  auto provider = std::make_shared<MemoryStorageProvider>();
+  FileBackendOptions file{.type = FileBackend::OBJECT,
+                          .object{.provider = provider, .part_size = kMinUploadPartSize, .upload_threads = 3}};
+  std::string expected;
+  {
+    LocalBasicSink s({.name = "object",
+                      .path = "mem://bucket/sink",
+                      .roll_options{.is_rotate = false},
+                      .ofs_options{.file = file}});
+    for (int i = 0; i < 300000; ++i) {
+      s.Write("object line " + std::to_string(i));
+      expected += "object line " + std::to_string(i) + "\n";
+    }
+  }
+  ASSERT_EQ(provider->objects_.size(), 1);
+  auto &[key, object] = *provider->objects_.begin();
+  EXPECT_TRUE(key.starts_with("bucket/sink/object_"));
+  EXPECT_EQ(object, expected);
+  EXPECT_EQ(provider->parts_[key], (expected.size() + kMinUploadPartSize - 1) / kMinUploadPartSize);
+
+  // compressed blocks go through the same backend
+  {
+    LocalBasicSink s({.name = "gz",
+                      .path = "mem://bucket/sink",
+                      .roll_options{.is_rotate = false},
+                      .ofs_options{.compression{.type = Compression::GZIP}, .file = file}});
+    s.Write("compressed");
+  }
+  EXPECT_EQ(provider->objects_.size(), 2);
+}
+
+TEST(Sink, PostRoll) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_post_roll";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto provider = std::make_shared<MemoryStorageProvider>();
+  std::mutex mtx;
+  std::vector<std::string> rolled;
+  {
+    LocalBasicSink s({.name = "post",
+                      .path = dir.string(),
+                      .roll_options{.max_rows_per_file = 3},
+                      .on_roll_callback =
+                          [&](std::string filepath, const TimeRollPolicy &) {
+                            std::lock_guard lock(mtx);
+                            rolled.push_back(std::move(filepath));
+                          },
+                      .post_roll{.steps = {GzipStep(), ChecksumStep(), UploadStep(provider, "bucket", "logs/"),
+                                           DeleteStep()},
+                                 .pool = std::make_shared<PostRollPool>(2, 1)}});
+    for (int i = 0; i < 10; ++i) {
+      s.Write("post roll line " + std::to_string(i));
+    }
+    s.Close();
+    auto stats = s.PostRollStats();
+    ASSERT_EQ(stats.size(), 5);
+    for (auto &step : stats) {
+      EXPECT_EQ(step.ok, 4) << step.name;
+      EXPECT_EQ(step.failed, 0) << step.name;
+    }
+  }
+  ASSERT_EQ(rolled.size(), 4);
+  for (auto &filepath : rolled) {
+    EXPECT_TRUE(filepath.ends_with(".log.gz"));
+    EXPECT_FALSE(std::filesystem::exists(filepath));
+  }
+  ASSERT_EQ(provider->objects_.size(), 4);
+  for (auto &[key, object] : provider->objects_) {
+    EXPECT_TRUE(key.starts_with("bucket/logs/post_")) << key;
+    // gzip magic
+    ASSERT_GT(object.size(), 2);
+    EXPECT_EQ(static_cast<unsigned char>(object[0]), 0x1f);
+    EXPECT_EQ(static_cast<unsigned char>(object[1]), 0x8b);
+  }
+  EXPECT_TRUE(std::filesystem::is_empty(dir));
+}
+
+TEST(Sink, PostRollBackupFiles) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_post_roll_backup";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  {
+    LocalBasicSink s({.name = "backup",
+                      .path = dir.string(),
+                      .roll_options{.max_rows_per_file = 2, .max_backup_files = 3},
+                      .post_roll{.steps = {GzipStep()}, .pool = std::make_shared<PostRollPool>(2, 1)}});
+    for (int i = 0; i < 20; ++i) {
+      s.Write("backup line " + std::to_string(i));
+    }
+    s.Close();
+  }
+  // the oldest files are removed by the names GzipStep leaves
+  std::set<std::string> files;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) files.insert(entry.path().filename().string());
+  ASSERT_EQ(files.size(), 3);
+  for (auto &file : files) EXPECT_TRUE(file.ends_with(".log.gz")) << file;
+  std::string lines;
+  for (auto &file : files) lines += ReadGzipFile((dir / file).string());
+  for (int i = 14; i < 20; ++i) EXPECT_NE(lines.find("backup line " + std::to_string(i) + "\n"), std::string::npos) << i;
+  EXPECT_EQ(lines.find("backup line 13\n"), std::string::npos);
+}
+
+TEST(Sink, PostRollRetry) {
+  {
+    // a delayed task does not hold the only worker until its deadline
+    PostRollPool pool(1, 1);
+    std::atomic<bool> delayed{false};
+    std::atomic<bool> ran{false};
+    pool.SubmitAfter(std::chrono::milliseconds(300), [&] { delayed = true; });
+    pool.Submit([&] { ran = true; });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (!ran && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_TRUE(ran);
+    EXPECT_FALSE(delayed);
+  }
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_post_roll_retry";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::mutex mtx;
+  std::map<std::string, int> calls;
+  std::atomic<int> rolled{0};
+  // fails the first two calls of every file
+  PostRollStep flaky{.name = "flaky",
+                     .func =
+                         [&](RolledFile &file) {
+                           std::lock_guard lock(mtx);
+                           return ++calls[file.filepath] > 2;
+                         },
+                     .max_retries = 2,
+                     .retry_backoff = std::chrono::milliseconds(10)};
+  PostRollStep broken{.name = "broken", .func = [](RolledFile &) { return false; }, .max_retries = 1};
+  PostRollStep skipped{.name = "skipped", .func = [](RolledFile &) { return true; }};
+  for (bool close_in_threads : {true, false}) {
+    calls.clear();
+    rolled = 0;
+    LocalBasicSink s({.name = "retry",
+                      .path = dir.string(),
+                      .roll_options{.max_rows_per_file = 3},
+                      .on_roll_callback = [&](std::string, const TimeRollPolicy &) { ++rolled; },
+                      .close_in_threads = close_in_threads,
+                      .post_roll{.steps = {flaky, broken, skipped}, .pool = std::make_shared<PostRollPool>(1, 1)}});
+    for (int i = 0; i < 10; ++i) {
+      s.Write("retry line " + std::to_string(i));
+    }
+    s.Close();
+    EXPECT_EQ(rolled, 4);
+    std::map<std::string, PostRollStepStats> stats;
+    for (auto &step : s.PostRollStats()) stats[step.name] = step;
+    EXPECT_EQ(stats["flaky"].ok, 4);
+    EXPECT_EQ(stats["flaky"].retries, 8);
+    EXPECT_EQ(stats["broken"].failed, 4);
+    EXPECT_EQ(stats["broken"].retries, 4);
+    EXPECT_EQ(stats.count("skipped"), 0);
+  }
+}
+
+TEST(Sink, Metrics) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_metrics";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  int callbacks = 0;
+  LocalBasicSink s({.name = "metrics",
+                    .path = dir.string(),
+                    .roll_options{.max_rows_per_file = 1000},
+                    .on_roll_callback = [&](std::string, const TimeRollPolicy &) { ++callbacks; },
+                    .close_in_threads = false,
+                    .shard_options{.shards = 2}});
+  uint64_t bytes = 0;
+  for (int i = 0; i < 5000; ++i) {
+    auto line = "metrics line " + std::to_string(i);
+    bytes += line.size() + 1;
+    s.Write(std::move(line));
+  }
+  s.Close();
+  auto m = s.Metrics();
+  EXPECT_EQ(m.name, "metrics");
+  EXPECT_EQ(m.enqueued, 5000);
+  EXPECT_GT(m.enqueue_rate, 0);
+  EXPECT_EQ(m.queue_depth, 0);
+  EXPECT_GT(m.queue_depth_hwm, 0);
+  EXPECT_EQ(m.rows_written, 5000);
+  EXPECT_EQ(m.bytes_written, bytes);
+  EXPECT_EQ(m.files_rolled, callbacks);
+  EXPECT_EQ(m.files_rolled, 6);
+  EXPECT_GT(m.enqueue_to_write.count, 0);
+  EXPECT_LE(m.enqueue_to_write.p50_us, m.enqueue_to_write.max_us);
+  EXPECT_GT(m.write_batch.count, 0);
+  EXPECT_GT(m.roll.count, 0);
+  EXPECT_EQ(m.close.count, 6);
+  EXPECT_EQ(m.roll_callback.count, 6);
+  EXPECT_EQ(m.drops.Total(), 0);
+
+  auto json = m.ToJson();
+  EXPECT_TRUE(json.starts_with(R"({"name":"metrics","uptime_s":)")) << json;
+  EXPECT_NE(json.find(R"("rows_written":5000,)"), std::string::npos) << json;
+  EXPECT_NE(json.find(R"("post_roll":[{"name":"close","ok":6,)"), std::string::npos) << json;
+  EXPECT_EQ(json.back(), '}');
+}
+
+TEST(Sink, Replay) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_replay";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  constexpr int kRows = 50000;
+  LocalBasicSink::Options options{.name = "replay",
+                                  .path = dir.string(),
+                                  .roll_options{.max_rows_per_file = 20000},
+                                  .shard_options{.shards = 2}};
+  auto replay_options = ReplayOptionsOf(options);
+  {
+    LocalBasicSink s(std::move(options));
+    for (int i = 0; i < kRows; ++i) {
+      s.Write("replay line " + std::to_string(i));
+    }
+  }
+
+  // chunks split lines of the same file, batches come back in file order
+  replay_options.chunk_bytes = 4096;
+  replay_options.threads = 3;
+  TextReplayReader reader(replay_options);
+  ASSERT_EQ(reader.Files().size(), 4);
+  std::map<int, int> next;
+  std::set<int> seen;
+  reader.Start();
+  TextReplayReader::Batch batch;
+  size_t seq = 0;
+  while (reader.Next(batch)) {
+    ASSERT_EQ(batch.seq, seq++);
+    for (auto &line : batch.rows) {
+      ASSERT_TRUE(line.starts_with("replay line ")) << line;
+      auto i = std::stoi(line.substr(12));
+      // records of a shard are written in order
+      ASSERT_GT(i + 1, next[batch.file->shard]);
+      next[batch.file->shard] = i + 1;
+      seen.insert(i);
+    }
+  }
+  ASSERT_GT(seq, 4);
+  ASSERT_EQ(seen.size(), kRows);
+}
+
+TEST(Sink, Partitioned) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_partitioned";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  using Sink = PartitionedSink<std::string, LocalTextSinkFileSystem, TextWriterOptions>;
+  constexpr int kRows = 5000;
+  std::atomic<int> closed{0};
+  {
+    Sink s({.name = "part",
+            .path = dir.string(),
+            .partition_func = [](const std::string &record) {
+              return HivePartition({{"app", record.substr(0, 4)}, {"kind", record.substr(5, record.find('|', 5) - 5)}});
+            },
+            .max_rows_per_file = 400,
+            .max_open_files = 4,
+            .idle_timeout = std::chrono::milliseconds(50),
+            .shards = 2,
+            .on_roll_callback = [&closed](std::string, const TimeRollPolicy &) { ++closed; }});
+    for (int i = 0; i < kRows; ++i) {
+      s.Write(fmt::format("app{}|{}|{}", i % 5, i % 2 ? "a" : "b/c", i));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(s.OpenFiles(), 0);
+    EXPECT_GT(s.IdleClosedFiles(), 0);
+    EXPECT_GT(s.EvictedFiles(), 0);
+  }
+  std::map<std::string, int> rows;
+  int files = 0;
+  for (auto &entry : std::filesystem::recursive_directory_iterator(dir)) {
+    if (!entry.is_regular_file()) continue;
+    ++files;
+    auto partition = entry.path().parent_path().lexically_relative(dir).string();
+    std::ifstream ifs(entry.path());
+    std::string line;
+    int last = -1;
+    while (std::getline(ifs, line)) {
+      EXPECT_EQ(HivePartition({{"app", line.substr(0, 4)}, {"kind", line.substr(5, line.find('|', 5) - 5)}}), partition)
+          << line;
+      auto i = std::stoi(line.substr(line.rfind('|') + 1));
+      EXPECT_GT(i, last);
+      last = i;
+      ++rows[partition];
+    }
+  }
+  EXPECT_EQ(files, closed);
+  ASSERT_EQ(rows.size(), 10);
+  EXPECT_EQ(rows["app=app0/kind=b%2Fc"], kRows / 10);
+  int total = 0;
+  for (auto &[_, n] : rows) total += n;
+  EXPECT_EQ(total, kRows);
+}
+
+TEST(Sink, PartitionedBoundedQueue) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_partitioned_bounded";
+  using Sink = PartitionedSink<std::string, SlowTextSinkFileSystem>;
+  EXPECT_THROW(Sink({.partition_func = [](const std::string &) { return std::string("p"); },
+                     .queue_options{.capacity = 10, .policy = OverflowPolicy::SPILL}}),
+               std::invalid_argument);
+  for (auto policy : {OverflowPolicy::BLOCK, OverflowPolicy::DROP_NEWEST, OverflowPolicy::DROP_OLDEST,
+                      OverflowPolicy::SAMPLE}) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    int ok = 0;
+    SinkDropStats stats;
+    {
+      Sink s({.name = "part",
+              .path = dir.string(),
+              .partition_func = [](const std::string &record) { return HivePartition({{"p", record.substr(0, 1)}}); },
+              .write_batch_size = 4,
+              .queue_options{
+                  .capacity = 10,
+                  .policy = policy,
+                  .block_timeout = std::chrono::milliseconds(1),
+              }});
+      for (int i = 0; i < 1000; ++i) {
+        if (s.Write(std::to_string(i % 2) + " " + std::to_string(i)) == WriteStatus::OK) ++ok;
+      }
+      ASSERT_LE(s.Size(), 20);
+      s.Close();
+      stats = s.DropStats();
+    }
+    spdlog::info("policy={}, ok={}, newest={}, oldest={}, sampled={}, timeout={}", static_cast<int>(policy), ok,
+                 stats.dropped_newest, stats.dropped_oldest, stats.dropped_sampled, stats.dropped_timeout);
+    ASSERT_GT(stats.Total(), 0);
+    int rows = 0;
+    for (auto &entry : std::filesystem::recursive_directory_iterator(dir)) {
+      if (!entry.is_regular_file()) continue;
+      std::ifstream ifs(entry.path());
+      std::string line;
+      while (std::getline(ifs, line)) ++rows;
+    }
+    if (policy == OverflowPolicy::DROP_OLDEST) {
+      ASSERT_EQ(ok, 1000);
+      ASSERT_EQ(rows + stats.dropped_oldest, 1000);
+    } else {
+      ASSERT_EQ(ok + stats.Total(), 1000);
+      ASSERT_EQ(rows, ok);
+    }
+  }
+}
@@ -1,6 +1,15 @@
 #include <spdlog/spdlog.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <span>
 #include <string>
 #include <thread>
 #include <utility>
@@ -9,6 +18,8 @@
 #include "cppcommon/objectstorage/api.h"
 #include "cppcommon/objectstorage/sink/base_sink.h"
 #include "cppcommon/objectstorage/sink/local_csv_sink.h"
+#include "cppcommon/objectstorage/sink/replay_reader.h"
+#include "cppcommon/objectstorage/sink/tee_sink.h"
 #include "cppcommon/utils/time.h"
 #include "cppcommon/utils/time_ruler.h"
 #include "gtest/gtest.h"
@@ -187,3 +198,324 @@ TEST(Sink, CsvBm) {
 
   // std::this_thread::sleep_for(std::chrono::seconds(20));
 }
+
+TEST(Sink, CsvOrder) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_csv_order";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  constexpr int kRows = 100000;
+  {
+    CsvSink::Options options{.name = "order",
+                             .path = dir.string(),
+                             .name_options{.suffix = "csv"},
+                             .roll_options{.is_rotate = false},
+                             .ofs_options{.headers = {"idx", "value"}, .writer_threads_count = 4, .chunk_rows = 100}};
+    CsvSink s(std::move(options));
+    for (int i = 0; i < kRows; ++i) {
+      s.Write(CsvRow{std::to_string(i), i % 10 ? "v" : "a,\"b\""});
+    }
+  }
+
+  ASSERT_EQ(std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator()), 1);
+  std::ifstream ifs(std::filesystem::directory_iterator(dir)->path());
+  std::string line;
+  std::getline(ifs, line);
+  ASSERT_EQ(line, "idx,value");
+  for (int i = 0; i < kRows; ++i) {
+    ASSERT_TRUE(std::getline(ifs, line));
+    ASSERT_EQ(line, std::to_string(i) + (i % 10 ? ",v" : ",\"a,\"\"b\"\"\""));
+  }
+  ASSERT_FALSE(std::getline(ifs, line));
+}
+
+// chunks are formatted and the sink is written by one shared executor
+TEST(Sink, CsvExecutor) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_csv_executor";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  constexpr int kRows = 100000;
+  auto executor = std::make_shared<SinkExecutor>(2);
+  {
+    CsvSink::Options options{.name = "executor",
+                             .path = dir.string(),
+                             .name_options{.suffix = "csv"},
+                             .roll_options{.max_rows_per_file = 30000},
+                             .ofs_options{.headers = {"idx", "value"}, .chunk_rows = 100, .executor = executor},
+                             .executor{.pool = executor}};
+    CsvSink s(std::move(options));
+    for (int i = 0; i < kRows; ++i) {
+      s.Write(CsvRow{std::to_string(i), "v"});
+    }
+  }
+
+  std::vector<int> rows;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream ifs(entry.path());
+    std::string line;
+    std::getline(ifs, line);
+    ASSERT_EQ(line, "idx,value");
+    int last = -1;
+    while (std::getline(ifs, line)) {
+      auto idx = std::stoi(line.substr(0, line.find(',')));
+      ASSERT_EQ(idx, last < 0 ? idx : last + 1);
+      last = idx;
+      rows.push_back(idx);
+    }
+  }
+  std::sort(rows.begin(), rows.end());
+  ASSERT_EQ(rows.size(), kRows);
+  for (int i = 0; i < kRows; ++i) ASSERT_EQ(rows[i], i);
+}
+
+class SlowLineFileSystem : public LocalTextSinkFileSystem {
+ public:
+  inline int WriteBatch(std::span<std::string> records) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return LocalTextSinkFileSystem::WriteBatch(records);
+  }
+};
+
+TEST(Sink, CsvTee) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_csv_tee";
+  std::filesystem::remove_all(dir);
+  for (auto sub : {"csv", "a", "b", "slow"}) std::filesystem::create_directories(dir / sub);
+
+  constexpr int kRows = 20000;
+  std::atomic<int> encoded{0};
+  int dropped = 0;
+  {
+    TeeSink<CsvRow> tee;
+    auto line = tee.AddEncoding([&encoded](const CsvRow &row, std::string &out) {
+      ++encoded;
+      AppendCsvRow<','>(out, row);
+      out.pop_back();
+    });
+    tee.AddBranch<CsvWriter<','>, CsvWriterOptions>({.name = "tee",
+                                                     .path = (dir / "csv").string(),
+                                                     .name_options{.suffix = "csv"},
+                                                     .roll_options{.max_rows_per_file = 5000},
+                                                     .ofs_options{.headers = {"idx", "value"}, .chunk_rows = 100}});
+    tee.AddBranch<LocalTextSinkFileSystem, TextWriterOptions>(
+        {.name = "tee", .path = (dir / "a").string(), .roll_options{.is_rotate = false}}, line);
+    tee.AddBranch<LocalTextSinkFileSystem, TextWriterOptions>(
+        {.name = "tee", .path = (dir / "b").string(), .roll_options{.max_rows_per_file = 3000}}, line);
+    // a slow branch drops its own records, the others get every record
+    auto &slow = tee.AddBranch<SlowLineFileSystem>({.name = "tee",
+                                                    .path = (dir / "slow").string(),
+                                                    .roll_options{.is_rotate = false},
+                                                    .queue_options{.capacity = 10,
+                                                                   .policy = OverflowPolicy::DROP_NEWEST}},
+                                                   line);
+    ASSERT_THROW(tee.AddBranch<LocalTextSinkFileSystem>({.name = "raw"}), std::invalid_argument);
+    ASSERT_EQ(tee.Branches(), 4);
+    for (int i = 0; i < kRows; ++i) {
+      if (tee.Write(CsvRow{std::to_string(i), i % 10 ? "v" : "a,b"}) == WriteStatus::DROPPED) ++dropped;
+    }
+    tee.Close();
+    ASSERT_GT(dropped, 0);
+    ASSERT_EQ(slow.DropStats().dropped_newest, dropped);
+    ASSERT_EQ(tee.Write(CsvRow{"closed", "v"}), WriteStatus::STOPPED);
+  }
+  // every record is encoded once for all branches of the encoding
+  ASSERT_EQ(encoded, kRows);
+
+  auto read_lines = [&dir](const char *sub, bool header) {
+    std::map<int, std::string> lines;
+    for (auto &entry : std::filesystem::directory_iterator(dir / sub)) {
+      std::ifstream ifs(entry.path());
+      std::string line;
+      if (header) {
+        std::getline(ifs, line);
+        EXPECT_EQ(line, "idx,value");
+      }
+      while (std::getline(ifs, line)) lines.emplace(std::stoi(line), line);
+    }
+    return lines;
+  };
+  for (auto [sub, header] : {std::pair{"csv", true}, {"a", false}, {"b", false}}) {
+    auto lines = read_lines(sub, header);
+    ASSERT_EQ(lines.size(), kRows) << sub;
+    for (auto &[i, line] : lines) ASSERT_EQ(line, std::to_string(i) + (i % 10 ? ",v" : ",\"a,b\"")) << sub;
+  }
+  ASSERT_EQ(read_lines("slow", false).size(), kRows - dropped);
+}
+
+TEST(Sink, CsvFlatRow) {
+  CsvFlatRow row{"a", "", "c,d"};
+  row.Append(12).Append(1.5);
+  ASSERT_EQ(row.size(), 5);
+  ASSERT_EQ(row[1], "");
+  ASSERT_EQ(row[2], "c,d");
+  ASSERT_EQ(row[3], "12");
+  ASSERT_EQ(row.ToRow(), (CsvRow{"a", "", "c,d", "12", "1.5"}));
+  ASSERT_EQ(CsvFlatRow(CsvRow{"x", "y"}).ToRow(), (CsvRow{"x", "y"}));
+}
+
+TEST(Sink, CsvFlat) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_csv_flat";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  constexpr int kRows = 10000;
+  {
+    CsvFlatSink::Options options{.name = "flat",
+                                 .path = dir.string(),
+                                 .name_options{.suffix = "csv"},
+                                 .roll_options{.is_rotate = false},
+                                 .ofs_options{.headers = {"idx", "value"}}};
+    CsvFlatSink s(std::move(options));
+    for (int i = 0; i < kRows; ++i) {
+      auto row = CsvFlatRowPool::Instance().Acquire();
+      row.Append(i).Append("v");
+      s.Write(std::move(row));
+    }
+    s.Write(CsvRow{"row", "v"});
+  }
+
+  std::ifstream ifs(std::filesystem::directory_iterator(dir)->path());
+  std::string line;
+  std::getline(ifs, line);
+  ASSERT_EQ(line, "idx,value");
+  for (int i = 0; i < kRows; ++i) {
+    ASSERT_TRUE(std::getline(ifs, line));
+    ASSERT_EQ(line, std::to_string(i) + ",v");
+  }
+  ASSERT_TRUE(std::getline(ifs, line));
+  ASSERT_EQ(line, "row,v");
+}
+
+TEST(Sink, CsvCompressed) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_csv_compressed";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::string expected = "a,b\n";
+  {
+    CsvSink::Options options{.name = "compressed",
+                             .path = dir.string(),
+                             .roll_options{.is_rotate = false},
+                             .ofs_options{
+                                 .headers = {"a", "b"},
+                                 .chunk_rows = 100,
+                                 .compression{.type = Compression::GZIP},
+                             }};
+    options.name_options.suffix = "csv";
+    CsvSink s(std::move(options));
+    for (int i = 0; i < 5000; ++i) {
+      s.Write(CsvRow{std::to_string(i), "v,"});
+      expected += std::to_string(i) + ",\"v,\"\n";
+    }
+  }
+  std::vector<std::filesystem::path> files;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) files.emplace_back(entry.path());
+  ASSERT_EQ(files.size(), 1);
+  ASSERT_TRUE(files[0].string().ends_with(".csv.gz"));
+  auto gz = gzopen(files[0].c_str(), "rb");
+  ASSERT_TRUE(gz);
+  std::string content;
+  char buf[64 * 1024];
+  int n;
+  while ((n = gzread(gz, buf, sizeof(buf))) > 0) content.append(buf, n);
+  gzclose(gz);
+  ASSERT_EQ(content, expected);
+}
+
+TEST(Sink, CsvBytesRoll) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_csv_bytes_roll";
+  constexpr int64_t kMaxBytes = 16 * 1024;
+  constexpr int kRows = 20000;
+  for (auto compression : {Compression::NONE, Compression::GZIP}) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    {
+      CsvSink::Options options{.name = "bytes",
+                               .path = dir.string(),
+                               .roll_options{.max_bytes_per_file = kMaxBytes},
+                               .ofs_options{
+                                   .headers = {"a", "b"},
+                                   .chunk_rows = 100,
+                                   .compression{.type = compression},
+                               }};
+      options.name_options.suffix = "csv";
+      CsvSink s(std::move(options));
+      // quoted fields are longer than the raw ones
+      for (int i = 0; i < kRows; ++i) s.Write(CsvRow{std::to_string(i), "v,"});
+    }
+    // bytes of the files are counted, formatted and compressed, only the last file is below the limit
+    size_t rows = 0, small = 0, files = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+      auto size = static_cast<int64_t>(entry.file_size());
+      if (size < kMaxBytes) ++small;
+      EXPECT_LE(size, kMaxBytes + 2048) << entry.path();
+      std::string content;
+      if (compression == Compression::GZIP) {
+        auto gz = gzopen(entry.path().c_str(), "rb");
+        ASSERT_TRUE(gz);
+        char buf[64 * 1024];
+        int n;
+        while ((n = gzread(gz, buf, sizeof(buf))) > 0) content.append(buf, n);
+        gzclose(gz);
+      } else {
+        std::ifstream ifs(entry.path());
+        content.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+      }
+      ASSERT_TRUE(content.starts_with("a,b\n")) << entry.path();
+      rows += std::count(content.begin(), content.end(), '\n') - 1;
+      ++files;
+    }
+    EXPECT_GT(files, 1);
+    EXPECT_LE(small, 1);
+    EXPECT_EQ(rows, kRows);
+  }
+}
+
+TEST(Sink, CsvReplay) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_csv_replay";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  constexpr int kRows = 20000;
+  CsvSink::Options options{.name = "replay",
+                           .path = dir.string(),
+                           .name_options{.suffix = "csv"},
+                           .roll_options{.max_rows_per_file = 1000},
+                           .ofs_options{.headers = {"idx", "value"}}};
+  auto replay_options = ReplayOptionsOf(options);
+  {
+    CsvSink s(std::move(options));
+    for (int i = 0; i < kRows; ++i) {
+      s.Write(CsvRow{std::to_string(i), i % 10 ? "v" : "a,\"b\"\nc"});
+    }
+    CsvSink other({.name = "replay_other", .path = dir.string(), .name_options{.suffix = "csv"}});
+    other.Write(CsvRow{"other"});
+  }
+
+  replay_options.threads = 4;
+  replay_options.max_pending_batches = 2;
+  {
+    CsvReplayReader reader(replay_options);
+    ASSERT_EQ(reader.Files().size(), kRows / 1000);
+    int next = 0;
+    auto rows = reader.Run([&next](CsvReplayReader::Batch &&batch) {
+      for (auto &row : batch.rows) {
+        ASSERT_EQ(row, (CsvRow{std::to_string(next), next % 10 ? "v" : "a,\"b\"\nc"}));
+        ++next;
+      }
+    });
+    ASSERT_EQ(rows, kRows);
+    ASSERT_EQ(next, kRows);
+  }
+
+  replay_options.ordered = false;
+  {
+    CsvReplayReader reader(replay_options);
+    std::atomic<int> rows{0};
+    ASSERT_EQ(reader.Run([&rows](CsvReplayReader::Batch &&batch) { rows += batch.rows.size(); }), kRows);
+    ASSERT_EQ(rows, kRows);
+  }
+
+  // nothing was written in the range
+  replay_options.end_ms = 1000;
+  ASSERT_TRUE(CsvReplayReader(replay_options).Files().empty());
+}
@@ -5,23 +5,70 @@
 #include <arrow/result.h>
 #include <arrow/status.h>
 #include <arrow/type_fwd.h>
+#include <arrow/util/compression.h>
 #include <parquet/arrow/writer.h>
+#include <parquet/file_reader.h>
+#include <parquet/metadata.h>
 #include <spdlog/spdlog.h>
 
+#include <filesystem>
+#include <fstream>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "arrow/record_batch.h"
+#include "cppcommon/objectstorage/sink/arrow_row_sink.h"
 #include "cppcommon/objectstorage/sink/base_sink.h"
 #include "cppcommon/objectstorage/sink/local_arrow_sink.h"
+#include "cppcommon/objectstorage/sink/parquet_compactor.h"
+#include "cppcommon/objectstorage/utils/arrow_utils.h"
 #include "cppcommon/utils/os.h"
 #include "gtest/gtest.h"
 
 using namespace cppcommon;
 using namespace cppcommon::os;
 
+struct Trade {
+  std::string symbol;
+  double price;
+  int64_t qty;
+  std::optional<int32_t> flag;
+};
+
+template <>
+struct cppcommon::os::ArrowRowSchema<Trade> {
+  static constexpr auto kFields =
+      std::make_tuple(ArrowField{"symbol", &Trade::symbol}, ArrowField{"price", &Trade::price},
+                      ArrowField{"qty", &Trade::qty}, ArrowField{"flag", &Trade::flag});
+};
+
+// quantity column failing to append negative values
+struct Qty {
+  int64_t value;
+};
+
+template <>
+struct cppcommon::os::ArrowColumnTraits<Qty> : ArrowColumnTraits<int64_t> {
+  static inline arrow::Status Append(BuilderType &builder, const Qty &qty) {
+    if (qty.value < 0) return arrow::Status::Invalid("negative qty");
+    return builder.Append(qty.value);
+  }
+};
+
+struct Order {
+  std::string id;
+  Qty qty;
+};
+
+template <>
+struct cppcommon::os::ArrowRowSchema<Order> {
+  static constexpr auto kFields = std::make_tuple(ArrowField{"id", &Order::id}, ArrowField{"qty", &Order::qty});
+};
+
 std::shared_ptr<arrow::RecordBatch> GenRecordBatch() {
   arrow::StringBuilder sb_a;
   arrow::StringBuilder sb_b;
@@ -218,6 +265,165 @@ TEST(Sink, PmrbV2) {
   }
 }
 
+TEST(Sink, ParquetRowGroupBytes) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_row_group";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto record = GenRecordBatchV2();
+  auto record_bytes = static_cast<int64_t>(RecordByteSize<std::shared_ptr<arrow::RecordBatch>>{}(record));
+  auto compression = arrow::util::Codec::IsAvailable(arrow::Compression::GZIP) ? arrow::Compression::GZIP
+                                                                                 : arrow::Compression::UNCOMPRESSED;
+
+  constexpr int kWrites = 1000;
+  {
+    LocalArrowRecordBatchSink s({.name = "table",
+                                 .path = dir.string(),
+                                 .name_options{.suffix = "parquet"},
+                                 .roll_options{.is_rotate = false},
+                                 .ofs_options{.parquet{.compression = compression,
+                                                       .dictionary = false,
+                                                       .data_page_size = 64 * 1024,
+                                                       .row_group_bytes = record_bytes * 100}}});
+    for (int i = 0; i < kWrites; ++i) {
+      s.Write(record);
+    }
+  }
+
+  auto reader = parquet::ParquetFileReader::OpenFile(std::filesystem::directory_iterator(dir)->path().string());
+  auto metadata = reader->metadata();
+  EXPECT_EQ(metadata->num_rows(), kWrites * record->num_rows());
+  EXPECT_GE(metadata->num_row_groups(), kWrites / 100);
+  EXPECT_EQ(metadata->RowGroup(0)->ColumnChunk(0)->compression(), compression);
+}
+
+TEST(Sink, ParquetCompactor) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_compactor";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto record = GenRecordBatchV2();
+
+  ParquetCompactor compactor({.bytes_per_second = 0});
+  constexpr int kWrites = 1000;
+  {
+    LocalArrowRecordBatchSinkV1 s({.name = "table",
+                                   .path = dir.string(),
+                                   .name_options{.suffix = "parquet"},
+                                   .roll_options{.is_rotate = true, .max_rows_per_file = 100},
+                                   .on_roll_callback = compactor.RollCallback()});
+    for (int i = 0; i < kWrites; ++i) {
+      s.Write(record);
+    }
+  }
+  auto count_files = [&dir] {
+    return std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator());
+  };
+  ASSERT_GT(count_files(), 1);
+  EXPECT_EQ(compactor.Compact(), 0);
+  EXPECT_EQ(compactor.Compact(true), 1);
+  ASSERT_EQ(count_files(), 1);
+
+  auto merged = std::filesystem::directory_iterator(dir)->path();
+  EXPECT_NE(merged.string().find(ParquetCompactor::kCompactedMark), std::string::npos);
+  auto reader = parquet::ParquetFileReader::OpenFile(merged.string());
+  EXPECT_EQ(reader->metadata()->num_rows(), kWrites * record->num_rows());
+  EXPECT_EQ(reader->metadata()->num_row_groups(), 1);
+}
+
+// names without a date are reused by a restarted sink, merges never replace merged files or remove new inputs
+TEST(Sink, ParquetCompactorRestart) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_compactor_restart";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto record = GenRecordBatchV2();
+  constexpr int kWrites = 100;
+  auto count_rows = [&dir] {
+    int64_t rows = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+      EXPECT_FALSE(entry.path().filename().string().starts_with(".")) << entry.path();
+      rows += parquet::ParquetFileReader::OpenFile(entry.path().string())->metadata()->num_rows();
+    }
+    return rows;
+  };
+
+  constexpr int kRuns = 3;
+  for (int run = 0; run < kRuns; ++run) {
+    ParquetCompactor compactor({.bytes_per_second = 0});
+    compactor.Watch(dir.string());
+    {
+      LocalArrowRecordBatchSinkV1 s({.name = "table",
+                                     .path = dir.string(),
+                                     .name_options{.name_with_date = true, .suffix = "parquet"},
+                                     .roll_options{.is_rotate = true, .max_rows_per_file = 10},
+                                     .on_roll_callback = compactor.RollCallback()});
+      for (int i = 0; i < kWrites; ++i) {
+        s.Write(record);
+      }
+    }
+    ASSERT_TRUE(std::filesystem::exists(dir / "table_0.parquet"));
+    EXPECT_EQ(compactor.Compact(true), 1);
+    EXPECT_EQ(count_rows(), (run + 1) * kWrites * record->num_rows());
+  }
+  EXPECT_TRUE(std::filesystem::exists(dir / "table_0.compacted.parquet"));
+  EXPECT_TRUE(std::filesystem::exists(dir / "table_0.1.compacted.parquet"));
+  EXPECT_TRUE(std::filesystem::exists(dir / "table_0.2.compacted.parquet"));
+
+  // a crash after the rename left a manifest, unchanged inputs are removed, replaced ones are kept
+  auto input = dir / "table_9.parquet";
+  std::filesystem::copy_file(dir / "table_0.compacted.parquet", input);
+  auto manifest = dir / ".table_9.compacted.parquet.compacting.manifest";
+  {
+    std::ofstream ofs(manifest);
+    ofs << std::filesystem::file_size(input) << '\t'
+        << std::filesystem::last_write_time(input).time_since_epoch().count() << "\ttable_9.parquet\n";
+    ofs << 1 << '\t' << 0 << "\ttable_0.1.compacted.parquet\n";
+  }
+  ParquetCompactor().Watch(dir.string());
+  EXPECT_FALSE(std::filesystem::exists(input));
+  EXPECT_FALSE(std::filesystem::exists(manifest));
+  EXPECT_EQ(count_rows(), kRuns * kWrites * record->num_rows());
+}
+
+TEST(Sink, ArrowIpc) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_ipc";
+  auto record = GenRecordBatchV2();
+  constexpr int kWrites = 1000;
+  for (auto compression : {arrow::Compression::UNCOMPRESSED, arrow::Compression::LZ4_FRAME}) {
+    if (!arrow::util::Codec::IsAvailable(compression)) continue;
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    {
+      LocalArrowIpcSink s({.name = "table",
+                           .path = dir.string(),
+                           .name_options{.suffix = "arrow"},
+                           .roll_options{.is_rotate = false},
+                           .ofs_options{.ipc{.compression = compression}}});
+      for (int i = 0; i < kWrites; ++i) {
+        s.Write(record);
+      }
+    }
+
+    auto batches = ReadMappedIpcFile(std::filesystem::directory_iterator(dir)->path().string()).ValueOrDie();
+    auto table = arrow::Table::FromRecordBatches(batches).ValueOrDie();
+    EXPECT_EQ(table->num_rows(), kWrites * record->num_rows());
+    EXPECT_TRUE(table->schema()->Equals(*record->schema()));
+    auto first = table->Slice(0, record->num_rows())->CombineChunksToBatch().ValueOrDie();
+    EXPECT_TRUE(first->Equals(*record));
+  }
+  // batches with combine_rows rows or more are written as they are
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  {
+    LocalArrowIpcSink s({.name = "table",
+                         .path = dir.string(),
+                         .name_options{.suffix = "arrow"},
+                         .roll_options{.is_rotate = false},
+                         .ofs_options{.ipc{.combine_rows = record->num_rows()}}});
+    for (int i = 0; i < kWrites; ++i) s.Write(record);
+  }
+  auto batches = ReadMappedIpcFile(std::filesystem::directory_iterator(dir)->path().string()).ValueOrDie();
+  EXPECT_EQ(batches.size(), static_cast<size_t>(kWrites));
+}
+
 TEST(Sink, CsvPm) {
   ArrowCsvLocalSink::Options options{
       .name = "table",
@@ -245,3 +451,108 @@ TEST(Sink, CsvPm) {
     t.join();
   }
 }
+
+// parquet and ipc rows are not durable before the footer is written, csv rows are synced
+TEST(Sink, ArrowDurable) {
+  auto dir = std::filesystem::temp_directory_path() / "cppcommon_sink_arrow_durable";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto record = GenRecordBatchV2();
+  LocalArrowRecordBatchSink parquet_sink({.name = "table", .path = dir.string(), .name_options{.suffix = "parquet"}});
+  EXPECT_EQ(parquet_sink.WriteDurable(record), WriteStatus::SYNC_FAILED);
+  LocalArrowIpcSink ipc_sink({.name = "table", .path = dir.string(), .name_options{.suffix = "arrow"}});
+  EXPECT_EQ(ipc_sink.WriteDurable(record), WriteStatus::SYNC_FAILED);
+  ArrowCsvLocalSink csv_sink({.name = "table", .path = dir.string(), .name_options{.suffix = "csv"}});
+  EXPECT_EQ(csv_sink.WriteDurable(record), WriteStatus::OK);
+}
+
+// bytes_written of an arrow sink is the size of its files once they are closed
+template <typename Sink>
+void ExpectArrowMetrics(const std::string &suffix) {
+  auto dir = std::filesystem::temp_directory_path() / ("cppcommon_sink_arrow_metrics_" + suffix);
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto record = GenRecordBatchV2();
+  Sink s({.name = "metrics",
+          .path = dir.string(),
+          .name_options{.suffix = suffix},
+          .roll_options{.max_rows_per_file = 500},
+          .close_in_threads = false});
+  for (int i = 0; i < 1000; ++i) s.Write(record);
+  s.Close();
+  uint64_t bytes = 0;
+  for (auto &entry : std::filesystem::directory_iterator(dir)) bytes += entry.file_size();
+  auto m = s.Metrics();
+  EXPECT_EQ(m.rows_written, static_cast<uint64_t>(1000 * record->num_rows())) << suffix;
+  EXPECT_GT(m.files_rolled, 1) << suffix;
+  EXPECT_GT(bytes, 0) << suffix;
+  EXPECT_EQ(m.bytes_written, bytes) << suffix;
+  EXPECT_NE(m.ToJson().find(fmt::format(R"("bytes_written":{},)", bytes)), std::string::npos) << suffix;
+}
+
+TEST(Sink, ArrowMetrics) {
+  ExpectArrowMetrics<LocalArrowRecordBatchSink>("parquet");
+  ExpectArrowMetrics<LocalArrowRecordBatchSinkV1>("parquet");
+  ExpectArrowMetrics<LocalArrowIpcSink>("arrow");
+  ExpectArrowMetrics<ArrowCsvLocalSink>("csv");
+}
+
+TEST(Sink, ArrowRow) {
+  auto schema = ArrowRowSink<Trade>::Schema();
+  ASSERT_EQ(schema->num_fields(), 4);
+  EXPECT_TRUE(schema->field(0)->type()->Equals(arrow::utf8()));
+  EXPECT_TRUE(schema->field(1)->type()->Equals(arrow::float64()));
+  EXPECT_TRUE(schema->field(2)->type()->Equals(arrow::int64()));
+  EXPECT_FALSE(schema->field(2)->nullable());
+  EXPECT_TRUE(schema->field(3)->nullable());
+
+  ArrowRowBatchBuilder<Trade> builder;
+  ASSERT_TRUE(builder.Append({"a", 1.0, 1, std::nullopt}).ok());
+  ASSERT_TRUE(builder.Append({"b", 2.0, 2, 7}).ok());
+  auto batch = builder.Finish().ValueOrDie();
+  EXPECT_EQ(batch->num_rows(), 2);
+  EXPECT_EQ(batch->column(3)->null_count(), 1);
+  EXPECT_EQ(builder.NumRows(), 0);
+
+  // the id of a failed row is not left in its column
+  ArrowRowBatchBuilder<Order> orders;
+  ASSERT_TRUE(orders.Append({"a", {1}}).ok());
+  ASSERT_FALSE(orders.Append({"b", {-1}}).ok());
+  ASSERT_TRUE(orders.Append({"c", {3}}).ok());
+  ASSERT_FALSE(orders.Append({"d", {-1}}).ok());
+  ASSERT_TRUE(orders.Append({"e", {5}}).ok());
+  EXPECT_EQ(orders.NumRows(), 3);
+  auto order_batch = orders.Finish().ValueOrDie();
+  ASSERT_TRUE(order_batch->ValidateFull().ok());
+  ASSERT_EQ(order_batch->num_rows(), 3);
+  auto ids = std::static_pointer_cast<arrow::StringArray>(order_batch->column(0));
+  auto qtys = std::static_pointer_cast<arrow::Int64Array>(order_batch->column(1));
+  for (int64_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(ids->GetString(i), std::string(1, static_cast<char>('a' + 2 * i)));
+    EXPECT_EQ(qtys->Value(i), 1 + 2 * i);
+  }
+  ASSERT_TRUE(orders.Append({"f", {6}}).ok());
+  EXPECT_EQ(orders.Finish().ValueOrDie()->num_rows(), 1);
+
+  ArrowRowSink<Trade> s({.name = "trade", .name_options{.suffix = "parquet"}}, {.batch_rows = 4096});
+
+  constexpr int kThreadCount = 8;
+  constexpr int kWritesPerThread = 10000 * 5 + 10;
+
+  auto writer = [&] {
+    for (int i = 0; i < kWritesPerThread; ++i) {
+      s.Write({"AAPL", 1.0 * i, i, i % 2 ? std::optional<int32_t>(i) : std::nullopt});
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreadCount; ++i) {
+    threads.emplace_back(writer);
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  s.Close();
+  EXPECT_EQ(s.Write({"AAPL", 1.0, 1, std::nullopt}), WriteStatus::STOPPED);
+}
@@ -4,10 +4,12 @@
 #include <aws/s3/model/PutObjectRequest.h>
 #include <spdlog/spdlog.h>
 
+#include <cstdlib>
 #include <string>
 
 #include "absl/status/statusor.h"
 #include "cppcommon/io/file/rw.h"
+#include "cppcommon/objectstorage/sink/local_text_sink.h"
 #include "cppcommon/objectstorage/transfor/api.h"
 #include "cppcommon/objectstorage/transfor/storage_provider.h"
 #include "cppcommon/utils/to_str.h"
@@ -44,3 +46,33 @@ TEST(Trans, S3) {
 
   Aws::ShutdownAPI(options);
 }
+
+// e.g. against MinIO: AWS_ENDPOINT=http://127.0.0.1:9000 AWS_S3_PATH_STYLE=true S3_BUCKET=test
+TEST(Trans, S3Stream) {
+  if (!std::getenv("S3_BUCKET")) GTEST_SKIP() << "S3_BUCKET is not set";
+  Aws::SDKOptions options;
+  Aws::InitAPI(options);
+  {
+    std::string bucket = std::getenv("S3_BUCKET");
+    auto tr = NewObjectTransfor(cppcommon::os::ServiceProvider::S3);
+    std::string expected;
+    {
+      cppcommon::os::LocalBasicSink s(
+          {.name = "stream",
+           .path = "s3://" + bucket + "/test/stream",
+           .roll_options{.is_rotate = false},
+           .ofs_options{.file{.type = cppcommon::os::FileBackend::OBJECT, .object{.provider = tr}}}});
+      for (int i = 0; i < 1000000; ++i) {
+        s.Write("stream line " + std::to_string(i));
+        expected += "stream line " + std::to_string(i) + "\n";
+      }
+    }
+    auto r = tr->List(bucket, "test/stream/");
+    ASSERT_TRUE(r.ok());
+    ASSERT_FALSE(r->empty());
+    auto s = tr->DownloadFile({.bucket = bucket, .remote_file_path = r->back(), .local_file_path = "output/stream"});
+    ASSERT_TRUE(s.ok()) << s.ToString();
+    EXPECT_EQ(cppcommon::ReadFile("output/stream"), expected);
+  }
+  Aws::ShutdownAPI(options);
+}
@@ -1,4 +1,7 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <thread>
 
 #include "cppcommon/utils/time.h"
 #include "gtest/gtest.h"
@@ -56,3 +59,20 @@ TEST(Time, Fmt) {
   f = di.Format("%Y-%m-%d %H:%M:%S");
   std::cout << f << std::endl;
 }
+
+TEST(Time, CoarseClock) {
+  cppcommon::CoarseClock clock(std::chrono::milliseconds(1));
+  auto now = cppcommon::CurrentTsMs();
+  ASSERT_LE(std::abs(clock.NowMs() - now), 50);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_GT(clock.NowMs(), now);
+
+  auto date = clock.Date();
+  auto di = cppcommon::GetDateInfo(date->second * 1000);
+  ASSERT_EQ(date->second_str, di.Format("%Y%m%d_%H%M%S"));
+  ASSERT_EQ(date->hour_str, di.Format("%Y%m%d%H"));
+  ASSERT_EQ(date->day_str, di.Format("%Y%m%d"));
+
+  auto &shared = cppcommon::CoarseClock::Instance();
+  ASSERT_LE(std::abs(shared.NowMs() - cppcommon::CurrentTsMs()), 50);
+}